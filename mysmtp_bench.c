@@ -0,0 +1,544 @@
+/*
+=====================================
+Assignment 6 Submission
+Name: Praveen Kumar
+Roll number: 22CS10054
+=====================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdint.h>
+
+#define BUFFER_SIZE 4096
+#define HISTOGRAM_SUB_BITS 4 // 16 buckets per power of two, about 6% resolution
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Measured commands
+#define CMD_CONNECT 0
+#define CMD_HELO 1
+#define CMD_MAIL 2
+#define CMD_RCPT 3
+#define CMD_DATA 4
+#define CMD_SEND 5 // The message body and terminating '.'
+#define CMD_LIST 6
+#define CMD_GET_MAIL 7
+#define CMD_QUIT 8
+#define CMD_COUNT 9
+
+// Operations in the mix
+#define OP_SEND 0 // MAIL FROM, RCPT TO (fan-out times), DATA, body
+#define OP_LIST 1
+#define OP_GET 2
+#define OP_COUNT 3
+
+// Latency histogram for one command
+typedef struct {
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long errors;
+    unsigned long max;
+} Histogram;
+
+// Per-connection worker state; results are merged after all workers finish
+typedef struct {
+    int index;
+    unsigned int seed;
+    unsigned long operations;
+    unsigned long messages_sent;
+    int failed;
+    int *seen;           // Highest ID listed so far in each mailbox
+    Histogram commands[CMD_COUNT];
+} Worker;
+
+// Functions shared with mysmtp_client.c
+int connect_to_server(const char *server_ip, int port);
+void send_command(int socket, const char *command);
+char *receive_response(int socket);
+int receive_line(int socket, char *line, size_t size);
+
+// Benchmark
+void *run_worker(void *arg);
+int run_operation(Worker *worker, int sock, int op);
+int timed_command(Worker *worker, int sock, int cmd, const char *command);
+int receive_get_mail(int sock);
+int receive_listing(int sock, int *last_id);
+int pick_operation(Worker *worker);
+int parse_mix(const char *mix);
+void build_message();
+int send_all(int sock, const char *data, size_t len);
+void record(Histogram *histogram, uint32_t latency_us, int ok);
+uint32_t elapsed_us(const struct timespec *started);
+double elapsed_seconds(const struct timespec *started);
+int histogram_bucket(uint32_t value);
+unsigned long histogram_bucket_value(int bucket);
+unsigned long histogram_percentile(const Histogram *histogram, double percentile);
+void print_report(Worker *workers, double seconds);
+void print_usage(const char *prog);
+
+// Global variables
+const char *server_ip;
+int server_port;
+int connections = 8;
+int duration = 10;
+unsigned long operations_per_connection = 0; // Run for a count instead of a duration
+size_t message_size = 1024;
+int fan_out = 1;
+int mailboxes = 100;
+int mix[OP_COUNT] = {70, 20, 10};
+char *message;           // Dot-terminated body sent after DATA
+size_t message_len;
+struct timespec deadline;
+const char *command_names[CMD_COUNT] = {
+    "CONNECT", "HELO", "MAIL", "RCPT", "DATA", "SEND", "LIST", "GET_MAIL", "QUIT"
+};
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"count", required_argument, NULL, 'n'},
+        {"size", required_argument, NULL, 's'},
+        {"fan-out", required_argument, NULL, 'f'},
+        {"mailboxes", required_argument, NULL, 'b'},
+        {"mix", required_argument, NULL, 'x'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt_char;
+    while ((opt_char = getopt_long(argc, argv, "c:d:n:s:f:b:x:h", long_options, NULL)) != -1) {
+        switch (opt_char) {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            operations_per_connection = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            message_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            fan_out = atoi(optarg);
+            break;
+        case 'b':
+            mailboxes = atoi(optarg);
+            break;
+        case 'x':
+            if (parse_mix(optarg) != 0) {
+                fprintf(stderr, "Invalid mix: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 2 || connections <= 0 || duration <= 0 || fan_out <= 0 || mailboxes <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    server_ip = argv[optind];
+    server_port = atoi(argv[optind + 1]);
+
+    build_message();
+
+    Worker *workers = calloc(connections, sizeof(Worker));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    if (!workers || !threads || !message) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    deadline = started;
+    deadline.tv_sec += duration;
+
+    printf("Running %d connections against %s:%d for ", connections, server_ip, server_port);
+    if (operations_per_connection) {
+        printf("%lu operations each", operations_per_connection);
+    } else {
+        printf("%d seconds", duration);
+    }
+    printf(" (mix send=%d list=%d get=%d, %zu byte messages, fan-out %d over %d mailboxes)\n",
+           mix[OP_SEND], mix[OP_LIST], mix[OP_GET], message_size, fan_out, mailboxes);
+
+    for (int i = 0; i < connections; i++) {
+        workers[i].index = i;
+        workers[i].seed = time(NULL) ^ (i * 2654435761u);
+        if (pthread_create(&threads[i], NULL, run_worker, &workers[i]) != 0) {
+            perror("Error creating thread");
+            return 1;
+        }
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    print_report(workers, elapsed_seconds(&started));
+
+    for (int i = 0; i < connections; i++) {
+        free(workers[i].seen);
+    }
+    free(threads);
+    free(workers);
+    free(message);
+    return 0;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <server_ip> <port>\n"
+                    "  -c, --connections N    concurrent connections (default 8)\n"
+                    "  -d, --duration SEC     run time in seconds (default 10)\n"
+                    "  -n, --count N          operations per connection instead of a duration\n"
+                    "  -s, --size BYTES       message body size (default 1024)\n"
+                    "  -f, --fan-out N        recipients per message (default 1)\n"
+                    "  -b, --mailboxes N      distinct mailboxes to spread over (default 100)\n"
+                    "  -x, --mix S,L,G        weights of send/LIST/GET_MAIL operations (default 70,20,10)\n",
+            prog);
+}
+
+int parse_mix(const char *text) {
+    int weights[OP_COUNT];
+    if (sscanf(text, "%d,%d,%d", &weights[OP_SEND], &weights[OP_LIST], &weights[OP_GET]) != 3) {
+        return -1;
+    }
+    int total = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (weights[i] < 0) return -1;
+        total += weights[i];
+    }
+    if (total == 0) return -1;
+    memcpy(mix, weights, sizeof(mix));
+    return 0;
+}
+
+void build_message() {
+    // Lines of 'x' (so no dot-stuffing is needed) followed by the terminator
+    message = malloc(message_size + 8);
+    if (!message) return;
+
+    size_t len = 0;
+    while (len < message_size) {
+        size_t line = message_size - len < 78 ? message_size - len : 78;
+        memset(message + len, 'x', line);
+        len += line;
+        if (len < message_size) {
+            message[len - 2] = '\r';
+            message[len - 1] = '\n';
+        }
+    }
+    memcpy(message + len, "\r\n.\r\n", 5);
+    message_len = len + 5;
+}
+
+void *run_worker(void *arg) {
+    Worker *worker = arg;
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int sock = connect_to_server(server_ip, server_port);
+    if (sock < 0) {
+        record(&worker->commands[CMD_CONNECT], 0, 0);
+        worker->failed = 1;
+        return NULL;
+    }
+
+    // The greeting completes the connection
+    char *response = receive_response(sock);
+    record(&worker->commands[CMD_CONNECT], elapsed_us(&started), response && response[0] == '2');
+    free(response);
+
+    worker->seen = calloc(mailboxes, sizeof(int));
+    if (!worker->seen) {
+        perror("Memory allocation failed");
+        worker->failed = 1;
+        close(sock);
+        return NULL;
+    }
+
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "HELO bench%d", worker->index);
+    if (timed_command(worker, sock, CMD_HELO, command) != 0) {
+        worker->failed = 1;
+        close(sock);
+        return NULL;
+    }
+
+    while (1) {
+        if (operations_per_connection) {
+            if (worker->operations >= operations_per_connection) break;
+        } else {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > deadline.tv_sec ||
+                (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+                break;
+            }
+        }
+
+        if (run_operation(worker, sock, pick_operation(worker)) < 0) {
+            // The connection is gone
+            worker->failed = 1;
+            close(sock);
+            return NULL;
+        }
+        worker->operations++;
+    }
+
+    timed_command(worker, sock, CMD_QUIT, "QUIT");
+    close(sock);
+    return NULL;
+}
+
+int pick_operation(Worker *worker) {
+    int total = mix[OP_SEND] + mix[OP_LIST] + mix[OP_GET];
+    int r = rand_r(&worker->seed) % total;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (r < mix[op]) return op;
+        r -= mix[op];
+    }
+    return OP_SEND;
+}
+
+int run_operation(Worker *worker, int sock, int op) {
+    // Returns -1 if the connection failed, 0 otherwise (server errors are only counted)
+    char command[BUFFER_SIZE];
+    int mailbox = rand_r(&worker->seed) % mailboxes;
+
+    // IDs to fetch come from listings: take the next mailbox that has shown
+    // some, or list this one if none has yet
+    if (op == OP_GET) {
+        int tries = 0;
+        while (worker->seen[mailbox] == 0 && ++tries < mailboxes) mailbox = (mailbox + 1) % mailboxes;
+        if (worker->seen[mailbox] == 0) op = OP_LIST;
+    }
+
+    if (op == OP_LIST) {
+        // Poll like a client that only wants what arrived since its last listing
+        snprintf(command, sizeof(command), "LIST user%d@bench SINCE %d", mailbox, worker->seen[mailbox]);
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        send_command(sock, command);
+        int status = receive_listing(sock, &worker->seen[mailbox]);
+        if (status < 0) return -1;
+        record(&worker->commands[CMD_LIST], elapsed_us(&started), status == 0);
+        return 0;
+    }
+
+    if (op == OP_GET) {
+        // Pick an ID a listing has shown to exist
+        snprintf(command, sizeof(command), "GET_MAIL user%d@bench %d",
+                 mailbox, rand_r(&worker->seed) % worker->seen[mailbox] + 1);
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        send_command(sock, command);
+        int status = receive_get_mail(sock);
+        if (status < 0) return -1;
+        record(&worker->commands[CMD_GET_MAIL], elapsed_us(&started), status == 0);
+        return 0;
+    }
+
+    snprintf(command, sizeof(command), "MAIL FROM: bench%d@bench", worker->index);
+    if (timed_command(worker, sock, CMD_MAIL, command) < 0) return -1;
+
+    for (int i = 0; i < fan_out; i++) {
+        snprintf(command, sizeof(command), "RCPT TO: user%d@bench", (mailbox + i) % mailboxes);
+        if (timed_command(worker, sock, CMD_RCPT, command) < 0) return -1;
+    }
+
+    if (timed_command(worker, sock, CMD_DATA, "DATA") < 0) return -1;
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (send_all(sock, message, message_len) < 0) return -1;
+    char *response = receive_response(sock);
+    if (!response || response[0] == '\0') {
+        free(response);
+        return -1;
+    }
+    int ok = response[0] == '2';
+    record(&worker->commands[CMD_SEND], elapsed_us(&started), ok);
+    free(response);
+    if (ok) worker->messages_sent++;
+    return 0;
+}
+
+int timed_command(Worker *worker, int sock, int cmd, const char *command) {
+    // Returns -1 if the connection failed, 1 on an error reply, 0 on success
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    send_command(sock, command);
+    char *response = receive_response(sock);
+    if (!response || response[0] == '\0') {
+        free(response);
+        return -1;
+    }
+
+    int ok = response[0] == '2' || response[0] == '3';
+    record(&worker->commands[cmd], elapsed_us(&started), ok);
+    free(response);
+    return ok ? 0 : 1;
+}
+
+int receive_get_mail(int sock) {
+    // Reads "200 OK <length>" and discards the body. Returns -1 if the
+    // connection failed, 1 on an error reply, 0 on success.
+    char header[BUFFER_SIZE];
+    if (receive_line(sock, header, sizeof(header)) <= 0) return -1;
+
+    unsigned long remaining;
+    if (sscanf(header, "200 OK %lu", &remaining) != 1) return 1;
+
+    char buffer[BUFFER_SIZE];
+    while (remaining > 0) {
+        size_t chunk = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        ssize_t n = recv(sock, buffer, chunk, 0);
+        if (n <= 0) return -1;
+        remaining -= n;
+    }
+    return 0;
+}
+
+int receive_listing(int sock, int *last_id) {
+    // Reads "200 OK <n> <total>" and its n lines, remembering the last ID.
+    // Returns -1 if the connection failed, 1 on an error reply, 0 on success.
+    char line[BUFFER_SIZE];
+    if (receive_line(sock, line, sizeof(line)) <= 0) return -1;
+
+    int lines, total;
+    if (sscanf(line, "200 OK %d %d", &lines, &total) != 2) return 1;
+
+    for (int i = 0; i < lines; i++) {
+        if (receive_line(sock, line, sizeof(line)) <= 0) return -1;
+        sscanf(line, "%d:", last_id);
+    }
+    return 0;
+}
+
+int send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            perror("Error sending data");
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+void record(Histogram *histogram, uint32_t latency_us, int ok) {
+    if (!ok) {
+        histogram->errors++;
+        return;
+    }
+    histogram->buckets[histogram_bucket(latency_us)]++;
+    histogram->count++;
+    if (latency_us > histogram->max) histogram->max = latency_us;
+}
+
+uint32_t elapsed_us(const struct timespec *started) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started->tv_sec) * 1000000 + (now.tv_nsec - started->tv_nsec) / 1000;
+}
+
+double elapsed_seconds(const struct timespec *started) {
+    // The whole run, which may outlast the 71 minutes elapsed_us() can count
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+}
+
+int histogram_bucket(uint32_t value) {
+    // Same log-linear buckets as the server's STATS histograms
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+    int exponent = 31 - __builtin_clz(value);
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    int sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+unsigned long histogram_bucket_value(int bucket) {
+    // Highest value that falls into the bucket
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    unsigned long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+unsigned long histogram_percentile(const Histogram *histogram, double percentile) {
+    if (histogram->count == 0) return 0;
+    unsigned long rank = (unsigned long)(histogram->count * percentile / 100.0);
+    if (rank >= histogram->count) rank = histogram->count - 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen > rank) {
+            // The bucket's upper bound may lie above anything recorded
+            unsigned long value = histogram_bucket_value(b);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return 0;
+}
+
+void print_report(Worker *workers, double seconds) {
+    Histogram total[CMD_COUNT];
+    memset(total, 0, sizeof(total));
+    unsigned long operations = 0;
+    unsigned long messages = 0;
+    int failed = 0;
+
+    for (int i = 0; i < connections; i++) {
+        operations += workers[i].operations;
+        messages += workers[i].messages_sent;
+        failed += workers[i].failed;
+        for (int c = 0; c < CMD_COUNT; c++) {
+            Histogram *from = &workers[i].commands[c];
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                total[c].buckets[b] += from->buckets[b];
+            }
+            total[c].count += from->count;
+            total[c].errors += from->errors;
+            if (from->max > total[c].max) total[c].max = from->max;
+        }
+    }
+
+    printf("\n%.2f s, %lu operations (%.1f/s), %lu messages stored (%.1f/s, %.2f MB/s), "
+           "%d connections failed\n\n",
+           seconds, operations, operations / seconds, messages, messages / seconds,
+           messages * message_size / seconds / (1024 * 1024), failed);
+
+    printf("%-10s %10s %8s %10s %8s %8s %8s %8s %8s\n",
+           "command", "count", "errors", "per_sec", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+    for (int c = 0; c < CMD_COUNT; c++) {
+        if (total[c].count == 0 && total[c].errors == 0) continue;
+        printf("%-10s %10lu %8lu %10.1f %8lu %8lu %8lu %8lu %8lu\n",
+               command_names[c], total[c].count, total[c].errors, total[c].count / seconds,
+               histogram_percentile(&total[c], 50.0),
+               histogram_percentile(&total[c], 90.0),
+               histogram_percentile(&total[c], 99.0),
+               histogram_percentile(&total[c], 99.9),
+               total[c].max);
+    }
+}
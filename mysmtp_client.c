@@ -23,6 +23,12 @@ Roll number: 22CS10054
 int connect_to_server(const char *server_ip, int port);
 void send_command(int socket, const char *command);
 char *receive_response(int socket);
+int receive_line(int socket, char *line, size_t size);
+void receive_email(int socket);
+void receive_batch(int socket);
+int receive_body(int socket, unsigned long bytes, unsigned long length, int compressed);
+void receive_list(int socket);
+ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap);
 void handle_data_command(int socket);
 void print_help();
 
@@ -42,6 +48,8 @@ void handle_sigint(int sig) {
     exit(0);
 }
 
+// mysmtp_bench links against the functions below and supplies its own main()
+#ifndef MYSMTP_BENCH
 int main(int argc, char *argv[]) {
     if (argc != 3) {
         fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
@@ -102,9 +110,35 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
+        // A plain LIST reply has no line count to read up to, so ask for the
+        // whole mailbox in the counted SINCE form instead
+        char list_email[256], list_option[16];
+        int list_args = sscanf(command, "LIST %255s %15s", list_email, list_option);
+        if (list_args == 1) {
+            snprintf(command, BUFFER_SIZE, "LIST %s SINCE 0", list_email);
+        }
+
         // Send command to server
         send_command(server_socket, command);
 
+        // GET_MAIL replies carry a byte count and may be larger than one read;
+        // a range of IDs comes back as a count of framed emails
+        int range_end;
+        if (sscanf(command, "GET_MAIL %*s %*d-%d", &range_end) == 1) {
+            receive_batch(server_socket);
+            continue;
+        }
+        if (strncmp(command, "GET_MAIL", 8) == 0) {
+            receive_email(server_socket);
+            continue;
+        }
+
+        // Every listing is sent in a form that announces its line count
+        if (list_args >= 1 || strncmp(command, "SEARCH ", 7) == 0) {
+            receive_list(server_socket);
+            continue;
+        }
+
         // Receive and display response
         response = receive_response(server_socket);
         printf("%s", response);
@@ -121,6 +155,7 @@ int main(int argc, char *argv[]) {
     close(server_socket);
     return 0;
 }
+#endif
 
 int connect_to_server(const char *server_ip, int port) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -178,6 +213,192 @@ char *receive_response(int socket) {
     return response;
 }
 
+int receive_line(int socket, char *line, size_t size) {
+    // Read a single CRLF-terminated line without consuming anything after it
+    size_t len = 0;
+    while (len < size - 1) {
+        char c;
+        ssize_t n = recv(socket, &c, 1, 0);
+        if (n <= 0) {
+            if (n < 0) perror("Error receiving response");
+            return -1;
+        }
+        line[len++] = c;
+        if (c == '\n') break;
+    }
+    line[len] = '\0';
+    return len;
+}
+
+void receive_list(int socket) {
+    // "200 OK <n> <total>" is followed by exactly <n> lines
+    char line[BUFFER_SIZE];
+    if (receive_line(socket, line, sizeof(line)) < 0) {
+        return;
+    }
+    printf("%s", line);
+
+    int lines, total;
+    if (sscanf(line, "200 OK %d %d", &lines, &total) != 2) {
+        return;
+    }
+
+    for (int i = 0; i < lines; i++) {
+        if (receive_line(socket, line, sizeof(line)) < 0) {
+            return;
+        }
+        printf("%s", line);
+    }
+}
+
+void receive_email(int socket) {
+    // "200 OK <length>" is followed by exactly <length> bytes of email
+    char header[BUFFER_SIZE];
+    if (receive_line(socket, header, sizeof(header)) < 0) {
+        return;
+    }
+    printf("%s", header);
+
+    unsigned long bytes;
+    if (sscanf(header, "200 OK %lu", &bytes) != 1) {
+        return;
+    }
+
+    // After "HELO <id> COMPRESS=LZ" the body may come as stored:
+    // "200 OK <stored> LZ <length>"
+    unsigned long length;
+    int compressed = sscanf(header, "200 OK %*u LZ %lu", &length) == 1;
+    receive_body(socket, bytes, compressed ? length : bytes, compressed);
+}
+
+void receive_batch(int socket) {
+    // "200 OK <n>" is followed by n frames: a "<id> <bytes>" line (with
+    // " LZ <length>" if compressed) and the email's bytes
+    char line[BUFFER_SIZE];
+    if (receive_line(socket, line, sizeof(line)) < 0) {
+        return;
+    }
+    printf("%s", line);
+
+    int count;
+    if (sscanf(line, "200 OK %d", &count) != 1) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (receive_line(socket, line, sizeof(line)) < 0) {
+            return;
+        }
+
+        int id;
+        unsigned long bytes, length;
+        if (sscanf(line, "%d %lu", &id, &bytes) != 2) {
+            fprintf(stderr, "Malformed email frame: %s", line);
+            return;
+        }
+        int compressed = sscanf(line, "%*d %*u LZ %lu", &length) == 1;
+        if (!compressed) length = bytes;
+
+        printf("--- Email ID: %d (%lu bytes) ---\n", id, length);
+        if (receive_body(socket, bytes, length, compressed) < 0) {
+            return;
+        }
+    }
+}
+
+int receive_body(int socket, unsigned long bytes, unsigned long length, int compressed) {
+    // Prints the next bytes of the stream, decompressing them to length bytes
+    // if compressed. Returns -1 if the connection failed.
+    if (compressed) {
+        unsigned char *packed = malloc(bytes ? bytes : 1);
+        unsigned char *body = malloc(length ? length : 1);
+        size_t got = 0;
+        int status = -1;
+        while (packed && body && got < bytes) {
+            ssize_t n = recv(socket, packed + got, bytes - got, 0);
+            if (n <= 0) {
+                if (n < 0) perror("Error receiving email");
+                break;
+            }
+            got += n;
+        }
+        if (packed && body && got == bytes) {
+            status = 0;
+            ssize_t n = lz_decompress(packed, bytes, body, length);
+            if (n == (ssize_t)length) {
+                fwrite(body, 1, length, stdout);
+            } else {
+                fprintf(stderr, "Error decompressing email\n");
+            }
+        }
+        free(packed);
+        free(body);
+        return status;
+    }
+
+    char buffer[BUFFER_SIZE];
+    while (bytes > 0) {
+        size_t chunk = bytes < sizeof(buffer) ? bytes : sizeof(buffer);
+        ssize_t n = recv(socket, buffer, chunk, 0);
+        if (n <= 0) {
+            if (n < 0) perror("Error receiving email");
+            return -1;
+        }
+        fwrite(buffer, 1, n, stdout);
+        bytes -= n;
+    }
+    return 0;
+}
+
+ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap) {
+    // Same block format as the server's lz_compress(): sequences of a token
+    // (literal count << 4 | match length - 4), literals and a two-byte
+    // little-endian offset. Returns the bytes produced, or -1 if malformed.
+    size_t in = 0;
+    size_t out = 0;
+    while (in < len && out < cap) {
+        unsigned token = src[in++];
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            unsigned char b;
+            do {
+                if (in >= len) return -1;
+                b = src[in++];
+                literal_len += b;
+            } while (b == 255);
+        }
+        if (literal_len > len - in || literal_len > cap - out) return -1;
+        memcpy(dst + out, src + in, literal_len);
+        in += literal_len;
+        out += literal_len;
+        if (in == len) break;
+
+        if (in + 2 > len) return -1;
+        size_t offset = src[in] | src[in + 1] << 8;
+        in += 2;
+        if (offset == 0 || offset > out) return -1;
+
+        size_t match_len = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            unsigned char b;
+            do {
+                if (in >= len) return -1;
+                b = src[in++];
+                match_len += b;
+            } while (b == 255);
+        }
+        if (match_len > cap - out) return -1;
+
+        // Overlapping matches repeat recent output, so copy byte by byte
+        for (size_t i = 0; i < match_len; i++) {
+            dst[out + i] = dst[out + i - offset];
+        }
+        out += match_len;
+    }
+    return out;
+}
+
 void handle_data_command(int socket) {
     // Send DATA command
     send_command(socket, "DATA");
@@ -202,6 +423,12 @@ void handle_data_command(int socket) {
             break;
         }
         
+        // Double a leading dot so the server does not mistake it for the end
+        if (line[0] == '.' && send(socket, ".", 1, 0) < 0) {
+            perror("Error sending data");
+            return;
+        }
+
         // Send the line
         if (send(socket, line, strlen(line), 0) < 0) {
             perror("Error sending data");
@@ -218,11 +445,18 @@ void handle_data_command(int socket) {
 void print_help() {
     printf("\nMy_SMTP Client Commands:\n");
     printf("HELO <client_id>           - Initiate session\n");
+    printf("HELO <id> COMPRESS=LZ      - Initiate session; GET_MAIL sends stored compressed emails\n");
     printf("MAIL FROM: <email>         - Specify sender email\n");
     printf("RCPT TO: <email>           - Specify recipient email\n");
     printf("DATA                       - Start message input\n");
     printf("LIST <email>               - List emails for recipient\n");
+    printf("LIST <email> <offset> <n>  - List n emails starting at position offset\n");
+    printf("LIST <email> SINCE <id>    - List emails newer than id\n");
     printf("GET_MAIL <email> <id>      - Retrieve specific email\n");
+    printf("GET_MAIL <email> <a>-<b>   - Retrieve every email with an ID from a to b\n");
+    printf("DELETE <email> <id>        - Delete an email\n");
+    printf("SEARCH <email> <terms>     - List emails containing every term (from:<word> matches the sender)\n");
+    printf("RSET                       - Discard the sender and recipients given so far\n");
     printf("QUIT                       - End session\n");
     printf("HELP                       - Show this help message\n\n");
 }
\ No newline at end of file
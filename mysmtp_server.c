@@ -6,6 +6,7 @@ Roll number: 22CS10054
 =====================================
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,17 +14,219 @@ Roll number: 22CS10054
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <ctype.h>
 
 #define BUFFER_SIZE 4096
-#define MAX_CLIENTS 10
-#define MAX_EMAIL_SIZE 8192
+#define MAX_CLIENTS 10           // Backlog of the local metrics port
+#define DEFAULT_BACKLOG SOMAXCONN
+#define DEFAULT_QUEUE_SIZE 128
+#define WORKERS_PER_CORE 16      // Session workers block on the network, not the CPU
+#define SESSION_STACK_SIZE (64 * 1024)  // Worker threads: a session's deepest path is a few pages
+#define THREAD_STACK_SIZE (256 * 1024)  // Event loops and background threads
+#define POOL_KEEP 64             // Free session buffers a thread keeps for reuse
+#define MAX_SHARDS 256
+#define DEFAULT_MAX_MESSAGE_SIZE (10 * 1024 * 1024)
 #define MAILBOX_DIR "mailbox"
+#define SPOOL_DIR MAILBOX_DIR "/.spool"
+#define BLOB_DIR MAILBOX_DIR "/.blobs"
+#define JOURNAL_PATH MAILBOX_DIR "/.journal"
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_COMMIT_DELAY_US 1000
+#define LOG_RING_SIZE 256
+#define LOG_MESSAGE_SIZE 224
+#define LOG_FLUSH_INTERVAL_US 10000
+#define HISTOGRAM_SUB_BITS 4 // 16 buckets per power of two, about 6% resolution
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define METRICS_TEXT_SIZE 8192
+#define MAX_RECIPIENTS 1000
+#define LIST_BATCH 32            // Index entries read and formatted per LIST chunk
+#define MAX_EVENTS 256
+#define URING_ENTRIES 4096        // Submission queue size; the completion queue is twice this
+#define URING_BATCH 256           // Completions handled per wakeup, at most two SQEs each
+#define FILE_CHUNK 65536          // Mailbox bytes read per io_uring read
+#define URING_RECV_BUFFERS 256    // Read buffers an io_uring loop lends the kernel for idle sessions
+#define URING_BUFFER_GROUP 0
+#define COMPRESS_MIN_SIZE 512     // Smaller bodies are always stored as is
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define INDEX_MAGIC 0x58494d53 // "SMIX"
+#define SEGMENT_MAGIC 0x52474553 // "SEGR"
+#define INDEX_VERSION 5 // 5 marks deleted entries in place
+#define SEARCH_MAGIC 0x58495353 // "SSIX"
+#define SEARCH_VERSION 3         // 2 indexes one-character words, 3 sizes the chain heads
+#define SEARCH_MIN_BUCKETS 64     // Fewest posting chains of a search index
+#define SEARCH_MAX_BUCKETS 65536  // Most; in between, about one per email
+#define SEARCH_MAX_BYTES 65536    // Leading bytes of each email that are indexed
+#define SEARCH_MAX_TERM 32        // Longer words are not indexed
+#define SEARCH_MAX_QUERY 16       // Terms per SEARCH
+#define MAILBOX_LOCK_STRIPES 64
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024        // Hash chains per cache shard
+#define DEFAULT_IDLE_TIMEOUT 300  // Seconds a session may wait between commands
+#define DEFAULT_DATA_TIMEOUT 600  // Seconds a DATA transfer may stall
+#define DEFAULT_COMPACT_THRESHOLD 50 // Percent of a mailbox that may be deleted emails before compaction
+#define COMPACT_QUEUE_SIZE 64
+#define MAX_REPLICAS 8
+#define REPL_MAGIC 0x4c504552     // "REPL"
+#define REPL_VERSION 3             // 2 carries the replication secret in HELLO, 3 shared bodies once
+#define REPL_MAX_SECRET 255
+#define DEFAULT_STANDBY_BIND "127.0.0.1"
+#define REPL_LOG_SLOTS 65536      // Changes kept for standbys, at most
+#define DEFAULT_REPL_BUFFER (64 * 1024 * 1024) // Bytes of changes kept for standbys
+#define REPL_BATCH_BYTES (256 * 1024) // Changes copied out of the log per write
+#define REPL_RETRY_SECONDS 1
+#define REPL_SEND_TIMEOUT 30      // Seconds a standby may refuse data before it is dropped
+#define HANDOFF_MAGIC 0x46444e48   // "HNDF"
+#define SNAPSHOT_PATH MAILBOX_DIR "/.snapshot"
+#define SNAPSHOT_MAGIC 0x50414e53  // "SNAP"
+#define SNAPSHOT_VERSION 2
+#define DRAIN_TIMEOUT 30          // Seconds a restart waits for transactions in progress
+#define DRAIN_POLL_MS 50
+#define HANDOFF_BATCH 64          // Listeners per SCM_RIGHTS message; the kernel takes at most 253
+#define TIMER_TICK_MS 100
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4            // 64^4 ticks, about 194 days
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - (1ULL << (TIMER_LEVEL_BITS * (TIMER_LEVELS - 1))))
+
+// Replication record types
+#define REPL_HELLO 1    // Primary: opens the stream; id is the version, the body the secret
+#define REPL_STATE 2    // Standby: a mailbox's next ID; an empty email ends the list
+#define REPL_APPEND 3   // An email and its body, or no body if blob names a shared one
+#define REPL_DELETE 4
+#define REPL_SYNC 5     // The IDs of a mailbox's emails below id
+#define REPL_ACK 6      // Standby: every change up to seq is applied; id 1 ends a catch-up
+#define REPL_CAUGHT_UP 7 // Primary: the catch-up is complete, acknowledge it now
+#define REPL_BLOB 8     // A shared body, sent ahead of the first APPEND naming it
+
+// Replica states
+#define REPLICA_CONNECTING 0
+#define REPLICA_CATCHING_UP 1
+#define REPLICA_STREAMING 2
+
+// mailbox_index_open() flags and results
+#define INDEX_CREATE 1
+#define INDEX_REPAIR 2
+#define INDEX_STALE 2
+
+// Mailbox storage engines
+#define STORAGE_TEXT 0     // mailbox/<user>.txt with "--- Email ID ---" markers
+#define STORAGE_SEGMENT 1  // mailbox/<user>.seg of checksummed binary records
+
+// Stored body codecs, recorded per message
+#define CODEC_NONE 0
+#define CODEC_LZ 1         // LZ77 in the LZ4 block layout (lz_compress)
+
+// LIST and GET_MAIL range output formats
+#define LIST_PLAIN 0       // "<id>: Email from <sender> (<date>)" lines
+#define LIST_SIZES 1       // The same with " <length> bytes", after "200 OK <n> <total>"
+#define LIST_BODIES 2      // "<id> <bytes>" frames each followed by the email, after "200 OK <n>"
+
+// Message cache item kinds, for its hit and miss counters
+#define CACHE_BODY 0
+#define CACHE_LISTING 1
+
+// Server I/O modes
+#define MODE_THREADS 0
+#define MODE_EPOLL 1
+
+// Event loop I/O engines
+#define ENGINE_EPOLL 0
+#define ENGINE_URING 1
+
+// Operation tags kept in the low bits of an io_uring user_data pointer
+#define URING_RECV 0
+#define URING_SEND 1       // From wbuf
+#define URING_SEND_FILE 2  // From fbuf
+#define URING_READ_FILE 3
+#define URING_TAG_MASK 3
+#define URING_ACCEPT_DATA 1ULL   // user_data of the accept, never a tagged pointer
+#define URING_JOURNAL_DATA 2ULL  // user_data of the journal eventfd read
+#define URING_TIMER_DATA 3ULL    // user_data of the timer wheel tick
+#define URING_DRAIN_DATA 4ULL    // user_data of the restart poll and the accept cancel
+#define URING_PROVIDE_DATA 5ULL  // user_data of the read buffers handed to the kernel
+
+// Log levels; per-command records are logged at LOG_DEBUG
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+// Latency histograms, one per command verb plus the delivery path
+#define METRIC_HELO 0
+#define METRIC_MAIL 1
+#define METRIC_RCPT 2
+#define METRIC_DATA 3
+#define METRIC_LIST 4
+#define METRIC_GET_MAIL 5
+#define METRIC_STATS 6
+#define METRIC_QUIT 7
+#define METRIC_SEARCH 8
+#define METRIC_DELETE 9
+#define METRIC_OTHER 10
+#define METRIC_DATA_END 11 // Terminating '.' through queuing the reply
+#define METRIC_STORE 12    // Writing the message to mailboxes, blobs and the journal
+#define METRIC_COUNT 13
+
+// Throughput counters
+#define COUNTER_CONNECTIONS 0
+#define COUNTER_MESSAGES 1
+#define COUNTER_DELIVERIES 2
+#define COUNTER_BYTES_RECEIVED 3
+#define COUNTER_BYTES_SENT 4
+#define COUNTER_REJECTED 5
+#define COUNTER_TIMEOUTS 6
+#define COUNTER_COUNT 7
+
+// Thread mode session read states, for a restart to cut idle reads short
+#define READ_BUSY 0        // Running commands, or in a transaction
+#define READ_IDLE 1        // Waiting in recv() between transactions
+#define READ_CUT 2         // Being shut down for reading by the restart thread
+
+// Connection phases
+#define PHASE_COMMAND 0
+#define PHASE_DATA 1
+
+// DATA terminator scanner states
+#define DATA_LINE_START 0 // At the start of a line
+#define DATA_MID_LINE 1   // Inside a line
+#define DATA_DOT 2        // Saw a leading '.'
+#define DATA_DOT_CR 3     // Saw a leading ".\r"
+
+// DATA spooling failures
+#define DATA_TOO_LARGE 1
+#define DATA_WRITE_FAILED 2
 
 // Response codes
 #define OK "200 OK\r\n"
@@ -31,473 +234,8217 @@ Roll number: 22CS10054
 #define ERR_NOT_FOUND "401 NOT FOUND Requested email does not exist\r\n"
 #define ERR_FORBIDDEN "403 FORBIDDEN Action not permitted\r\n"
 #define ERR_SERVER "500 SERVER ERROR\r\n"
+#define ERR_STANDBY "403 FORBIDDEN Read-only standby\r\n"
+#define ERR_SEARCH_TERMS "400 ERR Search allows up to 16 terms of up to 32 characters\r\n"
+#define HELO_OK "200 OK PIPELINING COMPRESS=LZ\r\n"
+#define ERR_TOO_LARGE "552 ERR Message exceeds maximum size\r\n"
+#define ERR_TOO_MANY_RECIPIENTS "452 ERR Too many recipients\r\n"
+#define ERR_BUSY "421 Service busy, try again later\r\n"
+#define ERR_TIMEOUT "421 Timeout, closing connection\r\n"
+#define ERR_SHUTDOWN "421 Server restarting, try again\r\n"
 
 // Client session state
 typedef struct {
     char sender[256];
-    char recipient[256];
+    char (*recipients)[256]; // Every RCPT TO of the current transaction
+    int recipient_count;
+    int recipient_capacity;
     int is_authenticated;
+    int compressed_replies; // HELO asked for compressed bodies to be sent as stored
     int has_sender;
     int has_recipient;
 } ClientState;
 
+// Timer wheel: TIMER_LEVELS levels of TIMER_SLOTS slots, each slot a list
+// of timers. Level n holds timers due within 64^(n+1) ticks, filed by the
+// tick bits of that level; as time reaches a slot of an upper level its
+// timers are refiled further down, and level 0 slots fire. Arming and
+// cancelling are O(1) list operations.
+typedef struct Timer {
+    struct Timer *next;    // NULL while not armed
+    struct Timer *prev;
+    uint64_t expires;      // Tick the timer fires at
+} Timer;
+
+typedef struct TimerWheel {
+    uint64_t now;          // Last tick processed
+    long count;            // Armed timers
+    int shared;            // Used by several threads, under lock
+    pthread_mutex_t lock;
+    void (*expire)(struct TimerWheel *wheel, Timer *timer); // Called with the timer disarmed
+    Timer slots[TIMER_LEVELS][TIMER_SLOTS];                 // List heads
+} TimerWheel;
+
+// Open sessions of one event loop, or of the whole server in thread mode,
+// so that a restart can find the idle ones
+typedef struct {
+    struct Connection *head;
+    int shared;            // Thread mode: sessions come and go on different threads
+    pthread_mutex_t lock;
+} SessionList;
+
+// Free BUFFER_SIZE session buffers kept by one thread. A session takes a read
+// or reply buffer when it has bytes to hold and gives it back once it is
+// idle again, so sessions waiting for their next command hold none.
+typedef struct {
+    char *head;            // Each free buffer starts with a pointer to the next
+    int count;
+    int keep;              // Most free buffers kept; the rest go back to malloc
+} BufferPool;
+
+// Per-connection state shared by the threaded and event loop servers.
+// Responses are queued in wbuf and written out by connection_flush(),
+// followed by the pending file region (if any) sent with sendfile().
+typedef struct Connection {
+    uint64_t id;           // Identifies the session in log records
+    struct Shard *shard;   // Event loop that owns the session, or NULL in thread mode
+    int fd;
+    ClientState state;
+    int phase;
+    int closing;
+    char *rbuf;            // BUFFER_SIZE from the pool while input is buffered, else NULL
+    size_t rlen;
+    char *wbuf;            // From the pool, or grown past BUFFER_SIZE; NULL when idle
+    size_t wlen;
+    size_t wsent;
+    size_t wcap;
+    int file_fd;           // Mailbox being streamed after wbuf, or -1
+    off_t file_offset;
+    size_t file_remaining;
+    int spool_fd;      // Unlinked temp file holding the DATA being received
+    size_t data_len;   // Bytes spooled so far, headers included
+    int data_error;    // DATA_TOO_LARGE or DATA_WRITE_FAILED once spooling fails
+    int data_state;
+    uint64_t commit_seq;             // Journal record the held-back reply waits for, or 0
+    char commit_reply[128];
+    struct Connection *commit_next;  // Next connection waiting for a durable batch
+    int io_inflight;       // io_uring operations whose buffers the kernel still holds
+    int io_shutdown;       // Socket shut down to cut those operations short
+    char *fbuf;            // Mailbox bytes between their io_uring read and send
+    size_t flen;
+    size_t fsent;
+    int list_fd;           // Index a LIST reply is still being streamed from, or -1
+    struct CacheItem *list_item; // Or the cached listing it is streamed from
+    int list_next;         // Next index slot to list
+    int list_end;          // Slot the listing stops before
+    int list_hidden;       // Deleted count of the index when the listing began
+    int list_format;       // LIST_PLAIN, LIST_SIZES or LIST_BODIES
+    int batch_fd;          // Mailbox the emails of a GET_MAIL range are sent from, or -1
+    char batch_email[256];
+    TimerWheel *wheel;     // Wheel the session timer is armed in, or NULL without timeouts
+    Timer timer;
+    atomic_ullong deadline; // Tick the session times out at unless it makes progress
+    atomic_int timed_out;   // Thread mode: the timer shut the socket down
+    SessionList *sessions;  // The list the session is on
+    struct Connection *session_prev;
+    struct Connection *session_next;
+    atomic_int read_state;  // Thread mode: READ_BUSY, READ_IDLE or READ_CUT
+    int recv_fallback;      // io_uring: the loop's read buffers ran out, so receive into rbuf
+} Connection;
+
+// Sent ahead of the listeners passed to a successor over the handoff socket
+typedef struct {
+    uint32_t magic;
+    int32_t port;
+    int32_t count;          // Listeners in this message's SCM_RIGHTS
+    int32_t remaining;      // Listeners in the messages after it
+} HandoffHeader;
+
+// Sidecar index stored next to each mailbox as mailbox/<user>.idx (.seg.idx for
+// segment mailboxes): a header followed by one fixed-size entry per email in ID
+// order. Deleted emails have no entry; their bytes stay in the mailbox behind
+// a tombstone until it is compacted.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t mailbox_size;  // Bytes of the mailbox file covered by the entries
+    uint64_t mailbox_inode; // Detects the mailbox file being replaced
+    int32_t next_id;
+    int32_t count;
+    uint64_t dead_bytes;    // Mailbox bytes held by deleted emails and their tombstones
+    int32_t deleted;        // Entries marked deleted; count less these are listed
+    int32_t reserved;
+} IndexHeader;
+
+typedef struct {
+    int32_t id;
+    uint32_t length;        // Bytes between the start and end marker lines
+    uint64_t offset;        // Byte offset of the first line after the start marker
+    uint32_t stored_length; // Bytes at offset; less than length when compressed
+    uint32_t codec;         // CODEC_NONE or how the stored bytes are compressed
+    int32_t deleted;        // 0, or the header's deleted count once this email was deleted
+    int32_t reserved;
+    char sender[256];
+    char date[64];
+    char blob[48];          // Shared body file in BLOB_DIR, or empty if stored inline
+} IndexEntry;
+
+// Record in a segment mailbox (mailbox/<user>.seg): this fixed header, then
+// body_len bytes of email. Records are only ever appended; the checksum lets
+// a scan tell a complete record from a torn or damaged one.
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;           // CRC-32C of the rest of the header and the body
+    int32_t id;
+    uint32_t size;          // Bytes of email, with the newline every stored email ends in
+    int64_t timestamp;      // Delivery time, seconds since the epoch
+    uint32_t body_len;      // Bytes stored: size, less when compressed, 0 for a shared blob
+    uint32_t codec;         // CODEC_NONE or how the body is compressed
+    char sender[256];
+    char blob[48];          // Shared body file in BLOB_DIR, or empty if stored inline
+} SegmentRecord;
+
+typedef struct {
+    int fd;
+    IndexHeader header;
+    char path[600];         // The index file, which rebuilds and compaction replace
+} MailboxIndex;
+
+// Cached listings saved by a clean shutdown to SNAPSHOT_PATH and mapped by
+// the next start: this header, then per mailbox a SnapshotListing followed
+// by its live index entries. A listing is only loaded if the mailbox index
+// still has the header it was saved with.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t count;          // Listings in the file
+    int32_t reserved;
+} SnapshotHeader;
+
+typedef struct {
+    char email[256];
+    IndexHeader header;
+} SnapshotListing;
+
+// State of one mailbox compaction: the records of emails still indexed are
+// copied in order from the old mailbox to a new file, with a new index
+typedef struct {
+    MailboxIndex *old;      // Snapshot of the index the copy follows
+    MailboxIndex *fresh;    // Index of the new file
+    int mailbox_fd;
+    int new_fd;
+    int slot;               // Next live slot of the old index to find a record for
+    IndexEntry entry;       // That slot's entry
+    uint64_t pos;           // End of the new file
+    int dropped_blobs;      // Deleted emails left behind that shared a body
+} Compaction;
+
+// Search index stored as mailbox/<user>.sidx (.seg.sidx for segment
+// mailboxes): this header, the chain heads, then the postings, appended as
+// emails are indexed. Each posting names one term of one email and links to
+// the previous posting in its bucket, so the emails holding a term are found
+// by walking one chain, newest first. Compaction drops the file; the next
+// SEARCH rebuilds it without the deleted emails.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t next_id;        // Emails below this ID are indexed
+    int32_t buckets;        // Chain heads after the header, a power of two
+    uint64_t size;          // End of the postings
+} SearchHeader;
+
+typedef struct {
+    uint64_t term;          // search_hash() of the term
+    int32_t id;
+    uint32_t reserved;
+    uint64_t prev;          // Previous posting in the bucket, or 0
+} SearchPosting;
+
+typedef struct {
+    int fd;
+    SearchHeader header;
+} SearchIndex;
+
+// Replication: a primary started with --replica streams every stored and
+// deleted email to each standby (--standby) as ReplHeader records, each
+// followed by length bytes. Changes are numbered and standbys acknowledge
+// the last one applied. A standby applies nothing until the primary has
+// sent the same --replication-secret. Records hold host-order integers, so primary and
+// standbys run the same build.
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;           // Change number; catch-up records carry the last change they include
+    int32_t id;             // Email ID; STATE and SYNC: the mailbox's next ID
+    uint32_t length;        // Bytes that follow: APPEND the body, SYNC the IDs
+    char email[256];
+    char sender[256];
+    char blob[48];          // BLOB and shared APPEND: the body's name in BLOB_DIR
+} ReplHeader;
+
+// A change kept until the log needs its room
+typedef struct {
+    struct timespec committed;
+    ReplHeader header;
+    char body[];
+} ReplChange;
+
+typedef struct {
+    ReplChange *changes[REPL_LOG_SLOTS]; // Change seq is in slot seq % REPL_LOG_SLOTS
+    uint64_t first_seq;     // Oldest change kept
+    uint64_t next_seq;
+    size_t bytes;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} ReplLog;
+
+typedef struct {
+    char host[256];
+    int port;
+    int fd;
+    atomic_int state;
+    atomic_int connected;    // Cleared by the acknowledgement reader when the standby goes away
+    atomic_ullong sent_seq;  // Last change written to the standby
+    atomic_ullong acked_seq; // Last change the standby applied
+    atomic_ulong resyncs;    // Times the standby fell out of the log and was caught up again
+} Replica;
+
+// Shared bodies sent to a standby this session, by search_hash() of the name
+typedef struct {
+    uint64_t *hashes;       // 0 marks a free slot
+    size_t capacity;        // A power of two
+    size_t count;
+} BlobSet;
+
+// A standby's next ID for one mailbox, as reported when it connects
+typedef struct {
+    char email[256];
+    int next_id;
+} ReplState;
+
+// Mailboxes waiting for the compactor thread
+typedef struct {
+    char emails[COMPACT_QUEUE_SIZE][256];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} CompactQueue;
+
+// Message cache: recently stored or fetched bodies, keyed by mailbox and ID,
+// and whole mailbox listings (ID 0), kept current as emails are appended.
+// Items live in CACHE_SHARDS independently locked LRU lists, each allowed
+// an equal part of the cache size. A stored email's ID always names the
+// same bytes, so bodies are never stale; listings are dropped when an index
+// has to be repaired, an email is deleted or the mailbox is compacted.
+typedef struct CacheItem {
+    struct CacheItem *hash_next;
+    struct CacheItem *lru_prev;
+    struct CacheItem *lru_next;
+    uint32_t hash;
+    int id;                 // Email ID, or 0 for the mailbox's listing
+    int refs;               // One while cached, plus one per user
+    size_t charge;          // Bytes counted against the shard's share
+    char email[256];
+    IndexEntry entry;       // Bodies: the email's index entry
+    char *body;             // Bodies: entry.length bytes, decompressed
+    IndexEntry *entries;    // Listings: the index entries in slot order
+    int count;
+    int capacity;
+} CacheItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheItem **table;      // CACHE_BUCKETS hash chains
+    CacheItem lru;          // List head: lru.lru_next is the most recently used
+    size_t used;
+    unsigned long hits[2];  // By CACHE_BODY / CACHE_LISTING
+    unsigned long misses[2];
+    unsigned long evictions;
+} CacheShard;
+
+// Accepted sessions waiting for a free worker in thread mode
+typedef struct {
+    Connection **items;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} WorkQueue;
+
+// Write-ahead journal used by --durable. Each accepted message is appended
+// as a JournalRecord, the recipients with the IDs they were stored under,
+// the message body and a JournalTrailer; a reply is only sent once a group
+// fdatasync() has covered its record.
+typedef struct {
+    uint32_t magic;
+    uint32_t target_count;
+    uint64_t content_len;
+    char sender[256];
+    char blob[48];          // Shared body file, or empty if stored inline
+} JournalRecord;
+
+typedef struct {
+    char recipient[256];
+    int32_t id;             // Email ID in the recipient's mailbox, or 0 if not delivered
+} JournalTarget;
+
+typedef struct {
+    uint32_t checksum;      // FNV-1a over the record, targets and body
+    uint32_t magic;
+} JournalTrailer;
+
+typedef struct {
+    int fd;
+    int event_fds[MAX_SHARDS]; // Wake each event loop when a batch is durable
+    int event_fd_count;
+    uint64_t size;          // Bytes of valid records in the journal file
+    uint64_t appended_seq;  // Last record written
+    uint64_t durable_seq;   // Last record known to be on disk
+    pthread_mutex_t lock;
+    pthread_cond_t appended;
+    pthread_cond_t durable;
+} Journal;
+
+// Logging: each thread formats records into its own single-producer ring,
+// which a background thread drains and writes out in batches, so logging
+// never takes a lock or makes a system call on the request path.
+typedef struct {
+    struct timespec time;
+    uint64_t conn_id;
+    uint32_t latency_us;
+    int level;
+    char command[16];
+    char message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+typedef struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    atomic_size_t head;     // Next slot written by the owning thread
+    atomic_size_t tail;     // Next slot read by the drainer
+    atomic_int orphaned;    // Owning thread has exited; freed once drained
+    struct LogRing *next;
+} LogRing;
+
+// Metrics: every thread updates its own copy without locked instructions;
+// STATS sums all copies. A thread's totals are folded into retired_metrics
+// when it exits.
+typedef struct ThreadMetrics {
+    atomic_ulong counters[COUNTER_COUNT];
+    atomic_ulong histograms[METRIC_COUNT][HISTOGRAM_BUCKETS];
+    atomic_ulong latency_max[METRIC_COUNT];
+    struct ThreadMetrics *next;
+} ThreadMetrics;
+
+// One event loop with its own SO_REUSEPORT listener, pinned to a CPU
+typedef struct Shard {
+    int index;
+    int cpu;
+    int listen_fd;
+    atomic_long active;      // Open sessions owned by this shard
+    ThreadMetrics *metrics;  // The shard thread's metrics, for per-shard STATS
+} Shard;
+
+// An io_uring instance driven through the raw system calls: the rings are
+// shared memory, so queueing work and collecting results cost no syscalls;
+// one io_uring_enter() per loop iteration submits and waits for everything.
+typedef struct {
+    int fd;
+    void *ring_mem;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending;       // SQEs queued since the last io_uring_enter()
+    char *recv_buffers[URING_RECV_BUFFERS]; // Provided to the kernel, by buffer ID
+} IoRing;
+
 // Function to handle client connection
 void *handle_client(void *arg);
 
+// Thread mode worker pool
+void start_workers(int count);
+void *worker_main(void *arg);
+int work_queue_push(Connection *conn);
+Connection *work_queue_pop();
+int admit_connection();
+void reject_connection(int fd);
+
+// Event loop server
+int create_listener(in_addr_t address, int port, int reuseport);
+void run_shards();
+void *shard_main(void *arg);
+void run_event_loop(int server_socket);
+void connection_on_readable(Connection *conn);
+void connection_resume(Connection *conn);
+int connection_process_input(Connection *conn);
+void release_durable_replies();
+
+// Graceful restart
+int listener_open(int port, int reuseport);
+int handoff_receive(const char *path, int port);
+int handoff_send(int fd);
+void restart_start();
+void *restart_thread(void *arg);
+void restart_wake(int sig);
+void session_list_add(Connection *conn);
+void session_list_remove(Connection *conn);
+void session_list_drain(SessionList *list);
+int connection_idle(Connection *conn);
+int connection_drain_point(Connection *conn);
+void connection_drain(Connection *conn);
+
+// io_uring engine
+int uring_open(IoRing *ring, unsigned entries);
+void uring_close(IoRing *ring);
+int uring_prep(IoRing *ring, int opcode, int fd, void *addr, size_t len, uint64_t offset,
+               int flags, uint64_t user_data);
+int uring_submit(IoRing *ring, unsigned wait);
+int run_uring_loop(int server_socket);
+void uring_complete(Connection *conn, int op, int res);
+void uring_pump(Connection *conn);
+struct io_uring_sqe *uring_last(IoRing *ring);
+void uring_provide(IoRing *ring, int id);
+void uring_adopt(IoRing *ring, Connection *conn, int id);
+
+// Session timeouts
+void timer_wheel_init(TimerWheel *wheel, int shared, void (*expire)(TimerWheel *, Timer *));
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires);
+void timer_place(TimerWheel *wheel, Timer *timer);
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+void timer_advance(TimerWheel *wheel, uint64_t target);
+uint64_t timer_now();
+void *timer_main(void *arg);
+void connection_touch(Connection *conn);
+void connection_timer_start(Connection *conn);
+void connection_timer_stop(Connection *conn);
+void connection_timer_expired(TimerWheel *wheel, Timer *timer);
+
+// Command dispatch
+void dispatch_command(Connection *conn, char *line);
+
 // Protocol command handlers
-void handle_helo(int client_socket, char *client_id, ClientState *state);
-void handle_mail_from(int client_socket, char *sender, ClientState *state);
-void handle_rcpt_to(int client_socket, char *recipient, ClientState *state);
-void handle_data(int client_socket, ClientState *state);
-void handle_list(int client_socket, char *email);
-void handle_get_mail(int client_socket, char *email, int id);
-void handle_quit(int client_socket);
+void handle_helo(Connection *conn, char *client_id);
+void handle_mail_from(Connection *conn, char *sender);
+void handle_rcpt_to(Connection *conn, char *recipient);
+void handle_data(Connection *conn);
+void handle_data_end(Connection *conn);
+void handle_list(Connection *conn, const char *email, int first, int count, int since_id);
+void list_cached(Connection *conn, CacheItem *listing, int first, int count, int since_id, int format);
+void list_start(Connection *conn, MailboxIndex *index, CacheItem *listing, int first, int end, int lines,
+                int total, int format);
+void handle_get_range(Connection *conn, const char *email, int from, int to);
+void batch_send_entry(Connection *conn, const IndexEntry *entry);
+void list_continue(Connection *conn);
+void list_close(Connection *conn);
+void handle_get_mail(Connection *conn, char *email, int id);
+void handle_delete(Connection *conn, const char *email, int id);
+void handle_search(Connection *conn, const char *email, const char *query);
+void handle_stats(Connection *conn);
+void handle_quit(Connection *conn);
+void handle_rset(Connection *conn);
+void client_state_reset(ClientState *state);
+
+// Connection helpers
+Connection *connection_create(int fd);
+void connection_destroy(Connection *conn);
+int connection_read_buffer(Connection *conn);
+void connection_trim(Connection *conn);
+
+// Session memory
+char *buffer_get();
+void buffer_put(char *buf, size_t size);
+void session_memory(long delta);
+size_t session_format(char *text, size_t size);
+int thread_create(pthread_t *thread, size_t stack_size, void *(*start)(void *), void *arg);
+int connection_flush(Connection *conn);
+int connection_flush_buffers(Connection *conn);
+int connection_output_pending(Connection *conn);
+void send_file_region(Connection *conn, int fd, off_t offset, size_t len);
+int connection_waiting(Connection *conn);
+int connection_listing(Connection *conn);
+void connection_defer_reply(Connection *conn, uint64_t seq, const char *reply);
+void commit_waiters_remove(Connection *conn);
+size_t data_feed(Connection *conn, char *bytes, size_t len);
+int data_spool_write(Connection *conn, const char *bytes, size_t len);
+
+// Mailbox index
+int mailbox_index_open(const char *email, MailboxIndex *index, int flags);
+int mailbox_index_open_shared(const char *email, MailboxIndex *index, pthread_rwlock_t *lock);
+void mailbox_index_close(MailboxIndex *index);
+int mailbox_index_find(MailboxIndex *index, int id, IndexEntry *entry);
+int mailbox_index_seek(MailboxIndex *index, int id);
+int mailbox_index_append(MailboxIndex *index, const IndexEntry *entry, uint64_t mailbox_size);
+int mailbox_index_read(MailboxIndex *index, int first, IndexEntry *entries, int max);
+int mailbox_index_rebuild(const char *index_path, int mailbox_fd, const struct stat *st, MailboxIndex *index);
+int mailbox_index_scan(int mailbox_fd, uint64_t from, uint64_t to, MailboxIndex *index);
+int mailbox_index_tombstone(MailboxIndex *index, int id, uint64_t tombstone_len, uint64_t mailbox_size);
+int mailbox_index_live(const IndexHeader *header);
+int mailbox_index_hidden(const IndexEntry *entry, int deleted);
+int mailbox_index_range(MailboxIndex *index, int *first, int *end, int skip, int max);
+uint64_t mailbox_record_size(const IndexEntry *entry);
+void parse_email_headers(const char *content, size_t len, IndexEntry *entry);
+void resolve_index_entry(const char *head, size_t len, IndexEntry *entry);
+void mailbox_path_for(const char *email, const char *ext, char *path, size_t size);
+const char *mailbox_ext();
+void blob_read_headers(IndexEntry *entry);
+
+// Mailbox storage engines
+ssize_t mailbox_write_text(int mailbox_fd, off_t base, const char *sender, int spool_fd,
+                           size_t content_len, IndexEntry *entry);
+ssize_t mailbox_write_segment(int mailbox_fd, off_t base, const char *sender, int spool_fd,
+                              size_t content_len, IndexEntry *entry);
+ssize_t segment_write_record(int fd, off_t base, SegmentRecord *record, int src_fd, off_t src_offset,
+                             size_t src_len);
+ssize_t segment_write_compressed(int fd, off_t base, SegmentRecord *record, int src_fd, off_t src_offset,
+                                 size_t src_len);
+ssize_t segment_read_record(int fd, uint64_t pos, uint64_t end, SegmentRecord *record);
+uint64_t segment_resync(int fd, uint64_t from, uint64_t end);
+int segment_index_scan(int mailbox_fd, uint64_t from, uint64_t to, MailboxIndex *index);
+ssize_t segment_write_tombstone(int fd, off_t base, int id);
+int convert_mailboxes();
+int convert_mailbox(const char *email);
+void storage_check();
+char *email_read_body(int fd, const IndexEntry *entry);
+ssize_t email_read_head(int fd, const IndexEntry *entry, char *head, size_t size);
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap);
+ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap);
+int lz_emit(unsigned char *dst, size_t cap, size_t *out, const unsigned char *literals,
+            size_t literal_len, size_t offset, size_t match_len);
+void crc32c_init();
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+int crc32c_file(int fd, off_t offset, size_t len, uint32_t *crc);
+
+// Deletion and compaction
+int mailbox_delete(const char *email, int id);
+ssize_t mailbox_write_tombstone(int mailbox_fd, off_t base, int id);
+int compact_due(const IndexHeader *header);
+void compact_start();
+void compact_request(const char *email);
+void *compact_thread(void *arg);
+int compact_mailbox(const char *email);
+int compact_scan(Compaction *c, uint64_t end);
+int compact_record(Compaction *c, int id, uint64_t start, uint64_t len);
+int compact_next(Compaction *c, int slot);
+int blob_collect();
+
+// Search index
+int search_index_open(const char *email, MailboxIndex *mailbox, SearchIndex *search, int flags);
+int search_index_reset(SearchIndex *search, int emails);
+int search_buckets_for(int emails);
+int search_header_valid(const SearchHeader *header);
+int search_index_catch_up(const char *email, MailboxIndex *mailbox, SearchIndex *search);
+void search_index_append(const char *email, const IndexEntry *entry, int spool_fd, size_t content_len);
+int search_index_add(SearchIndex *search, int id, const char *sender, const char *text, size_t len);
+int search_lookup(SearchIndex *search, const uint64_t *terms, int count, int **ids);
+uint32_t search_bucket(SearchIndex *search, uint64_t term);
+int search_chain(SearchIndex *search, uint64_t term, int **ids);
+size_t search_terms(const char *text, size_t len, const char *prefix, uint64_t *terms, size_t count,
+                    size_t max);
+int search_query_terms(const char *query, uint64_t *terms, size_t max);
+uint64_t search_hash(const char *prefix, const char *word, size_t len);
+int compare_terms(const void *a, const void *b);
+
+// Replication
+void repl_start();
+ReplChange *repl_change_new(int type, const char *email, const char *sender, const char *blob,
+                            int spool_fd, size_t len);
+void repl_log_push(ReplChange *change, int id);
+int repl_send(int fd, int type, uint64_t seq, const char *email, const char *sender, const char *blob,
+              int id, const void *data, size_t len);
+size_t repl_format(char *text, size_t size);
+void *replica_thread(void *arg);
+int replica_connect(Replica *replica);
+int replica_session(Replica *replica, int fd);
+void *replica_ack_thread(void *arg);
+int replica_catch_up(int fd, uint64_t seq, ReplState *states, int state_count, BlobSet *sent);
+int replica_send_mailbox(int fd, const char *email, uint64_t seq, int standby_next_id, BlobSet *sent);
+int replica_send_blob(int fd, uint64_t seq, const char *blob, BlobSet *sent);
+int replica_stream(Replica *replica, int fd, uint64_t seq, BlobSet *sent);
+int blob_set_add(BlobSet *set, const char *name);
+int compare_repl_states(const void *a, const void *b);
+void *standby_thread(void *arg);
+int standby_session(int fd);
+int standby_secret_matches(const char *secret, size_t len);
+int standby_send_state(int fd);
+int standby_apply(int fd, const ReplHeader *header, int spool_fd);
+int standby_sync(const char *email, int next_id, const int32_t *ids, int count);
+int mailbox_names(char (**names)[256]);
+
+// Durable journal
+int journal_open();
+int journal_recover();
+int journal_replay_record(off_t offset, const JournalRecord *record, const JournalTarget *targets);
+uint64_t journal_append(ClientState *state, const int *ids, const char *blob,
+                        int spool_fd, size_t content_len);
+void journal_wait(uint64_t seq);
+void *journal_commit_thread(void *arg);
+uint32_t fnv1a(uint32_t hash, const void *data, size_t len);
+
+// Logging
+void log_init();
+int log_enabled(int level);
+void log_message(int level, uint64_t conn_id, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+void log_command(uint64_t conn_id, const char *command, uint32_t latency_us, const char *args);
+void log_push(int level, uint64_t conn_id, const char *command, uint32_t latency_us,
+              const char *fmt, va_list args);
+LogRing *log_thread_ring();
+void log_release_ring(void *ring);
+void log_drain();
+void log_push_args(int level, uint64_t conn_id, const char *command, uint32_t latency_us,
+                   const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+void log_toggle_verbose(int sig);
+void *log_thread(void *arg);
+
+// Metrics
+ThreadMetrics *metrics_thread();
+void metrics_release(void *metrics);
+void metrics_count(int counter, unsigned long n);
+void metrics_record(int metric, uint32_t latency_us);
+int metric_for_command(const char *command);
+int histogram_bucket(uint32_t value);
+unsigned long histogram_bucket_value(int bucket);
+unsigned long histogram_percentile(const unsigned long *buckets, unsigned long count, double percentile,
+                                   unsigned long max);
+size_t metrics_format(char *text, size_t size);
+void *metrics_server(void *arg);
+uint32_t elapsed_us(const struct timespec *started);
+double elapsed_seconds(const struct timespec *started);
+
+// Mailbox locking
+void init_mailbox_locks();
+pthread_rwlock_t *mailbox_lock_for(const char *email);
+void mailbox_read_lock(pthread_rwlock_t *lock);
+void mailbox_write_lock(pthread_rwlock_t *lock);
+
+// Message cache
+void cache_init();
+uint32_t cache_hash(const char *email, int id);
+CacheItem *cache_new(const char *email, int id);
+CacheItem *cache_lookup(const char *email, int id);
+void cache_release(CacheItem *item);
+void cache_insert(CacheItem *item);
+CacheItem *cache_find_locked(CacheShard *shard, const char *email, int id, uint32_t hash);
+void cache_unlink_locked(CacheShard *shard, CacheItem *item);
+void cache_evict_locked(CacheShard *shard);
+void cache_free(CacheItem *item);
+void cache_put_body(const char *email, const IndexEntry *entry, char *body);
+void cache_store_spool(const char *email, const IndexEntry *entry, int spool_fd, size_t content_len);
+CacheItem *cache_load_listing(const char *email, MailboxIndex *index);
+void cache_append_entry(const char *email, const IndexEntry *entry, int count);
+void cache_invalidate(const char *email, int id);
+void cache_listing_snapshot(CacheItem *item, int since_id, int *first, int *total);
+int cache_listing_seek_locked(CacheItem *item, int id);
+void cache_listing_read(CacheItem *item, int first, IndexEntry *entries, int n);
+size_t cache_format(char *text, size_t size);
+int snapshot_save();
+void snapshot_load();
 
 // Helper functions
 void create_mailbox_if_not_exists();
-void save_email(const char *recipient, const char *sender, const char *content);
+int deliver_email(ClientState *state, int spool_fd, size_t content_len, uint64_t *commit_seq);
+int deliver_sync(ClientState *state, const int *ids, const char *blob);
+int deliver_shared(ClientState *state, int spool_fd, size_t content_len, char *blob, int *ids);
+int save_email(const char *recipient, const char *sender, int spool_fd, size_t content_len);
+int mailbox_append_locked(const char *recipient, const char *sender, int spool_fd,
+                          size_t content_len, const char *blob, int id, ReplChange *change);
+int blob_create(int spool_fd, size_t content_len, char *name, size_t size);
+int blob_restore(const char *name, int spool_fd, size_t content_len);
+int blob_name_valid(const char *name);
+void blob_path_for(const char *name, char *path, size_t size);
+int copy_spool(int spool_fd, int dest_fd, off_t dest_offset, size_t len);
+int copy_range(int src_fd, off_t src_offset, int dest_fd, off_t dest_offset, size_t len);
 char *get_current_date();
-void send_response(int client_socket, const char *response);
+void send_response(Connection *conn, const char *response);
+void send_bytes(Connection *conn, const char *data, size_t len);
+ssize_t write_all(int fd, const char *data, size_t len);
+ssize_t read_all(int fd, char *data, size_t len);
+ssize_t pread_all(int fd, char *data, size_t len, off_t offset);
+int set_nonblocking(int fd);
+void print_usage(const char *prog);
 
 // Global variables
-pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t mailbox_locks[MAILBOX_LOCK_STRIPES];
+atomic_ulong mailbox_lock_acquired;
+atomic_ulong mailbox_lock_contended;
+atomic_uint blob_counter;
+atomic_ulong journal_records;
+atomic_ulong journal_syncs;
+Journal journal;
+__thread Connection *commit_waiters = NULL; // Sessions of this event loop awaiting a durable batch
+__thread Shard *current_shard = NULL;
+__thread IoRing *current_ring = NULL;  // Set while this thread's loop runs on io_uring
+__thread TimerWheel *current_wheel = NULL; // Session timers of this thread's event loop
+TimerWheel session_wheel;      // Session timers of thread mode, driven by timer_main()
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+int data_timeout = DEFAULT_DATA_TIMEOUT;
+int io_engine = ENGINE_EPOLL;
+int storage_engine = STORAGE_TEXT;
+int compress_codec = CODEC_NONE;
+int compact_threshold = DEFAULT_COMPACT_THRESHOLD;
+CompactQueue compact_queue;
+atomic_ulong emails_deleted;
+atomic_ulong compactions;
+atomic_ulong compacted_bytes;     // Mailbox bytes reclaimed by compaction
+atomic_ulong blobs_collected;     // Shared bodies removed once no email referred to them
+atomic_int blob_collect_due;      // Set when compaction left behind a reference to a shared body
+int blob_collect_enabled = 1;     // Off while mailboxes of the other storage engine hold references
+pthread_rwlock_t blob_lock = PTHREAD_RWLOCK_INITIALIZER; // Shared from a body's creation to its references
+Replica replicas[MAX_REPLICAS];
+int replica_count = 0;
+ReplLog repl_log = {
+    .first_seq = 1,
+    .next_seq = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+size_t repl_buffer_size = DEFAULT_REPL_BUFFER;
+int standby_port = 0;             // Set on a standby, which refuses writes from clients
+int standby_socket = -1;
+const char *standby_bind = DEFAULT_STANDBY_BIND; // Address the standby takes changes on
+const char *repl_secret = "";     // Shared by a primary and its standbys
+atomic_ulong standby_applied;     // Changes applied on this standby
+atomic_ullong standby_last_seq;   // Last change applied, in the primary's numbering
+const char *replica_state_names[] = {"connecting", "catching_up", "streaming"};
+atomic_ulong compress_bytes_in;   // Body bytes stored compressed, before compression
+atomic_ulong compress_bytes_out;  // The same bodies as stored
+uint32_t crc32c_table[256];
+CacheShard cache_shards[CACHE_SHARDS];
+size_t cache_size = DEFAULT_CACHE_SIZE;
+int cache_enabled = 0;
+size_t cache_item_limit;          // Larger bodies and listings are never cached
+Shard *shards = NULL;
+int shard_count = 1;
+int listeners[MAX_SHARDS];        // Client listeners, handed on to a successor
+int listener_count = 0;
+int inherited[MAX_SHARDS];        // Listeners taken over from the previous server
+int inherited_count = 0;
+int inherited_next = 0;           // Next of them listener_open() hands out
+const char *handoff_path = NULL;  // Unix socket a successor takes the listeners over on
+int handoff_socket = -1;
+atomic_int server_draining;       // Set once a restart or shutdown has begun
+atomic_int accepting_loops;       // Accept loops that have not stopped for it yet
+int drain_event_fd = -1;          // Readable once draining, to wake the event loops
+pthread_t main_thread;
+SessionList server_sessions = { .shared = 1, .lock = PTHREAD_MUTEX_INITIALIZER };
+__thread SessionList *current_sessions = NULL; // Sessions of this thread's event loop
+atomic_ullong next_connection_id;
+atomic_long active_connections;
+__thread BufferPool buffer_pool = { .keep = POOL_KEEP }; // This thread's free session buffers
+atomic_long session_bytes;        // Heap held by open sessions, their buffers included
+atomic_long pooled_bytes;         // Free session buffers in the pools or lent to io_uring
+ThreadMetrics *thread_metrics_list = NULL;
+ThreadMetrics retired_metrics;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t metrics_key;
+__thread ThreadMetrics *current_metrics;
+struct timespec server_started;
+int metrics_port = 0;
+const char *metric_names[METRIC_COUNT] = {
+    "HELO", "MAIL", "RCPT", "DATA", "LIST", "GET_MAIL", "STATS", "QUIT", "SEARCH", "DELETE", "OTHER", "DATA_END", "STORE"
+};
+atomic_int log_level = LOG_INFO;
+atomic_ulong log_dropped;
+unsigned long log_dropped_reported; // Guarded by log_rings_lock
+LogRing *log_rings = NULL;
+pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t log_ring_key;
+__thread LogRing *thread_log_ring;
+WorkQueue work_queue;
+int worker_count = 0;          // 0 sizes the pool from the number of cores
+int queue_size = DEFAULT_QUEUE_SIZE;
+int max_sessions = 0;          // 0 leaves only the pool and queue (thread mode) as limits
+int listen_backlog = DEFAULT_BACKLOG;
+int server_mode = MODE_THREADS;
+int durable_mode = 0;
+long commit_delay_us = DEFAULT_COMMIT_DELAY_US;
+size_t max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    static struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"max-message-size", required_argument, NULL, 's'},
+        {"durable", no_argument, NULL, 'd'},
+        {"commit-delay", required_argument, NULL, 'c'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"metrics-port", required_argument, NULL, 'p'},
+        {"workers", required_argument, NULL, 'w'},
+        {"queue", required_argument, NULL, 'q'},
+        {"max-sessions", required_argument, NULL, 'S'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"shards", required_argument, NULL, 'n'},
+        {"io-engine", required_argument, NULL, 'i'},
+        {"storage", required_argument, NULL, 'g'},
+        {"convert", no_argument, NULL, 'C'},
+        {"compress", required_argument, NULL, 'z'},
+        {"cache-size", required_argument, NULL, 'k'},
+        {"idle-timeout", required_argument, NULL, 't'},
+        {"data-timeout", required_argument, NULL, 'T'},
+        {"compact-threshold", required_argument, NULL, 'x'},
+        {"replica", required_argument, NULL, 'r'},
+        {"replication-buffer", required_argument, NULL, 'R'},
+        {"standby", required_argument, NULL, 'y'},
+        {"standby-bind", required_argument, NULL, 'Y'},
+        {"replication-secret", required_argument, NULL, 'K'},
+        {"handoff", required_argument, NULL, 'H'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int convert_only = 0;
+    int opt_char;
+    while ((opt_char = getopt_long(argc, argv, "m:s:dc:l:p:w:q:S:b:n:i:g:Cz:k:t:T:x:r:R:y:Y:K:H:h", long_options, NULL)) != -1) {
+        switch (opt_char) {
+        case 'm':
+            if (strcmp(optarg, "threads") == 0) {
+                server_mode = MODE_THREADS;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                server_mode = MODE_EPOLL;
+            } else {
+                fprintf(stderr, "Unknown mode: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's': {
+            // strtoull would take "-1" as the largest size, lifting the limit
+            char *end;
+            errno = 0;
+            unsigned long long size = strtoull(optarg, &end, 10);
+            if (!isdigit((unsigned char)optarg[0]) || *end != '\0' || errno == ERANGE || size == 0 ||
+                size > SIZE_MAX) {
+                fprintf(stderr, "Invalid maximum message size: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            max_message_size = size;
+            break;
+        }
+        case 'd':
+            durable_mode = 1;
+            break;
+        case 'c':
+            commit_delay_us = strtol(optarg, NULL, 10);
+            if (commit_delay_us < 0) {
+                fprintf(stderr, "Invalid commit delay: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            if (strcmp(optarg, "error") == 0) {
+                log_level = LOG_ERROR;
+            } else if (strcmp(optarg, "warn") == 0) {
+                log_level = LOG_WARN;
+            } else if (strcmp(optarg, "info") == 0) {
+                log_level = LOG_INFO;
+            } else if (strcmp(optarg, "debug") == 0) {
+                log_level = LOG_DEBUG;
+            } else {
+                fprintf(stderr, "Unknown log level: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            metrics_port = atoi(optarg);
+            if (metrics_port <= 0 || metrics_port > 65535) {
+                fprintf(stderr, "Invalid metrics port: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w':
+        case 'q':
+        case 'S':
+        case 'b': {
+            int value = atoi(optarg);
+            if (value <= 0) {
+                fprintf(stderr, "Invalid value for --%s: %s\n",
+                        opt_char == 'w' ? "workers" : opt_char == 'q' ? "queue" :
+                        opt_char == 'S' ? "max-sessions" : "backlog", optarg);
+                return 1;
+            }
+            if (opt_char == 'w') worker_count = value;
+            else if (opt_char == 'q') queue_size = value;
+            else if (opt_char == 'S') max_sessions = value;
+            else listen_backlog = value;
+            break;
+        }
+        case 'n':
+            // 0 starts one shard per core
+            shard_count = atoi(optarg);
+            if (shard_count < 0 || shard_count > MAX_SHARDS) {
+                fprintf(stderr, "Invalid shard count: %s\n", optarg);
+                return 1;
+            }
+            if (shard_count == 0) {
+                long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                shard_count = cores > 0 ? (cores < MAX_SHARDS ? cores : MAX_SHARDS) : 1;
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "epoll") == 0) {
+                io_engine = ENGINE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                io_engine = ENGINE_URING;
+            } else {
+                fprintf(stderr, "Unknown I/O engine: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'g':
+            if (strcmp(optarg, "text") == 0) {
+                storage_engine = STORAGE_TEXT;
+            } else if (strcmp(optarg, "segment") == 0) {
+                storage_engine = STORAGE_SEGMENT;
+            } else {
+                fprintf(stderr, "Unknown storage engine: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'C':
+            convert_only = 1;
+            break;
+        case 'k': {
+            char *end;
+            long long size = strtoll(optarg, &end, 10);
+            if (*end != '\0' || size < 0) {
+                fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                return 1;
+            }
+            cache_size = size;
+            break;
+        }
+        case 't':
+        case 'T': {
+            // Seconds; 0 disables
+            char *end;
+            long seconds = strtol(optarg, &end, 10);
+            if (*end != '\0' || seconds < 0 || seconds > INT_MAX / 1000) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                return 1;
+            }
+            if (opt_char == 't') idle_timeout = seconds;
+            else data_timeout = seconds;
+            break;
+        }
+        case 'x': {
+            // Percent; 0 never compacts
+            char *end;
+            long percent = strtol(optarg, &end, 10);
+            if (*end != '\0' || percent < 0 || percent > 100) {
+                fprintf(stderr, "Invalid compaction threshold: %s\n", optarg);
+                return 1;
+            }
+            compact_threshold = percent;
+            break;
+        }
+        case 'r': {
+            // host:port of a standby; may be given more than once
+            const char *colon = strrchr(optarg, ':');
+            int replica_port = colon ? atoi(colon + 1) : 0;
+            if (replica_count == MAX_REPLICAS || !colon || colon == optarg || colon - optarg >= 256 ||
+                replica_port <= 0 || replica_port > 65535) {
+                fprintf(stderr, "Invalid replica: %s\n", optarg);
+                return 1;
+            }
+            Replica *replica = &replicas[replica_count++];
+            snprintf(replica->host, sizeof(replica->host), "%.*s", (int)(colon - optarg), optarg);
+            replica->port = replica_port;
+            break;
+        }
+        case 'R': {
+            char *end;
+            long long size = strtoll(optarg, &end, 10);
+            if (*end != '\0' || size <= 0) {
+                fprintf(stderr, "Invalid replication buffer: %s\n", optarg);
+                return 1;
+            }
+            repl_buffer_size = size;
+            break;
+        }
+        case 'y':
+            standby_port = atoi(optarg);
+            if (standby_port <= 0 || standby_port > 65535) {
+                fprintf(stderr, "Invalid standby port: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'Y': {
+            struct in_addr address;
+            if (inet_pton(AF_INET, optarg, &address) != 1) {
+                fprintf(stderr, "Invalid standby address: %s\n", optarg);
+                return 1;
+            }
+            standby_bind = optarg;
+            break;
+        }
+        case 'K':
+            if (strlen(optarg) > REPL_MAX_SECRET) {
+                fprintf(stderr, "Replication secret too long (at most %d characters)\n", REPL_MAX_SECRET);
+                return 1;
+            }
+            repl_secret = optarg;
+            break;
+        case 'H':
+            if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+                fprintf(stderr, "Handoff socket path too long: %s\n", optarg);
+                return 1;
+            }
+            handoff_path = optarg;
+            break;
+        case 'z':
+            if (strcmp(optarg, "none") == 0) {
+                compress_codec = CODEC_NONE;
+            } else if (strcmp(optarg, "lz") == 0) {
+                compress_codec = CODEC_LZ;
+            } else {
+                fprintf(stderr, "Unknown codec: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Offline migration of text mailboxes to segments; no server is started
+    if (convert_only) {
+        if (optind != argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        log_init();
+        create_mailbox_if_not_exists();
+        crc32c_init();
+        return convert_mailboxes() == 0 ? 0 : 1;
+    }
+
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int port = atoi(argv[optind]);
+
+    // SIGINT and SIGTERM go to the restart thread; every thread created
+    // from here on inherits them blocked
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    log_init();
+    clock_gettime(CLOCK_MONOTONIC, &server_started);
+    pthread_key_create(&metrics_key, metrics_release);
+    int server_socket, client_socket;
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    if (shard_count > 1 && server_mode != MODE_EPOLL) {
+        fprintf(stderr, "--shards requires --mode epoll\n");
+        return 1;
+    }
+    if (io_engine == ENGINE_URING && server_mode != MODE_EPOLL) {
+        fprintf(stderr, "--io-engine uring requires --mode epoll\n");
+        return 1;
+    }
+    if (compress_codec != CODEC_NONE && storage_engine != STORAGE_SEGMENT) {
+        // Text mailboxes delimit emails with marker lines, so they hold text only
+        fprintf(stderr, "--compress requires --storage segment\n");
+        return 1;
+    }
+
+    // Take the listeners over from a running server, which returns once it
+    // has stopped, or create them; shards each have their own on the port
+    if (handoff_path) {
+        handoff_receive(handoff_path, port);
+    }
+    int listener_total = server_mode == MODE_EPOLL ? shard_count : 1;
+    for (int i = 0; i < listener_total; i++) {
+        if (listener_open(port, shard_count > 1) < 0) {
+            return 1;
+        }
+    }
+    if (inherited_next < inherited_count) {
+        log_message(LOG_WARN, 0, "Closing %d listeners taken over beyond the %d needed",
+                    inherited_count - inherited_next, listener_total);
+        while (inherited_next < inherited_count) {
+            close(inherited[inherited_next++]);
+        }
+    }
+    server_socket = listeners[0];
+
+    log_message(LOG_INFO, 0, "Listening on port %d", port);
+
+    // Create mailbox directory if it doesn't exist
+    create_mailbox_if_not_exists();
+    init_mailbox_locks();
+    crc32c_init();
+    storage_check();
+    cache_init();
+    snapshot_load();
+
+    // Replay the journal before any new message can be accepted
+    if (durable_mode && journal_open() != 0) {
+        close(server_socket);
         return 1;
     }
 
-    int port = atoi(argv[1]);
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    pthread_t thread_id;
+    // Mailboxes are compacted in the background once enough of them is deleted
+    if (compact_threshold > 0) {
+        compact_start();
+    }
+
+    // A standby takes the primary's changes on its own port, by default
+    // only from this host
+    if (standby_port) {
+        struct in_addr address;
+        inet_pton(AF_INET, standby_bind, &address);
+        standby_socket = create_listener(address.s_addr, standby_port, 0);
+        if (standby_socket < 0) {
+            close(server_socket);
+            return 1;
+        }
+        log_message(LOG_INFO, 0, "Standby: replication on %s:%d", standby_bind, standby_port);
+        if (address.s_addr != htonl(INADDR_LOOPBACK) && repl_secret[0] == '\0') {
+            log_message(LOG_WARN, 0, "Standby takes changes from any host that can reach %s; "
+                        "set --replication-secret", standby_bind);
+        }
+    }
+    if (replica_count > 0 || standby_socket >= 0) {
+        repl_start();
+    }
+
+    // Plain-text metrics for local scrapers
+    if (metrics_port) {
+        pthread_t metrics_thread_id;
+        if (thread_create(&metrics_thread_id, THREAD_STACK_SIZE, metrics_server, NULL) != 0) {
+            log_message(LOG_ERROR, 0, "Error creating metrics thread: %s", strerror(errno));
+        } else {
+            pthread_detach(metrics_thread_id);
+        }
+    }
+
+    // SIGINT, SIGTERM or a successor on the handoff socket stops the server
+    // once its sessions have finished their transactions
+    restart_start();
+
+    // Writes to a peer that went away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (server_mode == MODE_EPOLL) {
+        if (shard_count > 1) {
+            run_shards();
+        } else {
+            run_event_loop(server_socket);
+        }
+        close(server_socket);
+        return 0;
+    }
+
+    // A fixed pool serves sessions; accepted sessions wait in a bounded queue
+    start_workers(worker_count);
+
+    // Session threads block in recv(), so one thread expires them all
+    if (idle_timeout || data_timeout) {
+        timer_wheel_init(&session_wheel, 1, connection_timer_expired);
+        pthread_t timer_thread_id;
+        if (thread_create(&timer_thread_id, THREAD_STACK_SIZE, timer_main, NULL) != 0) {
+            log_message(LOG_ERROR, 0, "Error creating timer thread: %s", strerror(errno));
+            exit(1);
+        }
+        pthread_detach(timer_thread_id);
+    }
+
+    // Accept and handle client connections until a restart begins
+    while (!atomic_load(&server_draining)) {
+        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+        if (client_socket < 0) {
+            // The restart thread interrupts the wait
+            if (errno != EINTR) log_message(LOG_ERROR, 0, "Error accepting connection: %s", strerror(errno));
+            continue;
+        }
+
+        if (!admit_connection()) {
+            reject_connection(client_socket);
+            continue;
+        }
+
+        Connection *conn = connection_create(client_socket);
+        if (!conn) {
+            log_message(LOG_ERROR, 0, "Error allocating connection: %s", strerror(errno));
+            close(client_socket);
+            continue;
+        }
+
+        log_message(LOG_INFO, conn->id, "Client connected: %s", inet_ntoa(client_addr.sin_addr));
+
+        // Overload: refuse now rather than leave the client hanging
+        if (work_queue_push(conn) != 0) {
+            log_message(LOG_WARN, conn->id, "Work queue full, rejecting session");
+            send_response(conn, ERR_BUSY);
+            connection_flush(conn);
+            metrics_count(COUNTER_REJECTED, 1);
+            connection_destroy(conn);
+        }
+    }
+
+    // The listener stays open for a successor; the restart thread ends the
+    // process once the sessions have finished
+    atomic_fetch_sub(&accepting_loops, 1);
+    while (1) {
+        pause();
+    }
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--mode threads|epoll] [--max-message-size bytes] "
+                    "[--durable [--commit-delay usec]] [--log-level error|warn|info|debug]\n"
+                    "       [--metrics-port port] [--workers n] [--queue n] [--max-sessions n] [--backlog n]\n"
+                    "       [--shards n] [--io-engine epoll|uring] [--storage text|segment] [--compress none|lz]\n"
+                    "       [--cache-size bytes] [--idle-timeout sec] [--data-timeout sec]\n"
+                    "       [--compact-threshold percent] [--replica host:port]... [--replication-buffer bytes]\n"
+                    "       [--standby replication-port [--standby-bind address]] [--replication-secret secret]\n"
+                    "       [--handoff socket-path] <port>\n"
+                    "       %s [--compress none|lz] --convert\n",
+            prog, prog);
+}
+
+void *handle_client(void *arg) {
+    Connection *conn = arg;
+    int client_socket = conn->fd;
+    ssize_t bytes_read = 0;
+
+    // Send welcome message
+    send_response(conn, OK);
+    connection_flush(conn);
+
+    while (!conn->closing) {
+        // Run every complete command in the buffer, then write all of their
+        // replies at once so a pipelined batch costs one send
+        int paused = connection_process_input(conn);
+        if (connection_flush(conn) < 0 || conn->closing) break;
+        if (paused) continue;
+
+        // A restart lets sessions go between transactions; the restart
+        // thread cuts the recv() of those already waiting short
+        atomic_store(&conn->read_state, connection_idle(conn) ? READ_IDLE : READ_BUSY);
+        if (connection_drain_point(conn)) {
+            connection_flush(conn);
+            break;
+        }
+
+        // The reply buffer goes back to the pool while the session waits
+        connection_trim(conn);
+        if (connection_read_buffer(conn) < 0) break;
+        bytes_read = recv(client_socket, conn->rbuf + conn->rlen, BUFFER_SIZE - 1 - conn->rlen, 0);
+        if (atomic_exchange(&conn->read_state, READ_BUSY) == READ_CUT) {
+            // Nothing more can be read, so a command that slipped in is refused
+            log_message(LOG_INFO, conn->id, "Session closed for restart");
+            send_response(conn, ERR_SHUTDOWN);
+            connection_flush(conn);
+            conn->closing = 1;
+            break;
+        }
+        if (bytes_read <= 0) break;
+        conn->rlen += bytes_read;
+        connection_touch(conn);
+        metrics_count(COUNTER_BYTES_RECEIVED, bytes_read);
+    }
+
+    if (atomic_load(&conn->timed_out)) {
+        // The timer shut down the receiving side; the reply can still go out
+        log_message(LOG_INFO, conn->id, "Session timed out");
+        send_response(conn, ERR_TIMEOUT);
+        connection_flush(conn);
+    } else if (!conn->closing) {
+        if (bytes_read < 0) {
+            log_message(LOG_ERROR, conn->id, "Error reading from socket: %s", strerror(errno));
+        }
+        log_message(LOG_INFO, conn->id, "Client disconnected");
+    }
+
+    connection_destroy(conn);
+    return NULL;
+}
+
+int create_listener(in_addr_t address, int port, int reuseport) {
+    // Returns a listening socket on the address (network order) and port, or -1
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket < 0) {
+        log_message(LOG_ERROR, 0, "Error creating socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Set socket options to reuse address
+    int opt = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        log_message(LOG_ERROR, 0, "Error setting socket options: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+
+    // Sharded listeners share the port; the kernel spreads connections across them
+    if (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_message(LOG_ERROR, 0, "Error setting SO_REUSEPORT: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+
+    // Initialize server address
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = address;
+    server_addr.sin_port = htons(port);
+
+    // Bind socket to the specified port
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        log_message(LOG_ERROR, 0, "Error binding socket: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+
+    // Listen for incoming connections
+    if (listen(server_socket, listen_backlog) < 0) {
+        log_message(LOG_ERROR, 0, "Error listening: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+int listener_open(int port, int reuseport) {
+    // Returns the next listener taken over from the previous server, or a
+    // new one, and records it for handing on to a successor
+    int fd = inherited_next < inherited_count ? inherited[inherited_next++] : create_listener(htonl(INADDR_ANY), port, reuseport);
+    if (fd >= 0) {
+        listeners[listener_count++] = fd;
+    }
+    return fd;
+}
+
+int handoff_receive(const char *path, int port) {
+    // Takes over the listeners of a server running with the same handoff
+    // socket, then waits for it to drain its sessions and exit. Connections
+    // arriving meanwhile wait in the listeners' backlog, so none is refused.
+    // Returns the number of listeners taken over, 0 if no server answered.
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_message(LOG_ERROR, 0, "Error creating handoff socket: %s", strerror(errno));
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        // Nobody to take over from: a cold start
+        close(fd);
+        return 0;
+    }
+
+    // The listeners come in batches, each behind a header saying how many follow
+    HandoffHeader header;
+    header.remaining = 1;
+    int listener_port = port;
+    while (header.remaining > 0) {
+        char control[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+        struct iovec iov = { &header, sizeof(header) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(fd, &msg, MSG_WAITALL);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (n != sizeof(header) || header.magic != HANDOFF_MAGIC || !cmsg ||
+            cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            log_message(LOG_WARN, 0, "No listeners received on %s", path);
+            break;
+        }
+        listener_port = header.port;
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int listener;
+            memcpy(&listener, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (inherited_count == MAX_SHARDS) {
+                close(listener);
+                continue;
+            }
+            inherited[inherited_count++] = listener;
+        }
+    }
+
+    log_message(LOG_INFO, 0, "Took over %d listeners; waiting for the old server to finish its sessions",
+                inherited_count);
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // The old server closes its end by exiting
+    char byte;
+    while (read(fd, &byte, sizeof(byte)) > 0) {}
+    close(fd);
+    log_message(LOG_INFO, 0, "Old server stopped after %u ms", elapsed_us(&started) / 1000);
+
+    // The flag is shared with the old server, whose event loops set it and
+    // must not block in accept() while they still run
+    for (int i = 0; i < inherited_count; i++) {
+        int flags = fcntl(inherited[i], F_GETFL);
+        if (flags >= 0) fcntl(inherited[i], F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    if (inherited_count > 0 && listener_port != port) {
+        log_message(LOG_WARN, 0, "Listeners taken over are for port %d, not %d", listener_port, port);
+        while (inherited_count > 0) {
+            close(inherited[--inherited_count]);
+        }
+    }
+    return inherited_count;
+}
+
+int handoff_send(int fd) {
+    // Passes every client listener to a successor over the handoff socket.
+    // Returns -1 if they could not all be sent.
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(listeners[0], (struct sockaddr *)&addr, &addr_len) < 0) {
+        log_message(LOG_ERROR, 0, "Error handing over listeners: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int sent = 0; sent < listener_count; ) {
+        int count = listener_count - sent < HANDOFF_BATCH ? listener_count - sent : HANDOFF_BATCH;
+        HandoffHeader header = { HANDOFF_MAGIC, ntohs(addr.sin_port), count, listener_count - sent - count };
+
+        char control[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+        memset(control, 0, sizeof(control));
+        struct iovec iov = { &header, sizeof(header) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), listeners + sent, count * sizeof(int));
+
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header)) {
+            log_message(LOG_ERROR, 0, "Error handing over listeners: %s", strerror(errno));
+            return -1;
+        }
+        sent += count;
+    }
+
+    log_message(LOG_INFO, 0, "Handed %d listeners to a new server", listener_count);
+    return 0;
+}
+
+void restart_start() {
+    // Starts the thread that stops the server on SIGINT or SIGTERM, or hands
+    // it over when a successor connects to the handoff socket
+    main_thread = pthread_self();
+    atomic_store(&accepting_loops, server_mode == MODE_EPOLL ? shard_count : 1);
+
+    drain_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (drain_event_fd < 0) {
+        log_message(LOG_ERROR, 0, "Error creating drain event: %s", strerror(errno));
+        exit(1);
+    }
+
+    // Interrupts the thread mode accept() without restarting it
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = restart_wake;
+    sigaction(SIGUSR2, &action, NULL);
+
+    if (handoff_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", handoff_path);
+
+        // Any socket file left there belongs to a server that has stopped
+        unlink(handoff_path);
+        handoff_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (handoff_socket < 0 || bind(handoff_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(handoff_socket, 1) < 0) {
+            log_message(LOG_ERROR, 0, "Error creating handoff socket: %s", strerror(errno));
+            exit(1);
+        }
+        log_message(LOG_INFO, 0, "Handoff: a new server takes over on %s", handoff_path);
+    }
+
+    pthread_t thread_id;
+    if (thread_create(&thread_id, THREAD_STACK_SIZE, restart_thread, NULL) != 0) {
+        log_message(LOG_ERROR, 0, "Error creating restart thread: %s", strerror(errno));
+        exit(1);
+    }
+    pthread_detach(thread_id);
+}
+
+void restart_wake(int sig) {
+    (void)sig;
+}
+
+void *restart_thread(void *arg) {
+    // Waits for a shutdown signal or a successor, then stops accepting, lets
+    // every session finish its transaction, saves the cache snapshot and
+    // exits. A successor holds the listeners by then, and waits on the
+    // handoff socket for this process to go.
+    (void)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        log_message(LOG_ERROR, 0, "Error creating signal descriptor: %s", strerror(errno));
+        exit(1);
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = signal_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = handoff_socket;
+    fds[1].events = POLLIN;
+    int successor = -1;
+    while (successor < 0) {
+        if (poll(fds, handoff_socket >= 0 ? 2 : 1, -1) < 0) {
+            if (errno != EINTR) log_message(LOG_ERROR, 0, "Error waiting for shutdown: %s", strerror(errno));
+            continue;
+        }
+
+        struct signalfd_siginfo info;
+        if ((fds[0].revents & POLLIN) && read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            log_message(LOG_INFO, 0, "Shutting down on %s", strsignal(info.ssi_signo));
+            break;
+        }
+
+        if (handoff_socket >= 0 && (fds[1].revents & POLLIN)) {
+            successor = accept4(handoff_socket, NULL, NULL, SOCK_CLOEXEC);
+            if (successor >= 0 && handoff_send(successor) != 0) {
+                close(successor);
+                successor = -1;
+            }
+        }
+    }
+
+    // Stop accepting. The listeners stay open, so new connections wait in
+    // their backlog for the successor.
+    atomic_store(&server_draining, 1);
+    uint64_t one = 1;
+    if (write(drain_event_fd, &one, sizeof(one)) < 0) {
+        log_message(LOG_ERROR, 0, "Error waking event loops: %s", strerror(errno));
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    while (atomic_load(&accepting_loops) > 0 || atomic_load(&active_connections) > 0) {
+        if (elapsed_us(&started) >= DRAIN_TIMEOUT * 1000000u) {
+            log_message(LOG_WARN, 0, "%ld sessions still open after %d seconds, closing them",
+                        atomic_load(&active_connections), DRAIN_TIMEOUT);
+            break;
+        }
+        if (server_mode == MODE_THREADS) {
+            // Signals and shutdowns can race with the threads entering their
+            // waits, so they are repeated until everyone has left
+            if (atomic_load(&accepting_loops) > 0) pthread_kill(main_thread, SIGUSR2);
+            session_list_drain(&server_sessions);
+        }
+        usleep(DRAIN_POLL_MS * 1000);
+    }
+    log_message(LOG_INFO, 0, "Sessions drained in %u ms", elapsed_us(&started) / 1000);
+
+    snapshot_save();
+    log_message(LOG_INFO, 0, "Server stopped");
+    exit(0);
+}
+
+void session_list_add(Connection *conn) {
+    SessionList *list = current_sessions ? current_sessions : &server_sessions;
+    conn->sessions = list;
+    if (list->shared) pthread_mutex_lock(&list->lock);
+    conn->session_prev = NULL;
+    conn->session_next = list->head;
+    if (list->head) list->head->session_prev = conn;
+    list->head = conn;
+    if (list->shared) pthread_mutex_unlock(&list->lock);
+}
+
+void session_list_remove(Connection *conn) {
+    SessionList *list = conn->sessions;
+    if (list->shared) pthread_mutex_lock(&list->lock);
+    if (conn->session_prev) {
+        conn->session_prev->session_next = conn->session_next;
+    } else {
+        list->head = conn->session_next;
+    }
+    if (conn->session_next) conn->session_next->session_prev = conn->session_prev;
+    if (list->shared) pthread_mutex_unlock(&list->lock);
+}
+
+void session_list_drain(SessionList *list) {
+    // Closes the sessions that are between transactions. An event loop does
+    // this itself; in thread mode the restart thread can only cut short the
+    // recv() of idle sessions, and their workers say goodbye.
+    if (list->shared) {
+        pthread_mutex_lock(&list->lock);
+        for (Connection *conn = list->head; conn; conn = conn->session_next) {
+            int idle = READ_IDLE;
+            if (atomic_compare_exchange_strong(&conn->read_state, &idle, READ_CUT)) {
+                shutdown(conn->fd, SHUT_RD);
+            }
+        }
+        pthread_mutex_unlock(&list->lock);
+        return;
+    }
+
+    Connection *conn = list->head;
+    while (conn) {
+        Connection *next = conn->session_next;
+        connection_drain(conn);
+        conn = next;
+    }
+}
+
+int connection_idle(Connection *conn) {
+    // Between transactions, with no command or reply in progress
+    return conn->phase == PHASE_COMMAND && !conn->state.has_sender && conn->rlen == 0 &&
+           !conn->commit_seq && !connection_output_pending(conn);
+}
+
+int connection_drain_point(Connection *conn) {
+    // Called before waiting for the next command: once a restart has begun,
+    // an idle session is told to come back and closed. Returns nonzero if so.
+    if (!atomic_load(&server_draining) || !connection_idle(conn)) return 0;
+
+    // Closing over input the client already sent would reset the connection
+    char byte;
+    if (recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0) return 0;
+
+    log_message(LOG_INFO, conn->id, "Session closed for restart");
+    send_response(conn, ERR_SHUTDOWN);
+    conn->closing = 1;
+    return 1;
+}
+
+void connection_drain(Connection *conn) {
+    // Runs on the session's event loop when a restart begins. Sessions in a
+    // transaction are left to reach their next drain point.
+    if (!current_ring) {
+        connection_resume(conn);
+        return;
+    }
+
+    // Idle with only its receive queued: cancel it, and the session reaches
+    // its drain point when the cancel (or input that beat it) completes
+    if (connection_idle(conn) && conn->io_inflight > 0) {
+        uint64_t recv_data = (uint64_t)(uintptr_t)conn | URING_RECV;
+        uring_prep(current_ring, IORING_OP_ASYNC_CANCEL, -1, (void *)(uintptr_t)recv_data, 0, 0, 0,
+                   URING_DRAIN_DATA);
+    }
+}
+
+void run_shards() {
+    // Shard 0 runs on the main thread with the first listener; every other
+    // shard gets its own thread and listener
+    shards = calloc(shard_count, sizeof(Shard));
+    if (!shards) {
+        log_message(LOG_ERROR, 0, "Error allocating shards: %s", strerror(errno));
+        return;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].index = i;
+        shards[i].cpu = i % cores;
+        shards[i].listen_fd = listeners[i];
+    }
+
+    for (int i = 1; i < shard_count; i++) {
+        pthread_t thread_id;
+        if (thread_create(&thread_id, THREAD_STACK_SIZE, shard_main, &shards[i]) != 0) {
+            log_message(LOG_ERROR, 0, "Error creating shard thread: %s", strerror(errno));
+            exit(1);
+        }
+        pthread_detach(thread_id);
+    }
+
+    log_message(LOG_INFO, 0, "Started %d shards", shard_count);
+    shard_main(&shards[0]);
+}
+
+void *shard_main(void *arg) {
+    Shard *shard = arg;
+
+    // Keep the shard's sessions, caches and interrupts on one CPU
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (status != 0) {
+        errno = status;
+        log_message(LOG_ERROR, 0, "Error pinning shard: %s", strerror(errno));
+    }
+
+    current_shard = shard;
+    shard->metrics = metrics_thread();
+    run_event_loop(shard->listen_fd);
+    return NULL;
+}
+
+void start_workers(int count) {
+    if (count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (cores > 0 ? cores : 1) * WORKERS_PER_CORE;
+    }
+
+    work_queue.items = calloc(queue_size, sizeof(Connection *));
+    work_queue.capacity = queue_size;
+    if (!work_queue.items) {
+        log_message(LOG_ERROR, 0, "Error allocating work queue: %s", strerror(errno));
+        exit(1);
+    }
+    pthread_mutex_init(&work_queue.lock, NULL);
+    pthread_cond_init(&work_queue.not_empty, NULL);
+
+    for (int i = 0; i < count; i++) {
+        pthread_t thread_id;
+        if (thread_create(&thread_id, SESSION_STACK_SIZE, worker_main, NULL) != 0) {
+            log_message(LOG_ERROR, 0, "Error creating worker thread: %s", strerror(errno));
+            exit(1);
+        }
+        pthread_detach(thread_id);
+    }
+
+    log_message(LOG_INFO, 0, "Started %d workers, queue of %d sessions", count, queue_size);
+}
+
+void *worker_main(void *arg) {
+    (void)arg;
+    // A worker serves one session at a time; a spare buffer kept per worker
+    // would cost as much as the session's own
+    buffer_pool.keep = 0;
+    while (1) {
+        handle_client(work_queue_pop());
+    }
+    return NULL;
+}
+
+int work_queue_push(Connection *conn) {
+    // Returns -1 without blocking when the queue is full
+    pthread_mutex_lock(&work_queue.lock);
+    if (work_queue.count == work_queue.capacity) {
+        pthread_mutex_unlock(&work_queue.lock);
+        return -1;
+    }
+    work_queue.items[(work_queue.head + work_queue.count) % work_queue.capacity] = conn;
+    work_queue.count++;
+    pthread_cond_signal(&work_queue.not_empty);
+    pthread_mutex_unlock(&work_queue.lock);
+    return 0;
+}
+
+Connection *work_queue_pop() {
+    pthread_mutex_lock(&work_queue.lock);
+    while (work_queue.count == 0) {
+        pthread_cond_wait(&work_queue.not_empty, &work_queue.lock);
+    }
+    Connection *conn = work_queue.items[work_queue.head];
+    work_queue.head = (work_queue.head + 1) % work_queue.capacity;
+    work_queue.count--;
+    pthread_mutex_unlock(&work_queue.lock);
+    return conn;
+}
+
+int admit_connection() {
+    // Enforces --max-sessions. Sharded loops admit concurrently, so the limit
+    // can be overshot by at most one session per shard.
+    return max_sessions == 0 || atomic_load(&active_connections) < max_sessions;
+}
+
+void reject_connection(int fd) {
+    // Best effort: a temporary failure the client can retry, then close
+    metrics_count(COUNTER_REJECTED, 1);
+    send(fd, ERR_BUSY, strlen(ERR_BUSY), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+}
+
+void run_event_loop(int server_socket) {
+    // Every idle session holds a descriptor, so lift the soft limit as far as allowed
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // The loop's sessions, for a restart to find
+    SessionList sessions;
+    memset(&sessions, 0, sizeof(sessions));
+    current_sessions = &sessions;
+
+    // Session timers are only touched by this loop, so the wheel takes no lock
+    TimerWheel wheel;
+    if (idle_timeout || data_timeout) {
+        timer_wheel_init(&wheel, 0, connection_timer_expired);
+        current_wheel = &wheel;
+    }
+
+    // Runs until the server stops unless this kernel cannot provide io_uring
+    if (io_engine == ENGINE_URING) {
+        if (run_uring_loop(server_socket) == 0) return;
+        log_message(LOG_WARN, 0, "io_uring unavailable (%s), using epoll", strerror(errno));
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        log_message(LOG_ERROR, 0, "Error creating epoll instance: %s", strerror(errno));
+        return;
+    }
+
+    if (set_nonblocking(server_socket) < 0) {
+        log_message(LOG_ERROR, 0, "Error making server socket non-blocking: %s", strerror(errno));
+        close(epoll_fd);
+        return;
+    }
+
+    // The listening socket is registered with a NULL pointer, connections with their state
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        log_message(LOG_ERROR, 0, "Error registering server socket: %s", strerror(errno));
+        close(epoll_fd);
+        return;
+    }
+
+    // A restart leaves the drain eventfd readable; it leaves the set once seen
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &drain_event_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, drain_event_fd, &ev) < 0) {
+        log_message(LOG_ERROR, 0, "Error registering drain event: %s", strerror(errno));
+        close(epoll_fd);
+        return;
+    }
+    int accepting = 1;
+
+    // The commit thread signals durable batches through an eventfd per loop
+    int journal_event_fd = -1;
+    if (durable_mode) {
+        journal_event_fd = eventfd(0, EFD_NONBLOCK);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &journal;
+        if (journal_event_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, journal_event_fd, &ev) < 0) {
+            log_message(LOG_ERROR, 0, "Error registering journal event: %s", strerror(errno));
+            close(epoll_fd);
+            return;
+        }
+
+        pthread_mutex_lock(&journal.lock);
+        journal.event_fds[journal.event_fd_count++] = journal_event_fd;
+        pthread_mutex_unlock(&journal.lock);
+    }
+
+    log_message(LOG_INFO, 0, "Event loop started");
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // Wake up every tick while any session timer is armed
+        int wait_ms = current_wheel && current_wheel->count ? TIMER_TICK_MS : -1;
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_ERROR, 0, "Error waiting for events: %s", strerror(errno));
+            break;
+        }
+
+        int durable_batch = 0;
+        int drain = 0;
+        for (int i = 0; i < count; i++) {
+            Connection *conn = events[i].data.ptr;
+
+            if (events[i].data.ptr == &drain_event_fd) {
+                // Restart: stop accepting now, let idle sessions go after the batch
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_socket, NULL);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, drain_event_fd, NULL);
+                atomic_fetch_sub(&accepting_loops, 1);
+                accepting = 0;
+                drain = 1;
+                continue;
+            }
+
+            if (events[i].data.ptr == &journal) {
+                // Handled after this batch, since resuming a connection may close it
+                uint64_t batches;
+                while (read(journal_event_fd, &batches, sizeof(batches)) > 0) {}
+                durable_batch = 1;
+                continue;
+            }
+
+            if (conn == NULL) {
+                // Accept every pending connection (edge-triggered)
+                while (accepting) {
+                    struct sockaddr_in client_addr;
+                    socklen_t client_len = sizeof(client_addr);
+                    int client_socket = accept4(server_socket, (struct sockaddr *)&client_addr,
+                                                &client_len, SOCK_NONBLOCK);
+                    if (client_socket < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            log_message(LOG_ERROR, 0, "Error accepting connection: %s", strerror(errno));
+                        }
+                        break;
+                    }
+
+                    if (!admit_connection()) {
+                        reject_connection(client_socket);
+                        continue;
+                    }
+
+                    Connection *client = connection_create(client_socket);
+                    if (!client) {
+                        log_message(LOG_ERROR, 0, "Error allocating connection: %s", strerror(errno));
+                        close(client_socket);
+                        continue;
+                    }
+
+                    log_message(LOG_INFO, client->id, "Client connected: %s",
+                                inet_ntoa(client_addr.sin_addr));
+
+                    struct epoll_event client_ev;
+                    memset(&client_ev, 0, sizeof(client_ev));
+                    client_ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    client_ev.data.ptr = client;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &client_ev) < 0) {
+                        log_message(LOG_ERROR, client->id, "Error registering client socket: %s", strerror(errno));
+                        connection_destroy(client);
+                        continue;
+                    }
+
+                    // Send welcome message
+                    send_response(client, OK);
+                    if (connection_flush(client) < 0) {
+                        connection_destroy(client);
+                    } else {
+                        connection_trim(client);
+                    }
+                }
+                continue;
+            }
+
+            int dead = 0;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                dead = 1;
+            } else if (connection_flush(conn) < 0) {
+                dead = 1;
+            } else if (!connection_output_pending(conn)) {
+                // Input is only read while no reply is waiting for socket space,
+                // so a drained socket may still hold unread commands
+                connection_on_readable(conn);
+                if (connection_flush(conn) < 0) dead = 1;
+            }
+
+            // Close once the peer is gone or the goodbye has been written out
+            if (dead || (conn->closing && !connection_output_pending(conn))) {
+                if (!conn->closing) {
+                    log_message(LOG_INFO, conn->id, "Client disconnected");
+                }
+                connection_destroy(conn);
+            } else {
+                connection_trim(conn);
+            }
+        }
+
+        if (durable_batch) {
+            release_durable_replies();
+        }
+
+        if (drain) {
+            session_list_drain(&sessions);
+        }
+
+        // Expired sessions are closed after the batch, which may still name them
+        if (current_wheel) {
+            timer_advance(current_wheel, timer_now());
+        }
+    }
+
+    close(epoll_fd);
+}
+
+void release_durable_replies() {
+    // Sends the replies held back for records that are now on disk and
+    // resumes the commands that queued up behind them
+    pthread_mutex_lock(&journal.lock);
+    uint64_t durable = journal.durable_seq;
+    pthread_mutex_unlock(&journal.lock);
+
+    Connection **link = &commit_waiters;
+    while (*link) {
+        Connection *conn = *link;
+        // Queuing the reply could move wbuf under a send the kernel still holds
+        if (conn->commit_seq > durable || conn->io_inflight) {
+            link = &conn->commit_next;
+            continue;
+        }
+
+        *link = conn->commit_next;
+        conn->commit_seq = 0;
+        send_response(conn, conn->commit_reply);
+        connection_resume(conn);
+    }
+}
+
+void connection_resume(Connection *conn) {
+    // Continues a session after its held-back reply was queued
+    if (current_ring) {
+        uring_pump(conn);
+        return;
+    }
+
+    int dead = connection_flush(conn) < 0;
+    if (!dead && !connection_output_pending(conn)) {
+        connection_on_readable(conn);
+        if (connection_flush(conn) < 0) dead = 1;
+    }
+    if (dead || (conn->closing && !connection_output_pending(conn))) {
+        connection_destroy(conn);
+    } else {
+        connection_trim(conn);
+    }
+}
+
+int uring_open(IoRing *ring, unsigned entries) {
+    // Returns -1 with errno set if the kernel lacks io_uring or an opcode we use
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 2;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    // One mapping for both rings (5.4) and no dropped completions (5.5)
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Socket opcodes arrived in 5.5 and 5.6, provided buffers in 5.7; ask
+    // rather than guess from the version
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_TIMEOUT,
+                           IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_PROVIDE_BUFFERS };
+    int supported = probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!supported) {
+        close(ring->fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_mem, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *base = ring->ring_mem;
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    ring->pending = 0;
+    return 0;
+}
+
+void uring_close(IoRing *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_mem, ring->ring_size);
+    close(ring->fd);
+}
+
+int uring_prep(IoRing *ring, int opcode, int fd, void *addr, size_t len, uint64_t offset,
+               int flags, uint64_t user_data) {
+    // Queues one operation; it reaches the kernel with the next uring_submit().
+    // Returns -1 if the queue is full and cannot be flushed.
+    if (ring->pending == ring->sq_entries && uring_submit(ring, 0) < 0) {
+        return -1;
+    }
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+
+    // The kernel must see the entry before the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return 0;
+}
+
+int uring_submit(IoRing *ring, unsigned wait) {
+    // Hands every queued SQE to the kernel, optionally waiting for completions
+    while (1) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+                                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ring->pending -= submitted;
+        return 0;
+    }
+}
+
+int run_uring_loop(int server_socket) {
+    // Completion-driven counterpart of the epoll loop: each session always
+    // has exactly the operation it is waiting on queued in the ring (a receive
+    // when idle, a send while replies are pending, a mailbox read while a
+    // GET_MAIL body streams), and a wakeup handles up to URING_BATCH results
+    // and submits everything they queued with one system call.
+    IoRing ring;
+    if (uring_open(&ring, URING_ENTRIES) < 0) {
+        return -1;
+    }
+    current_ring = &ring;
+
+    // Idle sessions receive into buffers the loop lends the kernel
+    memset(ring.recv_buffers, 0, sizeof(ring.recv_buffers));
+    for (int i = 0; i < URING_RECV_BUFFERS; i++) {
+        uring_provide(&ring, i);
+    }
+
+    // The commit thread signals durable batches through an eventfd per loop
+    int journal_event_fd = -1;
+    uint64_t batches;
+    if (durable_mode) {
+        journal_event_fd = eventfd(0, 0);
+        if (journal_event_fd < 0) {
+            log_message(LOG_ERROR, 0, "Error registering journal event: %s", strerror(errno));
+            exit(1);
+        }
+        pthread_mutex_lock(&journal.lock);
+        journal.event_fds[journal.event_fd_count++] = journal_event_fd;
+        pthread_mutex_unlock(&journal.lock);
+        uring_prep(&ring, IORING_OP_READ, journal_event_fd, &batches, sizeof(batches), 0, 0,
+                   URING_JOURNAL_DATA);
+    }
+
+    // A restart leaves the drain eventfd readable
+    int draining = 0;
+    uring_prep(&ring, IORING_OP_POLL_ADD, drain_event_fd, NULL, 0, 0, POLLIN, URING_DRAIN_DATA);
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    uring_prep(&ring, IORING_OP_ACCEPT, server_socket, &client_addr, 0,
+               (uint64_t)(uintptr_t)&client_len, 0, URING_ACCEPT_DATA);
+
+    // While session timers are armed a timeout completes every tick
+    struct __kernel_timespec tick = { 0, TIMER_TICK_MS * 1000000L };
+    int tick_queued = 0;
+
+    log_message(LOG_INFO, 0, "Event loop started (io_uring)");
+
+    while (1) {
+        if (current_wheel && current_wheel->count && !tick_queued) {
+            tick_queued = uring_prep(&ring, IORING_OP_TIMEOUT, -1, &tick, 1, 0, 0, URING_TIMER_DATA) == 0;
+        }
+        if (uring_submit(&ring, 1) < 0) {
+            // EBUSY: completions are backed up; handling them makes room
+            if (errno != EBUSY) {
+                log_message(LOG_ERROR, 0, "Error submitting to io_uring: %s", strerror(errno));
+                break;
+            }
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (int handled = 0; head != tail && handled < URING_BATCH; handled++, head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            // Release the slot before handling, which may queue more work
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (data == URING_TIMER_DATA) {
+                tick_queued = 0;
+                timer_advance(current_wheel, timer_now());
+                continue;
+            }
+
+            if (data == URING_JOURNAL_DATA) {
+                release_durable_replies();
+                uring_prep(&ring, IORING_OP_READ, journal_event_fd, &batches, sizeof(batches), 0, 0,
+                           URING_JOURNAL_DATA);
+                continue;
+            }
+
+            if (data == URING_DRAIN_DATA) {
+                // Restart: cancel the accept, whose completion stops the
+                // accepting, and let idle sessions go. The cancel's own
+                // completion comes back here too.
+                if (!draining) {
+                    draining = 1;
+                    uring_prep(&ring, IORING_OP_ASYNC_CANCEL, -1, (void *)(uintptr_t)URING_ACCEPT_DATA,
+                               0, 0, 0, URING_DRAIN_DATA);
+                    session_list_drain(current_sessions);
+                }
+                continue;
+            }
+
+            if (data == URING_ACCEPT_DATA) {
+                if (res >= 0) {
+                    if (!admit_connection()) {
+                        reject_connection(res);
+                    } else {
+                        Connection *client = connection_create(res);
+                        if (!client) {
+                            log_message(LOG_ERROR, 0, "Error allocating connection: %s", strerror(errno));
+                            close(res);
+                        } else {
+                            log_message(LOG_INFO, client->id, "Client connected: %s",
+                                        inet_ntoa(client_addr.sin_addr));
+
+                            // Send welcome message
+                            send_response(client, OK);
+                            uring_pump(client);
+                        }
+                    }
+                } else if (res != -EINTR && res != -EAGAIN && !(draining && res == -ECANCELED)) {
+                    errno = -res;
+                    log_message(LOG_ERROR, 0, "Error accepting connection: %s", strerror(errno));
+                }
+                if (draining) {
+                    atomic_fetch_sub(&accepting_loops, 1);
+                    continue;
+                }
+                client_len = sizeof(client_addr);
+                uring_prep(&ring, IORING_OP_ACCEPT, server_socket, &client_addr, 0,
+                           (uint64_t)(uintptr_t)&client_len, 0, URING_ACCEPT_DATA);
+                continue;
+            }
+
+            if (data == URING_PROVIDE_DATA) {
+                if (res < 0) {
+                    errno = -res;
+                    log_message(LOG_ERROR, 0, "Error providing read buffers: %s", strerror(errno));
+                }
+                continue;
+            }
+
+            Connection *conn = (Connection *)(uintptr_t)(data & ~(uint64_t)URING_TAG_MASK);
+            conn->io_inflight--;
+            if (flags & IORING_CQE_F_BUFFER) {
+                uring_adopt(&ring, conn, flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            uring_complete(conn, data & URING_TAG_MASK, res);
+            uring_pump(conn);
+        }
+    }
+
+    current_ring = NULL;
+    uring_close(&ring);
+    for (int i = 0; i < URING_RECV_BUFFERS; i++) {
+        if (!ring.recv_buffers[i]) continue;
+        free(ring.recv_buffers[i]);
+        atomic_fetch_sub(&pooled_bytes, BUFFER_SIZE);
+    }
+    return 0;
+}
+
+struct io_uring_sqe *uring_last(IoRing *ring) {
+    // The entry uring_prep() queued last, for the fields it does not set
+    return &ring->sqes[(*ring->sq_tail - 1) & *ring->sq_mask];
+}
+
+void uring_provide(IoRing *ring, int id) {
+    // Lends the kernel a pool buffer as read buffer <id> of the loop's group
+    char *buf = buffer_get();
+    if (!buf) {
+        log_message(LOG_ERROR, 0, "Error allocating read buffer: %s", strerror(errno));
+        return;
+    }
+    if (uring_prep(ring, IORING_OP_PROVIDE_BUFFERS, 1, buf, BUFFER_SIZE - 1, id, 0, URING_PROVIDE_DATA) < 0) {
+        buffer_put(buf, BUFFER_SIZE);
+        return;
+    }
+    uring_last(ring)->buf_group = URING_BUFFER_GROUP;
+    ring->recv_buffers[id] = buf;
+    atomic_fetch_add(&pooled_bytes, BUFFER_SIZE);
+}
+
+void uring_adopt(IoRing *ring, Connection *conn, int id) {
+    // A receive filled read buffer <id>: it becomes the session's rbuf and
+    // the group gets a fresh one in its place
+    if (id < 0 || id >= URING_RECV_BUFFERS || !ring->recv_buffers[id]) return;
+    conn->rbuf = ring->recv_buffers[id];
+    ring->recv_buffers[id] = NULL;
+    atomic_fetch_sub(&pooled_bytes, BUFFER_SIZE);
+    session_memory(BUFFER_SIZE);
+    uring_provide(ring, id);
+}
+
+void uring_complete(Connection *conn, int op, int res) {
+    // Applies the result of one operation to the session
+    if (res == -EINTR || res == -EAGAIN || res == -ECANCELED) {
+        return;  // Nothing happened (or a restart cancelled it); uring_pump() queues it again
+    }
+    if (res == -ENOBUFS && op == URING_RECV) {
+        // Every read buffer of the loop is taken; the session uses its own
+        conn->recv_fallback = 1;
+        return;
+    }
+
+    if (res < 0 || (res == 0 && op != URING_RECV)) {
+        if (!conn->closing) {
+            errno = res < 0 ? -res : EIO;
+            if (op == URING_RECV) {
+                log_message(LOG_ERROR, conn->id, "Error reading from socket: %s", strerror(errno));
+            } else if (op == URING_READ_FILE) {
+                // The file is shorter than the index claims, or unreadable
+                log_message(LOG_ERROR, conn->id, "Error sending email: %s", strerror(errno));
+            } else if (errno != EPIPE && errno != ECONNRESET) {
+                log_message(LOG_ERROR, conn->id, "Error sending response: %s", strerror(errno));
+            }
+            log_message(LOG_INFO, conn->id, "Client disconnected");
+        }
+
+        // The peer is gone: nothing queued can be delivered any more
+        conn->closing = 1;
+        conn->wlen = conn->wsent = 0;
+        conn->flen = conn->fsent = 0;
+        if (conn->file_fd >= 0) {
+            close(conn->file_fd);
+            conn->file_fd = -1;
+        }
+        list_close(conn);
+        return;
+    }
+
+    switch (op) {
+    case URING_RECV:
+        if (res == 0) {
+            if (!conn->closing) log_message(LOG_INFO, conn->id, "Client disconnected");
+            conn->closing = 1;
+            break;
+        }
+        conn->rlen += res;
+        connection_touch(conn);
+        metrics_count(COUNTER_BYTES_RECEIVED, res);
+        break;
+    case URING_SEND:
+        conn->wsent += res;
+        connection_touch(conn);
+        metrics_count(COUNTER_BYTES_SENT, res);
+        if (conn->wsent == conn->wlen) conn->wlen = conn->wsent = 0;
+        break;
+    case URING_SEND_FILE:
+        conn->fsent += res;
+        connection_touch(conn);
+        metrics_count(COUNTER_BYTES_SENT, res);
+        break;
+    case URING_READ_FILE:
+        conn->flen = res;
+        conn->fsent = 0;
+        conn->file_offset += res;
+        conn->file_remaining -= res;
+        break;
+    }
+}
+
+void uring_pump(Connection *conn) {
+    // Queues the next operation the session is waiting on, running buffered
+    // commands whenever all earlier output has gone out. Frees the session
+    // once it is closing and the kernel holds none of its buffers.
+    IoRing *ring = current_ring;
+    uint64_t tag = (uint64_t)(uintptr_t)conn;
+
+    while (conn->io_inflight == 0) {
+        int queued = -2;  // No operation needed
+        if (conn->wsent < conn->wlen) {
+            // A reply header followed by a file region or more of a stream goes out with them
+            int more = conn->file_fd >= 0 || connection_listing(conn) ? MSG_MORE : 0;
+            queued = uring_prep(ring, IORING_OP_SEND, conn->fd, conn->wbuf + conn->wsent,
+                                conn->wlen - conn->wsent, 0, MSG_NOSIGNAL | more, tag | URING_SEND);
+        } else if (conn->fsent < conn->flen) {
+            queued = uring_prep(ring, IORING_OP_SEND, conn->fd, conn->fbuf + conn->fsent,
+                                conn->flen - conn->fsent, 0, MSG_NOSIGNAL, tag | URING_SEND_FILE);
+        } else if (conn->file_fd >= 0 && conn->file_remaining > 0) {
+            if (!conn->fbuf && (conn->fbuf = malloc(FILE_CHUNK))) session_memory(FILE_CHUNK);
+            if (!conn->fbuf) {
+                log_message(LOG_ERROR, conn->id, "Error sending email: %s", strerror(errno));
+                queued = -1;
+            } else {
+
+                size_t len = conn->file_remaining < FILE_CHUNK ? conn->file_remaining : FILE_CHUNK;
+                conn->flen = conn->fsent = 0;
+                queued = uring_prep(ring, IORING_OP_READ, conn->file_fd, conn->fbuf, len,
+                                    conn->file_offset, 0, tag | URING_READ_FILE);
+            }
+        } else if (conn->file_fd >= 0) {
+            // The whole region is out; commands behind it may run now
+            close(conn->file_fd);
+            conn->file_fd = -1;
+            conn->flen = conn->fsent = 0;
+            continue;
+        } else if (connection_listing(conn)) {
+            list_continue(conn);
+            continue;
+        } else if (conn->closing) {
+            connection_destroy(conn);
+            return;
+        } else if (conn->commit_seq) {
+            // Normally resumed by release_durable_replies(), which leaves
+            // sessions with a send in flight for their completion to resume
+            pthread_mutex_lock(&journal.lock);
+            int durable = conn->commit_seq <= journal.durable_seq;
+            pthread_mutex_unlock(&journal.lock);
+            if (!durable) return;
+
+            commit_waiters_remove(conn);
+            send_response(conn, conn->commit_reply);
+            continue;
+        } else {
+            // Everything is written: run what is buffered, then wait for more
+            size_t before = conn->rlen;
+            int paused = connection_process_input(conn);
+            if (conn->wlen > 0 || connection_waiting(conn) || conn->closing) continue;
+            if (paused || conn->rlen != before) continue;
+
+            // A restart lets the session go here, between transactions
+            if (connection_drain_point(conn)) continue;
+            connection_trim(conn);
+            if (conn->rlen == 0 && !conn->recv_fallback) {
+                // Nothing is buffered: the kernel picks one of the loop's read
+                // buffers once data arrives, so a waiting session holds none
+                queued = uring_prep(ring, IORING_OP_RECV, conn->fd, NULL, BUFFER_SIZE - 1, 0, 0,
+                                    tag | URING_RECV);
+                if (queued == 0) {
+                    uring_last(ring)->flags |= IOSQE_BUFFER_SELECT;
+                    uring_last(ring)->buf_group = URING_BUFFER_GROUP;
+                }
+            } else if (connection_read_buffer(conn) < 0) {
+                queued = -1;
+            } else {
+                conn->recv_fallback = 0;
+                queued = uring_prep(ring, IORING_OP_RECV, conn->fd, conn->rbuf + conn->rlen,
+                                    BUFFER_SIZE - 1 - conn->rlen, 0, 0, tag | URING_RECV);
+            }
+        }
+
+        if (queued == 0) {
+            conn->io_inflight++;
+        } else if (queued == -1) {
+            // Out of submission slots: drop the session like a dead peer
+            uring_complete(conn, URING_SEND, -ENOBUFS);
+        } else {
+            break;
+        }
+    }
+
+    // The peer is gone but an operation is still queued: cut it short so the
+    // session can be freed when it completes
+    if (conn->closing && conn->io_inflight > 0 && conn->wlen == 0 && !conn->io_shutdown) {
+        shutdown(conn->fd, SHUT_RDWR);
+        conn->io_shutdown = 1;
+    }
+}
+
+void connection_on_readable(Connection *conn) {
+    // Edge-triggered: keep reading until the socket would block, pausing
+    // whenever replies back up so a slow reader cannot make us buffer
+    // unbounded output
+    while (!conn->closing) {
+        int paused = connection_process_input(conn);
+        if (connection_flush(conn) < 0) {
+            conn->closing = 1;
+            break;
+        }
+        if (conn->closing || connection_output_pending(conn)) break;
+
+        // Nothing more is read until the held-back reply is released
+        if (conn->commit_seq) break;
+
+        // The transfer that held up buffered commands has finished
+        if (paused) continue;
+
+        // A restart lets the session go here, between transactions
+        if (connection_drain_point(conn)) break;
+
+        if (connection_read_buffer(conn) < 0) {
+            conn->closing = 1;
+            break;
+        }
+        ssize_t bytes_read = recv(conn->fd, conn->rbuf + conn->rlen,
+                                  BUFFER_SIZE - 1 - conn->rlen, 0);
+        if (bytes_read > 0) {
+            conn->rlen += bytes_read;
+            connection_touch(conn);
+            metrics_count(COUNTER_BYTES_RECEIVED, bytes_read);
+        } else if (bytes_read == 0) {
+            log_message(LOG_INFO, conn->id, "Client disconnected");
+            conn->closing = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_message(LOG_ERROR, conn->id, "Error reading from socket: %s", strerror(errno));
+                conn->closing = 1;
+            }
+            break;
+        }
+    }
+}
+
+int connection_process_input(Connection *conn) {
+    // Splits the buffered byte stream into commands (or DATA bytes) and runs
+    // them. Returns nonzero if it stopped early behind a reply still in progress.
+    size_t start = 0;
+
+    // A pending file transfer or durable commit must finish before later
+    // replies are queued
+    while (!conn->closing && !connection_waiting(conn) && start < conn->rlen) {
+        if (conn->phase == PHASE_DATA) {
+            // Message bytes go straight to the spool file
+            start += data_feed(conn, conn->rbuf + start, conn->rlen - start);
+            continue;
+        }
+
+        char *line = conn->rbuf + start;
+        char *newline = memchr(line, '\n', conn->rlen - start);
+        if (!newline) break;
+        start += newline - line + 1;
+
+        // Strip the line terminator
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+
+        dispatch_command(conn, line);
+    }
+
+    // Keep the unfinished tail for the next read
+    if (start > 0) {
+        memmove(conn->rbuf, conn->rbuf + start, conn->rlen - start);
+        conn->rlen -= start;
+    }
+
+    // A full buffer without a line terminator can never complete
+    if (conn->rlen == BUFFER_SIZE - 1) {
+        send_response(conn, ERR_SYNTAX);
+        conn->rlen = 0;
+    }
+
+    return connection_waiting(conn) && conn->rlen > 0;
+}
+
+void dispatch_command(Connection *conn, char *line) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // Parse command; the argument is the rest of the line, left in place
+    char command[16] = {0};
+    int command_len = 0;
+
+    if (sscanf(line, "%15s%n", command, &command_len) < 1) {
+        send_response(conn, ERR_SYNTAX);
+        return;
+    }
+    char *argument = line + command_len;
+    while (isspace((unsigned char)*argument)) argument++;
+
+    // Handle commands
+    if (strcmp(command, "HELO") == 0) {
+        handle_helo(conn, argument);
+    } else if (strcmp(command, "MAIL") == 0) {
+        // Extract email from "MAIL FROM: <email>"
+        char email[256] = {0};
+        if (sscanf(argument, "FROM: %255s", email) == 1) {
+            handle_mail_from(conn, email);
+        } else {
+            send_response(conn, ERR_SYNTAX);
+        }
+    } else if (strcmp(command, "RCPT") == 0) {
+        // Extract email from "RCPT TO: <email>"
+        char email[256] = {0};
+        if (sscanf(argument, "TO: %255s", email) == 1) {
+            handle_rcpt_to(conn, email);
+        } else {
+            send_response(conn, ERR_SYNTAX);
+        }
+    } else if (strcmp(command, "DATA") == 0) {
+        handle_data(conn);
+    } else if (strcmp(command, "LIST") == 0) {
+        // LIST <email> [<offset> <count> | SINCE <id>]
+        char email[256] = {0};
+        int consumed = 0;
+        int first, count, since_id;
+        if (sscanf(argument, "%255s%n", email, &consumed) != 1) {
+            send_response(conn, ERR_SYNTAX);
+        } else if (argument[consumed + strspn(argument + consumed, " \t")] == '\0') {
+            handle_list(conn, email, 0, -1, -1);
+        } else if (sscanf(argument + consumed, " SINCE %d", &since_id) == 1 && since_id >= 0) {
+            handle_list(conn, email, 0, -1, since_id);
+        } else if (sscanf(argument + consumed, "%d %d", &first, &count) == 2 && first >= 0 && count > 0) {
+            handle_list(conn, email, first, count, -1);
+        } else {
+            send_response(conn, ERR_SYNTAX);
+        }
+    } else if (strcmp(command, "GET_MAIL") == 0) {
+        // GET_MAIL <email> <id> | GET_MAIL <email> <from>-<to>
+        char email[256] = {0};
+        int id, to;
+        int fields = sscanf(argument, "%255s %d-%d", email, &id, &to);
+        if (fields == 3 && id >= 0 && to >= id && to < INT_MAX) {
+            handle_get_range(conn, email, id, to);
+        } else if (fields == 2 && strchr(argument, '-') == NULL) {
+            handle_get_mail(conn, email, id);
+        } else {
+            send_response(conn, ERR_SYNTAX);
+        }
+    } else if (strcmp(command, "DELETE") == 0) {
+        // DELETE <email> <id>
+        char email[256] = {0};
+        int id;
+        if (sscanf(argument, "%255s %d", email, &id) == 2) {
+            handle_delete(conn, email, id);
+        } else {
+            send_response(conn, ERR_SYNTAX);
+        }
+    } else if (strcmp(command, "SEARCH") == 0) {
+        // SEARCH <email> <terms>
+        char email[256] = {0};
+        int consumed = 0;
+        if (sscanf(argument, "%255s%n", email, &consumed) == 1) {
+            handle_search(conn, email, argument + consumed);
+        } else {
+            send_response(conn, ERR_SYNTAX);
+        }
+    } else if (strcmp(command, "STATS") == 0) {
+        handle_stats(conn);
+    } else if (strcmp(command, "RSET") == 0) {
+        handle_rset(conn);
+    } else if (strcmp(command, "QUIT") == 0) {
+        handle_quit(conn);
+    } else {
+        send_response(conn, ERR_SYNTAX);
+    }
+
+    uint32_t latency_us = elapsed_us(&started);
+    metrics_record(metric_for_command(command), latency_us);
+
+    // Per-command log records are only built when verbose logging is on
+    if (log_enabled(LOG_DEBUG)) {
+        log_command(conn->id, command, latency_us, argument);
+    }
+}
+
+void handle_helo(Connection *conn, char *client_id) {
+    // "HELO <client_id> COMPRESS=LZ" opts in to receiving compressed bodies
+    char option[32];
+    if (sscanf(client_id, "%*s %31s", option) == 1 && strcmp(option, "COMPRESS=LZ") == 0) {
+        conn->state.compressed_replies = 1;
+    }
+    conn->state.is_authenticated = 1;
+
+    // Advertise that commands may be sent without waiting for each reply, and
+    // that bodies can be sent the way they are stored
+    send_response(conn, HELO_OK);
+}
+
+void handle_mail_from(Connection *conn, char *sender) {
+    ClientState *state = &conn->state;
+    if (!state->is_authenticated) {
+        send_response(conn, ERR_FORBIDDEN);
+        return;
+    }
+    if (standby_port) {
+        send_response(conn, ERR_STANDBY);
+        return;
+    }
+
+    strcpy(state->sender, sender);
+    state->has_sender = 1;
+    send_response(conn, OK);
+}
+
+void handle_rcpt_to(Connection *conn, char *recipient) {
+    ClientState *state = &conn->state;
+    if (!state->is_authenticated || !state->has_sender) {
+        send_response(conn, ERR_FORBIDDEN);
+        return;
+    }
+
+    // Repeating a recipient does not deliver twice
+    for (int i = 0; i < state->recipient_count; i++) {
+        if (strcmp(state->recipients[i], recipient) == 0) {
+            send_response(conn, OK);
+            return;
+        }
+    }
+
+    if (state->recipient_count >= MAX_RECIPIENTS) {
+        send_response(conn, ERR_TOO_MANY_RECIPIENTS);
+        return;
+    }
+
+    if (state->recipient_count == state->recipient_capacity) {
+        int new_capacity = state->recipient_capacity ? state->recipient_capacity * 2 : 4;
+        char (*new_list)[256] = realloc(state->recipients, new_capacity * sizeof(*new_list));
+        if (!new_list) {
+            send_response(conn, ERR_SERVER);
+            return;
+        }
+        session_memory((new_capacity - state->recipient_capacity) * sizeof(*new_list));
+        state->recipients = new_list;
+        state->recipient_capacity = new_capacity;
+    }
+
+    strcpy(state->recipients[state->recipient_count++], recipient);
+    state->has_recipient = 1;
+    send_response(conn, OK);
+}
+
+void handle_data(Connection *conn) {
+    ClientState *state = &conn->state;
+    if (!state->is_authenticated || !state->has_sender || !state->has_recipient) {
+        send_response(conn, ERR_FORBIDDEN);
+        return;
+    }
+
+    // Spool the message to an anonymous file so memory use does not grow with its size
+    char spool_path[] = SPOOL_DIR "/dataXXXXXX";
+    conn->spool_fd = mkstemp(spool_path);
+    if (conn->spool_fd < 0) {
+        log_message(LOG_ERROR, conn->id, "Error creating spool file: %s", strerror(errno));
+        send_response(conn, ERR_SERVER);
+        return;
+    }
+    unlink(spool_path);
+
+    // Add metadata to email
+    char headers[512];
+    char date[64];
+    strcpy(date, get_current_date());
+    int header_len = snprintf(headers, sizeof(headers), "From: %s\nDate: %s\n",
+                              state->sender, date);
+
+    conn->data_len = 0;
+    conn->data_error = 0;
+    conn->data_state = DATA_LINE_START;
+    conn->phase = PHASE_DATA;
+    connection_touch(conn);
+    data_spool_write(conn, headers, header_len);
+
+    // Tell client to start sending data
+    send_response(conn, "354 Start mail input; end with a single dot '.'\r\n");
+}
+
+size_t data_feed(Connection *conn, char *bytes, size_t len) {
+    // Consumes message bytes up to and including the terminating "." line,
+    // undoing dot-stuffing ("..text" -> ".text") on the way. The scanner state
+    // lives in the connection, so the terminator may be split across reads.
+    // Returns the number of bytes consumed; anything after the terminator is
+    // left for the command parser. The unstuffed bytes are written back over
+    // the input, which they never overtake: a held-back dot was read first.
+    size_t out_len = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        char c = bytes[i++];
+        switch (conn->data_state) {
+        case DATA_LINE_START:
+            if (c == '.') {
+                conn->data_state = DATA_DOT;
+                continue;
+            }
+            break;
+        case DATA_DOT:
+            if (c == '\n') {
+                goto done;
+            } else if (c == '\r') {
+                conn->data_state = DATA_DOT_CR;
+                continue;
+            }
+            // A doubled dot stands for one; any other character keeps the
+            // dot, which came with the previous read if c is the first byte
+            if (i == 1) {
+                data_spool_write(conn, ".", 1);
+            } else {
+                bytes[out_len++] = '.';
+            }
+            if (c == '.') {
+                conn->data_state = DATA_MID_LINE;
+                continue;
+            }
+            break;
+        case DATA_DOT_CR:
+            if (c == '\n') {
+                goto done;
+            }
+            if (i <= 2) {
+                data_spool_write(conn, ".\r", 2);
+            } else {
+                bytes[out_len++] = '.';
+                bytes[out_len++] = '\r';
+            }
+            break;
+        }
+
+        bytes[out_len++] = c;
+        conn->data_state = (c == '\n') ? DATA_LINE_START : DATA_MID_LINE;
+    }
+
+    data_spool_write(conn, bytes, out_len);
+    return len;
+
+done:
+    data_spool_write(conn, bytes, out_len);
+    handle_data_end(conn);
+    return i;
+}
+
+int data_spool_write(Connection *conn, const char *bytes, size_t len) {
+    if (conn->data_error || len == 0) return 0;
+
+    if (conn->data_len + len > max_message_size) {
+        // Email too large; keep consuming until the terminating dot
+        conn->data_error = DATA_TOO_LARGE;
+        return -1;
+    }
+
+    if (write_all(conn->spool_fd, bytes, len) < 0) {
+        log_message(LOG_ERROR, conn->id, "Error writing spool file: %s", strerror(errno));
+        conn->data_error = DATA_WRITE_FAILED;
+        return -1;
+    }
+    conn->data_len += len;
+    return 0;
+}
+
+void handle_data_end(Connection *conn) {
+    ClientState *state = &conn->state;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    conn->phase = PHASE_COMMAND;
+    connection_touch(conn);
+
+    if (conn->data_error) {
+        send_response(conn, conn->data_error == DATA_TOO_LARGE ? ERR_TOO_LARGE : ERR_SERVER);
+    } else {
+        uint64_t commit_seq;
+        char response[128];
+        int delivered = deliver_email(state, conn->spool_fd, conn->data_len, &commit_seq);
+        metrics_record(METRIC_STORE, elapsed_us(&started));
+        if (delivered > 0) {
+            metrics_count(COUNTER_MESSAGES, 1);
+            metrics_count(COUNTER_DELIVERIES, delivered);
+        }
+        if (delivered == state->recipient_count) {
+            snprintf(response, sizeof(response), "200 Message stored successfully\r\n");
+        } else if (delivered > 0) {
+            snprintf(response, sizeof(response), "200 Message stored for %d of %d recipients\r\n",
+                     delivered, state->recipient_count);
+        } else {
+            snprintf(response, sizeof(response), ERR_SERVER);
+        }
+
+        // In durable mode the reply waits until the journal record is on disk
+        if (commit_seq) {
+            connection_defer_reply(conn, commit_seq, response);
+        } else {
+            send_response(conn, response);
+        }
+
+        // Covers delivery and journaling, but not a held-back durable reply
+        uint32_t latency_us = elapsed_us(&started);
+        metrics_record(METRIC_DATA_END, latency_us);
+        if (log_enabled(LOG_DEBUG)) {
+            char summary[64];
+            snprintf(summary, sizeof(summary), "%zu bytes, %d/%d recipients",
+                     conn->data_len, delivered, state->recipient_count);
+            log_command(conn->id, "DATA_END", latency_us, summary);
+        }
+    }
+
+    close(conn->spool_fd);
+    conn->spool_fd = -1;
+    conn->data_len = 0;
+
+    // Reset state for next email
+    client_state_reset(state);
+}
+
+void client_state_reset(ClientState *state) {
+    // Clears the transaction but keeps the session authenticated
+    state->has_sender = 0;
+    state->has_recipient = 0;
+    memset(state->sender, 0, sizeof(state->sender));
+    session_memory(-(long)(state->recipient_capacity * sizeof(*state->recipients)));
+    free(state->recipients);
+    state->recipients = NULL;
+    state->recipient_count = 0;
+    state->recipient_capacity = 0;
+}
+
+void handle_list(Connection *conn, const char *email, int first, int count, int since_id) {
+    // Lists index slots [first, first + count), or every email newer than
+    // since_id. The plain form (count < 0, since_id < 0) keeps its original
+    // reply; the others start with "200 OK <n> <total>" and add sizes.
+    int paginated = count >= 0 || since_id >= 0;
+
+    // Hot mailboxes are listed without touching the index
+    CacheItem *listing = cache_lookup(email, 0);
+    if (listing) {
+        list_cached(conn, listing, first, count, since_id, paginated ? LIST_SIZES : LIST_PLAIN);
+        return;
+    }
+
+    // Later LISTs of this mailbox are answered from memory
+    MailboxIndex index;
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    int status = mailbox_index_open_shared(email, &index, lock);
+    if (status == 0) {
+        listing = cache_load_listing(email, &index);
+        if (listing) {
+            pthread_rwlock_unlock(lock);
+            mailbox_index_close(&index);
+            list_cached(conn, listing, first, count, since_id, paginated ? LIST_SIZES : LIST_PLAIN);
+            return;
+        }
+    }
+
+    // Otherwise the reply covers the emails indexed now; later appends are
+    // not included, and deleted entries are skipped
+    int skip = since_id >= 0 ? 0 : first;
+    int end = 0;
+    int lines = 0;
+    if (status == 0) {
+        first = since_id >= 0 ? mailbox_index_seek(&index, since_id + 1) : 0;
+        end = index.header.count;
+        lines = first < 0 ? -1 : mailbox_index_range(&index, &first, &end, skip, count);
+        if (lines < 0) {
+            mailbox_index_close(&index);
+            status = -1;
+        }
+    }
+    if (status != 0) {
+        pthread_rwlock_unlock(lock);
+        if (status > 0 && paginated) {
+            send_response(conn, "200 OK 0 0\r\n");
+        } else if (status > 0) {
+            // Mailbox doesn't exist
+            send_response(conn, "200 OK\r\nNo emails found.\r\n");
+        } else {
+            send_response(conn, ERR_SERVER);
+        }
+        return;
+    }
+
+    int total = mailbox_index_live(&index.header);
+    pthread_rwlock_unlock(lock);
+    list_start(conn, &index, NULL, first, end, lines, total, paginated ? LIST_SIZES : LIST_PLAIN);
+}
+
+void list_cached(Connection *conn, CacheItem *listing, int first, int count, int since_id, int format) {
+    // Lists a cached listing, which holds only live entries
+    int total;
+    cache_listing_snapshot(listing, since_id, &first, &total);
+    int end = total;
+    if (first > total) first = total;
+    if (count >= 0 && count < end - first) end = first + count;
+    list_start(conn, NULL, listing, first, end, end - first, total, format);
+}
+
+void list_start(Connection *conn, MailboxIndex *index, CacheItem *listing, int first, int end, int lines,
+                int total, int format) {
+    // Sends the reply header and starts streaming the lines emails in slots
+    // [first, end) of the index or the cached listing, taking ownership of
+    // either
+    char header[64];
+    if (format == LIST_BODIES) {
+        snprintf(header, sizeof(header), "200 OK %d\r\n", lines);
+        send_response(conn, header);
+    } else if (format == LIST_SIZES) {
+        snprintf(header, sizeof(header), "200 OK %d %d\r\n", lines, total);
+        send_response(conn, header);
+    } else {
+        send_response(conn, OK);
+        if (lines == 0) send_response(conn, "No emails found.\r\n");
+    }
+
+    // The entries are streamed a chunk at a time as the socket drains, so a
+    // large mailbox never sits in the output buffer all at once
+    conn->list_fd = index ? index->fd : -1;
+    conn->list_hidden = index ? index->header.deleted : 0;
+    conn->list_item = listing;
+    conn->list_next = first;
+    conn->list_end = end;
+    conn->list_format = format;
+    list_continue(conn);
+}
+
+void handle_get_range(Connection *conn, const char *email, int from, int to) {
+    // Sends every email with an ID in [from, to]: "200 OK <n>", then n frames
+    // of "<id> <bytes>" (or "<id> <stored> LZ <length>", as for GET_MAIL)
+    // and the email. The emails go out in mailbox order from one descriptor.
+    char mailbox_path[512];
+    mailbox_path_for(email, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+
+    int first, end, lines;
+    int mailbox_fd;
+    MailboxIndex index;
+    index.fd = -1;
+
+    // The listing's offsets belong to the mailbox file opened with it, which
+    // compaction only replaces under the write lock
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    mailbox_read_lock(lock);
+    CacheItem *listing = cache_lookup(email, 0);
+    if (listing) {
+        // Appends only add IDs above every listed one, so the slots stay put
+        CacheShard *shard = &cache_shards[listing->hash % CACHE_SHARDS];
+        pthread_mutex_lock(&shard->lock);
+        first = cache_listing_seek_locked(listing, from);
+        end = cache_listing_seek_locked(listing, to + 1);
+        pthread_mutex_unlock(&shard->lock);
+        lines = end - first;
+        mailbox_fd = open(mailbox_path, O_RDONLY);
+        pthread_rwlock_unlock(lock);
+    } else {
+        pthread_rwlock_unlock(lock);
+        int status = mailbox_index_open_shared(email, &index, lock);
+        if (status == 0) {
+            first = mailbox_index_seek(&index, from);
+            end = mailbox_index_seek(&index, to + 1);
+            lines = first < 0 || end < 0 ? -1 : mailbox_index_range(&index, &first, &end, 0, -1);
+            if (lines < 0) {
+                mailbox_index_close(&index);
+                status = -1;
+            }
+        }
+        if (status != 0) {
+            pthread_rwlock_unlock(lock);
+            send_response(conn, status > 0 ? "200 OK 0\r\n" : ERR_SERVER);
+            return;
+        }
+        mailbox_fd = open(mailbox_path, O_RDONLY);
+        pthread_rwlock_unlock(lock);
+    }
+
+    if (mailbox_fd < 0) {
+        log_message(LOG_ERROR, conn->id, "Error opening mailbox: %s", strerror(errno));
+        mailbox_index_close(&index);
+        if (listing) cache_release(listing);
+        send_response(conn, ERR_SERVER);
+        return;
+    }
+
+    conn->batch_fd = mailbox_fd;
+    snprintf(conn->batch_email, sizeof(conn->batch_email), "%s", email);
+    list_start(conn, listing ? NULL : &index, listing, first, end, lines, lines, LIST_BODIES);
+}
+
+void batch_send_entry(Connection *conn, const IndexEntry *entry) {
+    // Queues one frame of a GET_MAIL range; a file region is sent before the
+    // next frame is queued
+    char header[64];
+    CacheItem *item = cache_lookup(conn->batch_email, entry->id);
+    if (item) {
+        snprintf(header, sizeof(header), "%d %u\r\n", entry->id, item->entry.length);
+        send_response(conn, header);
+        send_bytes(conn, item->body, item->entry.length);
+        cache_release(item);
+        return;
+    }
+
+    int fd;
+    if (entry->blob[0]) {
+        char path[512];
+        blob_path_for(entry->blob, path, sizeof(path));
+        fd = open(path, O_RDONLY);
+    } else {
+        fd = dup(conn->batch_fd);
+    }
+    if (fd < 0) {
+        // The frame count is already sent; only closing is honest
+        log_message(LOG_ERROR, conn->id, "Error opening mailbox: %s", strerror(errno));
+        conn->closing = 1;
+        return;
+    }
+
+    if (entry->codec != CODEC_NONE && !conn->state.compressed_replies) {
+        char *body = email_read_body(fd, entry);
+        close(fd);
+        if (!body) {
+            conn->closing = 1;
+            return;
+        }
+        snprintf(header, sizeof(header), "%d %u\r\n", entry->id, entry->length);
+        send_response(conn, header);
+        send_bytes(conn, body, entry->length);
+        free(body);
+        return;
+    }
+
+    if (entry->codec == CODEC_LZ) {
+        snprintf(header, sizeof(header), "%d %u LZ %u\r\n", entry->id, entry->stored_length, entry->length);
+    } else {
+        snprintf(header, sizeof(header), "%d %u\r\n", entry->id, entry->length);
+    }
+    send_response(conn, header);
+    send_file_region(conn, fd, entry->offset, entry->stored_length);
+}
+
+void list_continue(Connection *conn) {
+    // Queues the next chunk of a LIST reply. Index entries only change to be
+    // marked deleted, which entries deleted after the listing began ignore; a
+    // rebuilt or compacted index replaces the file, so no lock is needed.
+    IndexEntry entries[LIST_BATCH];
+    int n = conn->list_end - conn->list_next;
+    if (n > LIST_BATCH) n = LIST_BATCH;
+
+    // Each email of a GET_MAIL range is sent before the next is looked up
+    if (conn->list_format == LIST_BODIES && n > 1) n = 1;
+
+    if (conn->list_item) {
+        cache_listing_read(conn->list_item, conn->list_next, entries, n);
+    } else {
+        off_t offset = sizeof(IndexHeader) + (off_t)conn->list_next * sizeof(IndexEntry);
+        ssize_t bytes = pread_all(conn->list_fd, (char *)entries, n * sizeof(IndexEntry), offset);
+        if (bytes != (ssize_t)(n * sizeof(IndexEntry))) {
+            // The reply promised more lines than can be sent; only closing is honest
+            log_message(LOG_ERROR, conn->id, "Error reading mailbox index: %s", strerror(errno));
+            conn->closing = 1;
+            n = 0;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        char email_info[512];
+        if (!conn->list_item && mailbox_index_hidden(&entries[i], conn->list_hidden)) continue;
+        if (conn->list_format == LIST_BODIES) {
+            batch_send_entry(conn, &entries[i]);
+            continue;
+        }
+        if (conn->list_format == LIST_SIZES) {
+            snprintf(email_info, sizeof(email_info), "%d: Email from %s (%s) %u bytes\r\n",
+                     entries[i].id, entries[i].sender, entries[i].date, entries[i].length);
+        } else {
+            snprintf(email_info, sizeof(email_info), "%d: Email from %s (%s)\r\n",
+                     entries[i].id, entries[i].sender, entries[i].date);
+        }
+        send_response(conn, email_info);
+    }
+
+    conn->list_next += n;
+    if (conn->list_next == conn->list_end || conn->closing) {
+        list_close(conn);
+    }
+}
+
+void list_close(Connection *conn) {
+    // Ends the listing, releasing the index or cached listing it came from
+    if (conn->list_fd >= 0) {
+        close(conn->list_fd);
+        conn->list_fd = -1;
+    }
+    if (conn->list_item) {
+        cache_release(conn->list_item);
+        conn->list_item = NULL;
+    }
+    if (conn->batch_fd >= 0) {
+        close(conn->batch_fd);
+        conn->batch_fd = -1;
+    }
+}
+
+void handle_get_mail(Connection *conn, char *email, int id) {
+    char header[64];
+    CacheItem *item = cache_lookup(email, id);
+    if (item) {
+        snprintf(header, sizeof(header), "200 OK %u\r\n", item->entry.length);
+        send_response(conn, header);
+        send_bytes(conn, item->body, item->entry.length);
+        cache_release(item);
+        return;
+    }
+
+    // Look the email up in the mailbox index
+    MailboxIndex index;
+    IndexEntry entry;
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    int status = mailbox_index_open_shared(email, &index, lock);
+    if (status == 0) {
+        status = mailbox_index_find(&index, id, &entry);
+        mailbox_index_close(&index);
+    }
+
+    if (status != 0) {
+        pthread_rwlock_unlock(lock);
+        if (status > 0) {
+            log_message(LOG_DEBUG, conn->id, "Email with id %d not found", id);
+            send_response(conn, ERR_NOT_FOUND);
+        } else {
+            send_response(conn, ERR_SERVER);
+        }
+        return;
+    }
+
+    // Read the email straight from its recorded offset, in the mailbox itself
+    // or in the shared body file it references
+    char mailbox_path[512];
+    if (entry.blob[0]) {
+        blob_path_for(entry.blob, mailbox_path, sizeof(mailbox_path));
+    } else {
+        mailbox_path_for(email, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+    }
+
+    int mailbox_fd = open(mailbox_path, O_RDONLY);
+    if (mailbox_fd < 0) {
+        log_message(LOG_ERROR, conn->id, "Error opening mailbox: %s", strerror(errno));
+        pthread_rwlock_unlock(lock);
+        send_response(conn, ERR_SERVER);
+        return;
+    }
+
+    // Stored bytes never change once appended (compaction writes a new file),
+    // so the descriptor stays valid for the transfer after the lock is released
+    pthread_rwlock_unlock(lock);
+
+    int send_stored = entry.codec != CODEC_NONE && conn->state.compressed_replies;
+    if (!send_stored && (entry.codec != CODEC_NONE || (cache_enabled && entry.length <= cache_item_limit))) {
+        // Read into memory: to decompress it for clients that did not ask for
+        // the stored form, or to keep it for the next fetch
+        char *body = email_read_body(mailbox_fd, &entry);
+        close(mailbox_fd);
+        if (!body) {
+            send_response(conn, ERR_SERVER);
+            return;
+        }
+        snprintf(header, sizeof(header), "200 OK %u\r\n", entry.length);
+        send_response(conn, header);
+        send_bytes(conn, body, entry.length);
+        cache_put_body(email, &entry, body);
+        return;
+    }
+
+    // A short header with the length, then the body goes out with sendfile().
+    // Compressed bodies are sent untouched as "200 OK <stored> LZ <length>".
+    if (entry.codec == CODEC_LZ) {
+        snprintf(header, sizeof(header), "200 OK %u LZ %u\r\n", entry.stored_length, entry.length);
+    } else {
+        snprintf(header, sizeof(header), "200 OK %u\r\n", entry.length);
+    }
+    send_response(conn, header);
+    send_file_region(conn, mailbox_fd, entry.offset, entry.stored_length);
+}
+
+void handle_delete(Connection *conn, const char *email, int id) {
+    // Like delivery, changing a mailbox needs a session that has said HELO
+    if (!conn->state.is_authenticated) {
+        send_response(conn, ERR_FORBIDDEN);
+        return;
+    }
+    if (standby_port) {
+        send_response(conn, ERR_STANDBY);
+        return;
+    }
+
+    int status = mailbox_delete(email, id);
+    if (status == 0) {
+        log_message(LOG_DEBUG, conn->id, "Deleted email %d of %s", id, email);
+        send_response(conn, OK);
+    } else if (status > 0) {
+        send_response(conn, ERR_NOT_FOUND);
+    } else {
+        send_response(conn, ERR_SERVER);
+    }
+}
+
+void handle_search(Connection *conn, const char *email, const char *query) {
+    // Replies like a paginated LIST with every email holding all the terms,
+    // oldest first. A "from:" term only matches words of the sender.
+    // A term left out would match more emails than asked for, so a query
+    // with a word too long to be indexed or too many terms is refused
+    uint64_t terms[SEARCH_MAX_QUERY + 1];
+    int count = search_query_terms(query, terms, SEARCH_MAX_QUERY + 1);
+    if (count < 0 || count > SEARCH_MAX_QUERY) {
+        send_response(conn, ERR_SEARCH_TERMS);
+        return;
+    }
+    if (count == 0) {
+        send_response(conn, ERR_SYNTAX);
+        return;
+    }
+
+    MailboxIndex index;
+    SearchIndex search;
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    int status = mailbox_index_open_shared(email, &index, lock);
+    if (status == 0) {
+        status = search_index_open(email, &index, &search, 0);
+        if (status == INDEX_STALE) {
+            // Catching up writes the search index, which needs the write lock
+            mailbox_index_close(&index);
+            pthread_rwlock_unlock(lock);
+            mailbox_write_lock(lock);
+            status = mailbox_index_open(email, &index, INDEX_REPAIR);
+            if (status == 0) {
+                status = search_index_open(email, &index, &search, INDEX_REPAIR);
+            }
+        }
+        if (status != 0) mailbox_index_close(&index);
+    }
+    if (status != 0) {
+        pthread_rwlock_unlock(lock);
+        send_response(conn, status > 0 ? "200 OK 0 0\r\n" : ERR_SERVER);
+        return;
+    }
+
+    // The postings give IDs; the mailbox index gives the listing lines and
+    // leaves out deleted emails
+    int *ids = NULL;
+    int n = search_lookup(&search, terms, count, &ids);
+    CacheItem *results = n >= 0 ? cache_new(email, 0) : NULL;
+    if (results && n > 0) {
+        results->entries = malloc(n * sizeof(IndexEntry));
+        for (int i = n - 1; results->entries && i >= 0; i--) {
+            if (mailbox_index_find(&index, ids[i], &results->entries[results->count]) == 0) {
+                results->count++;
+            }
+        }
+        if (!results->entries) {
+            cache_release(results);
+            results = NULL;
+        }
+    }
+    close(search.fd);
+    mailbox_index_close(&index);
+    pthread_rwlock_unlock(lock);
+    free(ids);
+
+    if (!results) {
+        send_response(conn, ERR_SERVER);
+        return;
+    }
+    list_start(conn, NULL, results, 0, results->count, results->count, results->count, LIST_SIZES);
+}
+
+void handle_stats(Connection *conn) {
+    // The report is formatted on the heap to keep session stacks small
+    char *response = malloc(METRICS_TEXT_SIZE);
+    if (!response) {
+        send_response(conn, ERR_SERVER);
+        return;
+    }
+    size_t len = snprintf(response, METRICS_TEXT_SIZE, "200 OK\r\n");
+    len += metrics_format(response + len, METRICS_TEXT_SIZE - len);
+    send_bytes(conn, response, len);
+    free(response);
+}
+
+void handle_quit(Connection *conn) {
+    send_response(conn, "200 Goodbye\r\n");
+    conn->closing = 1;
+}
+
+void handle_rset(Connection *conn) {
+    // Abandons the transaction so the session can start another; HELO stays
+    client_state_reset(&conn->state);
+    send_response(conn, OK);
+}
+
+void create_mailbox_if_not_exists() {
+    struct stat st = {0};
+    if (stat(MAILBOX_DIR, &st) == -1) {
+        if (mkdir(MAILBOX_DIR, 0700) == -1) {
+            log_message(LOG_ERROR, 0, "Error creating mailbox directory: %s", strerror(errno));
+            exit(1);
+        }
+        log_message(LOG_INFO, 0, "Created mailbox directory");
+    }
+
+    // Incoming messages are spooled here until they are committed
+    if (mkdir(SPOOL_DIR, 0700) == -1 && errno != EEXIST) {
+        log_message(LOG_ERROR, 0, "Error creating spool directory: %s", strerror(errno));
+        exit(1);
+    }
+
+    // Bodies shared by several recipients live here
+    if (mkdir(BLOB_DIR, 0700) == -1 && errno != EEXIST) {
+        log_message(LOG_ERROR, 0, "Error creating blob directory: %s", strerror(errno));
+        exit(1);
+    }
+}
+
+typedef struct {
+    int stripe;
+    int recipient;
+} StripeOrder;
+
+int compare_stripe_order(const void *a, const void *b) {
+    const StripeOrder *x = a;
+    const StripeOrder *y = b;
+    if (x->stripe != y->stripe) return x->stripe - y->stripe;
+    return x->recipient - y->recipient;
+}
+
+int deliver_email(ClientState *state, int spool_fd, size_t content_len, uint64_t *commit_seq) {
+    // Returns the number of recipients the email was stored for. In durable
+    // mode *commit_seq is the journal record to wait for before replying.
+    int count = state->recipient_count;
+    *commit_seq = 0;
+
+    int *ids = calloc(count, sizeof(int));
+    if (!ids) {
+        log_message(LOG_ERROR, 0, "Error allocating delivery state: %s", strerror(errno));
+        return 0;
+    }
+
+    // A single recipient keeps the body inline in its mailbox
+    char blob[48] = "";
+    int delivered = 0;
+    if (count == 1) {
+        ids[0] = save_email(state->recipients[0], state->sender, spool_fd, content_len);
+        delivered = ids[0] > 0;
+    } else {
+        delivered = deliver_shared(state, spool_fd, content_len, blob, ids);
+    }
+
+    if (delivered > 0 && durable_mode) {
+        // The email is already stored (and replicated), so failing here would
+        // make the client send it again. Without a journal record it is made
+        // durable by syncing the files it went into instead.
+        *commit_seq = journal_append(state, ids, blob, spool_fd, content_len);
+        if (*commit_seq == 0 && deliver_sync(state, ids, blob) != 0) delivered = 0;
+    }
+
+    free(ids);
+    return delivered;
+}
+
+int deliver_sync(ClientState *state, const int *ids, const char *blob) {
+    // Flushes the mailboxes an email was appended to, its shared body and
+    // the directories that may have gained them. A stale index catches up
+    // from its mailbox when next opened. Returns 0 once all is on disk.
+    int status = 0;
+    char path[512];
+    for (int i = 0; i < state->recipient_count + 1 && status == 0; i++) {
+        if (i < state->recipient_count) {
+            if (ids[i] <= 0) continue;
+            mailbox_path_for(state->recipients[i], mailbox_ext(), path, sizeof(path));
+        } else if (blob[0]) {
+            blob_path_for(blob, path, sizeof(path));
+        } else {
+            continue;
+        }
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fdatasync(fd) < 0) status = -1;
+        if (fd >= 0) close(fd);
+    }
+
+    const char *dirs[] = { MAILBOX_DIR, BLOB_DIR };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]) && status == 0; i++) {
+        int fd = open(dirs[i], O_RDONLY | O_DIRECTORY);
+        if (fd < 0 || fsync(fd) < 0) status = -1;
+        if (fd >= 0) close(fd);
+    }
+
+    if (status != 0) {
+        log_message(LOG_ERROR, 0, "Error syncing delivered email: %s", strerror(errno));
+    } else {
+        log_message(LOG_WARN, 0, "Journal unavailable, email synced to its mailboxes instead");
+    }
+    return status;
+}
+
+int deliver_shared(ClientState *state, int spool_fd, size_t content_len, char *blob, int *ids) {
+    // Several recipients share one stored copy of the body
+    // Until every reference is appended, the body must not be collected
+    int count = state->recipient_count;
+    pthread_rwlock_rdlock(&blob_lock);
+    if (blob_create(spool_fd, content_len, blob, 48) != 0) {
+        pthread_rwlock_unlock(&blob_lock);
+        return 0;
+    }
+
+    StripeOrder *order = malloc(count * sizeof(StripeOrder));
+    if (!order) {
+        log_message(LOG_ERROR, 0, "Error allocating delivery order: %s", strerror(errno));
+        pthread_rwlock_unlock(&blob_lock);
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        order[i].stripe = mailbox_lock_for(state->recipients[i]) - mailbox_locks;
+        order[i].recipient = i;
+    }
+
+    // Visit the mailboxes grouped by lock stripe so each stripe is taken once
+    qsort(order, count, sizeof(StripeOrder), compare_stripe_order);
+
+    int delivered = 0;
+    int i = 0;
+    while (i < count) {
+        int stripe = order[i].stripe;
+        mailbox_write_lock(&mailbox_locks[stripe]);
+        for (; i < count && order[i].stripe == stripe; i++) {
+            int r = order[i].recipient;
+            ids[r] = mailbox_append_locked(state->recipients[r], state->sender, spool_fd, content_len,
+                                           blob, 0, NULL);
+            if (ids[r] > 0) {
+                delivered++;
+            }
+        }
+        pthread_rwlock_unlock(&mailbox_locks[stripe]);
+    }
+    free(order);
+
+    if (delivered == 0) {
+        char path[512];
+        blob_path_for(blob, path, sizeof(path));
+        unlink(path);
+        blob[0] = '\0';
+    }
+    pthread_rwlock_unlock(&blob_lock);
+    return delivered;
+}
+
+int save_email(const char *recipient, const char *sender, int spool_fd, size_t content_len) {
+    // Returns the new email's ID, or -1 on failure.
+    // Only deliveries to the same lock stripe serialize with each other
+    pthread_rwlock_t *lock = mailbox_lock_for(recipient);
+    // The body is copied for the standbys before the lock is taken
+    ReplChange *change = repl_change_new(REPL_APPEND, recipient, sender, NULL, spool_fd, content_len);
+    mailbox_write_lock(lock);
+    int status = mailbox_append_locked(recipient, sender, spool_fd, content_len, NULL, 0, change);
+    pthread_rwlock_unlock(lock);
+    return status;
+}
+
+int mailbox_append_locked(const char *recipient, const char *sender, int spool_fd,
+                          size_t content_len, const char *blob, int id, ReplChange *change) {
+    // Appends one email to the recipient's mailbox and returns its ID, or -1;
+    // the caller holds the write lock. With a blob name, only a reference to
+    // the shared body is written. A standby passes the primary's ID, and gets
+    // 0 back if the mailbox is already past it; otherwise id is 0. change is
+    // the email's replication record if the caller made it before locking,
+    // and is queued or freed here.
+
+    // The index gives the next ID and the current end of the mailbox
+    MailboxIndex index;
+    if (mailbox_index_open(recipient, &index, INDEX_CREATE | INDEX_REPAIR) != 0) {
+        free(change);
+        return -1;
+    }
+    if (id > 0 && id < index.header.next_id) {
+        mailbox_index_close(&index);
+        free(change);
+        return 0;
+    }
+
+    // Construct the path to the mailbox file
+    char mailbox_path[512];
+    mailbox_path_for(recipient, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+
+    // Writes go to the end recorded in the index, which the write lock keeps stable
+    int mailbox_fd = open(mailbox_path, O_WRONLY | O_CREAT, 0600);
+    if (mailbox_fd < 0) {
+        log_message(LOG_ERROR, 0, "Error opening mailbox: %s", strerror(errno));
+        mailbox_index_close(&index);
+        free(change);
+        return -1;
+    }
+
+    // Determine the email ID
+    int email_id = id > 0 ? id : index.header.next_id;
+    off_t base = index.header.mailbox_size;
+
+    // The writer records where the email lives so readers can seek straight to it
+    IndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.id = email_id;
+    entry.length = content_len + 1; // Includes the newline every stored email ends in
+    entry.stored_length = entry.length;
+    if (blob) {
+        snprintf(entry.blob, sizeof(entry.blob), "%s", blob);
+    }
+
+    ssize_t record_len = storage_engine == STORAGE_SEGMENT
+        ? mailbox_write_segment(mailbox_fd, base, sender, spool_fd, content_len, &entry)
+        : mailbox_write_text(mailbox_fd, base, sender, spool_fd, content_len, &entry);
+
+    int status = 0;
+    if (record_len < 0) {
+        log_message(LOG_ERROR, 0, "Error writing mailbox: %s", strerror(errno));
+        // Drop the partial record so the mailbox still ends on a complete email
+        if (ftruncate(mailbox_fd, base) < 0) {
+            log_message(LOG_ERROR, 0, "Error truncating mailbox: %s", strerror(errno));
+        }
+        status = -1;
+    } else {
+        char head[1024];
+        ssize_t head_len = pread_all(spool_fd, head, content_len < sizeof(head) ? content_len : sizeof(head), 0);
+        if (head_len > 0) {
+            parse_email_headers(head, head_len, &entry);
+        }
+        if (entry.sender[0] == '\0') {
+            snprintf(entry.sender, sizeof(entry.sender), "%s", sender);
+        }
+
+        if (mailbox_index_append(&index, &entry, base + record_len) != 0) {
+            log_message(LOG_ERROR, 0, "Error updating mailbox index: %s", strerror(errno));
+            cache_invalidate(recipient, 0);
+        } else {
+            // New mail is the likeliest to be listed and fetched next
+            cache_append_entry(recipient, &entry, mailbox_index_live(&index.header));
+            if (!blob) cache_store_spool(recipient, &entry, spool_fd, content_len);
+            search_index_append(recipient, &entry, spool_fd, content_len);
+        }
+
+        // The email is stored even if its index entry is not, which the next
+        // open repairs from the mailbox, so the standbys get it either way.
+        // A shared body is not copied; the standbys are sent it from its file.
+        if (!change) {
+            change = repl_change_new(REPL_APPEND, recipient, sender, blob, blob ? -1 : spool_fd,
+                                     blob ? 0 : content_len);
+        }
+        repl_log_push(change, email_id);
+        change = NULL;
+    }
+
+    close(mailbox_fd);
+    mailbox_index_close(&index);
+    free(change);
+    return status == 0 ? email_id : -1;
+}
+
+ssize_t mailbox_write_text(int mailbox_fd, off_t base, const char *sender, int spool_fd,
+                           size_t content_len, IndexEntry *entry) {
+    // Writes the email at base between its ID markers and returns the bytes
+    // written, or -1. A shared body is represented by a reference line.
+    (void)sender;
+    char start_marker[64];
+    char end_marker[64];
+    char reference[128];
+    int start_len = snprintf(start_marker, sizeof(start_marker), "\n--- Email ID: %d ---\n", entry->id);
+    int end_len = snprintf(end_marker, sizeof(end_marker), "\n--- End Email ID: %d ---\n", entry->id);
+    size_t body_len = content_len;
+    if (entry->blob[0]) {
+        body_len = snprintf(reference, sizeof(reference), "Blob: %s %zu", entry->blob, content_len + 1);
+    }
+
+    int body_ok = entry->blob[0]
+        ? pwrite(mailbox_fd, reference, body_len, base + start_len) == (ssize_t)body_len
+        : copy_spool(spool_fd, mailbox_fd, base + start_len, content_len) == 0;
+    if (pwrite(mailbox_fd, start_marker, start_len, base) != start_len || !body_ok ||
+        pwrite(mailbox_fd, end_marker, end_len, base + start_len + body_len) != end_len) {
+        return -1;
+    }
+
+    if (!entry->blob[0]) entry->offset = base + start_len;
+    return start_len + body_len + end_len;
+}
+
+ssize_t mailbox_write_segment(int mailbox_fd, off_t base, const char *sender, int spool_fd,
+                              size_t content_len, IndexEntry *entry) {
+    // Appends one segment record at base and returns the bytes written, or -1
+    SegmentRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = SEGMENT_MAGIC;
+    record.id = entry->id;
+    record.size = entry->length;
+    record.timestamp = time(NULL);
+    record.body_len = entry->blob[0] ? 0 : record.size;
+    snprintf(record.sender, sizeof(record.sender), "%s", sender);
+    snprintf(record.blob, sizeof(record.blob), "%s", entry->blob);
+
+    ssize_t len = segment_write_record(mailbox_fd, base, &record, spool_fd, 0, content_len);
+    if (len >= 0 && !entry->blob[0]) {
+        entry->offset = base + sizeof(SegmentRecord);
+        entry->stored_length = record.body_len;
+        entry->codec = record.codec;
+    }
+    return len;
+}
+
+ssize_t segment_write_record(int fd, off_t base, SegmentRecord *record, int src_fd, off_t src_offset,
+                             size_t src_len) {
+    // Writes record at base followed by its body: src_len bytes of src_fd,
+    // plus the final newline when body_len is one longer. Fills in the
+    // checksum and returns the record length, or -1.
+    if (compress_codec != CODEC_NONE && record->codec == CODEC_NONE && record->body_len >= COMPRESS_MIN_SIZE) {
+        ssize_t len = segment_write_compressed(fd, base, record, src_fd, src_offset, src_len);
+        if (len != 0) return len;
+    }
+
+    int newline = record->body_len == src_len + 1;
+    uint32_t crc = crc32c(0, &record->id, sizeof(SegmentRecord) - offsetof(SegmentRecord, id));
+    if (record->body_len > 0) {
+        if (crc32c_file(src_fd, src_offset, src_len, &crc) < 0) return -1;
+        if (newline) crc = crc32c(crc, "\n", 1);
+    }
+    record->crc = crc;
+
+    // The body goes first; a record whose header is missing or torn fails its check
+    off_t body = base + sizeof(SegmentRecord);
+    if (record->body_len > 0 &&
+        (copy_range(src_fd, src_offset, fd, body, src_len) < 0 ||
+         (newline && pwrite(fd, "\n", 1, body + src_len) != 1))) {
+        return -1;
+    }
+    if (pwrite(fd, record, sizeof(SegmentRecord), base) != sizeof(SegmentRecord)) {
+        return -1;
+    }
+    return sizeof(SegmentRecord) + record->body_len;
+}
+
+ssize_t segment_write_compressed(int fd, off_t base, SegmentRecord *record, int src_fd, off_t src_offset,
+                                 size_t src_len) {
+    // Like segment_write_record, but stores the body compressed. Returns 0
+    // without writing anything if that would not save at least an eighth.
+    size_t size = record->body_len;
+    size_t cap = size - size / 8;
+    unsigned char *body = malloc(size);
+    unsigned char *packed = malloc(cap);
+    if (!body || !packed || pread_all(src_fd, (char *)body, src_len, src_offset) != (ssize_t)src_len) {
+        free(body);
+        free(packed);
+        return -1;
+    }
+    if (size == src_len + 1) body[src_len] = '\n';
+
+    size_t packed_len = lz_compress(body, size, packed, cap);
+    free(body);
+    if (packed_len == 0) {
+        free(packed);
+        return 0;
+    }
+
+    record->codec = CODEC_LZ;
+    record->body_len = packed_len;
+    uint32_t crc = crc32c(0, &record->id, sizeof(SegmentRecord) - offsetof(SegmentRecord, id));
+    record->crc = crc32c(crc, packed, packed_len);
+
+    // Body first, header last, as for uncompressed records
+    ssize_t status = sizeof(SegmentRecord) + packed_len;
+    if (pwrite(fd, packed, packed_len, base + sizeof(SegmentRecord)) != (ssize_t)packed_len ||
+        pwrite(fd, record, sizeof(SegmentRecord), base) != sizeof(SegmentRecord)) {
+        status = -1;
+    }
+    free(packed);
+
+    if (status > 0) {
+        atomic_fetch_add(&compress_bytes_in, size);
+        atomic_fetch_add(&compress_bytes_out, packed_len);
+    }
+    return status;
+}
+
+ssize_t segment_read_record(int fd, uint64_t pos, uint64_t end, SegmentRecord *record) {
+    // Returns the length of the intact record at pos, or -1 if there is none
+    if (pos + sizeof(SegmentRecord) > end) return -1;
+    if (pread_all(fd, (char *)record, sizeof(SegmentRecord), pos) != sizeof(SegmentRecord)) return -1;
+    if (record->magic != SEGMENT_MAGIC || record->body_len > end - pos - sizeof(SegmentRecord)) return -1;
+    if (record->codec == CODEC_NONE ? record->body_len != 0 && record->body_len != record->size
+                                    : record->codec != CODEC_LZ || record->body_len == 0) {
+        return -1;
+    }
+
+    uint32_t crc = crc32c(0, &record->id, sizeof(SegmentRecord) - offsetof(SegmentRecord, id));
+    if (crc32c_file(fd, pos + sizeof(SegmentRecord), record->body_len, &crc) < 0 || crc != record->crc) {
+        return -1;
+    }
+
+    record->sender[sizeof(record->sender) - 1] = '\0';
+    record->blob[sizeof(record->blob) - 1] = '\0';
+    return sizeof(SegmentRecord) + record->body_len;
+}
+
+uint64_t segment_resync(int fd, uint64_t from, uint64_t end) {
+    // Finds the next offset in [from, end) holding the record magic, or end
+    uint32_t magic = SEGMENT_MAGIC;
+    char buffer[BUFFER_SIZE];
+    while (from + sizeof(magic) <= end) {
+        size_t want = end - from < sizeof(buffer) ? end - from : sizeof(buffer);
+        ssize_t n = pread_all(fd, buffer, want, from);
+        if (n < (ssize_t)sizeof(magic)) break;
+
+        char *hit = memmem(buffer, n, &magic, sizeof(magic));
+        if (hit) return from + (hit - buffer);
+
+        // A magic split across two reads is found by the next one
+        from += n - (sizeof(magic) - 1);
+    }
+    return end;
+}
+
+int segment_index_scan(int mailbox_fd, uint64_t from, uint64_t to, MailboxIndex *index) {
+    // Appends an entry for each intact record in [from, to). Damaged bytes are
+    // skipped by searching for the next header that passes its check.
+    uint64_t pos = from;
+    uint64_t skipped = 0;
+    while (pos < to) {
+        SegmentRecord record;
+        ssize_t len = segment_read_record(mailbox_fd, pos, to, &record);
+        if (len < 0) {
+            uint64_t next = segment_resync(mailbox_fd, pos + 1, to);
+            skipped += next - pos;
+            pos = next;
+            continue;
+        }
+
+        // Every stored email ends in a newline, so only a tombstone is empty
+        if (record.size == 0) {
+            if (mailbox_index_tombstone(index, record.id, len, pos + len) != 0) {
+                log_message(LOG_ERROR, 0, "Error writing mailbox index: %s", strerror(errno));
+                return -1;
+            }
+            pos += len;
+            continue;
+        }
+
+        IndexEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.id = record.id;
+        entry.length = record.size;
+        entry.stored_length = record.size;
+        if (record.blob[0]) {
+            snprintf(entry.blob, sizeof(entry.blob), "%s", record.blob);
+            blob_read_headers(&entry);
+        } else {
+            entry.offset = pos + sizeof(SegmentRecord);
+            entry.stored_length = record.body_len;
+            entry.codec = record.codec;
+            char head[1024];
+            ssize_t head_len = email_read_head(mailbox_fd, &entry, head, sizeof(head));
+            if (head_len > 0) {
+                parse_email_headers(head, head_len, &entry);
+            }
+        }
+        if (entry.sender[0] == '\0') {
+            snprintf(entry.sender, sizeof(entry.sender), "%s", record.sender);
+        }
+
+        if (mailbox_index_append(index, &entry, pos + len) != 0) {
+            log_message(LOG_ERROR, 0, "Error writing mailbox index: %s", strerror(errno));
+            return -1;
+        }
+        pos += len;
+    }
+
+    if (skipped > 0) {
+        log_message(LOG_WARN, 0, "Skipped %lu damaged bytes in a mailbox segment", (unsigned long)skipped);
+    }
+
+    // The whole range has been consumed, including any torn trailing record
+    index->header.mailbox_size = to;
+    if (pwrite(index->fd, &index->header, sizeof(IndexHeader), 0) != sizeof(IndexHeader)) {
+        log_message(LOG_ERROR, 0, "Error writing mailbox index: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t segment_write_tombstone(int fd, off_t base, int id) {
+    // Appends the empty record that marks email id as deleted
+    SegmentRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = SEGMENT_MAGIC;
+    record.id = id;
+    record.timestamp = time(NULL);
+    return segment_write_record(fd, base, &record, -1, 0, 0);
+}
+
+int convert_mailboxes() {
+    // Offline migration: writes mailbox/<user>.seg for every mailbox/<user>.txt
+    // that has no segment yet. The text files are left in place.
+    DIR *dir = opendir(MAILBOX_DIR);
+    if (!dir) {
+        log_message(LOG_ERROR, 0, "Error opening mailbox directory: %s", strerror(errno));
+        return -1;
+    }
+
+    int mailboxes = 0;
+    int emails = 0;
+    int status = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len <= 4 || strcmp(ent->d_name + len - 4, ".txt") != 0) continue;
+
+        char email[256];
+        snprintf(email, sizeof(email), "%.*s", (int)(len - 4), ent->d_name);
+        int converted = convert_mailbox(email);
+        if (converted < 0) {
+            status = -1;
+        } else if (converted > 0) {
+            mailboxes++;
+            emails += converted;
+        }
+    }
+    closedir(dir);
+
+    log_message(LOG_INFO, 0, "Converted %d emails in %d mailboxes", emails, mailboxes);
+    return status;
+}
+
+int convert_mailbox(const char *email) {
+    // Returns the number of emails converted (0 if there was nothing to do), or -1
+    char text_path[512];
+    char segment_path[512];
+    char tmp_path[600];
+    mailbox_path_for(email, ".txt", text_path, sizeof(text_path));
+    mailbox_path_for(email, ".seg", segment_path, sizeof(segment_path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", segment_path);
+
+    if (access(segment_path, F_OK) == 0) {
+        log_message(LOG_WARN, 0, "Skipping %s: it already has a segment", email);
+        return 0;
+    }
+
+    // The text index locates every email; it is repaired first if needed
+    storage_engine = STORAGE_TEXT;
+    MailboxIndex index;
+    if (mailbox_index_open(email, &index, INDEX_REPAIR) != 0) {
+        return -1;
+    }
+
+    // Text mailboxes do not record delivery times; the last write is the best bound
+    struct stat st;
+    int text_fd = open(text_path, O_RDONLY);
+    int segment_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (text_fd < 0 || segment_fd < 0 || fstat(text_fd, &st) < 0) {
+        log_message(LOG_ERROR, 0, "Error converting mailbox: %s", strerror(errno));
+        if (text_fd >= 0) close(text_fd);
+        if (segment_fd >= 0) close(segment_fd);
+        unlink(tmp_path);
+        mailbox_index_close(&index);
+        return -1;
+    }
+
+    IndexEntry entries[LIST_BATCH];
+    off_t pos = 0;
+    int slot = 0;
+    int converted = 0;
+    int last_id = 0;
+    int status = 0;
+    while (status == 0 && slot < index.header.count) {
+        int n = mailbox_index_read(&index, slot, entries, LIST_BATCH);
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (mailbox_index_hidden(&entries[i], index.header.deleted)) continue;
+            SegmentRecord record;
+            memset(&record, 0, sizeof(record));
+            record.magic = SEGMENT_MAGIC;
+            record.id = entries[i].id;
+            record.size = entries[i].length;
+            record.timestamp = st.st_mtime;
+            record.body_len = entries[i].blob[0] ? 0 : entries[i].length;
+            snprintf(record.sender, sizeof(record.sender), "%s", entries[i].sender);
+            snprintf(record.blob, sizeof(record.blob), "%s", entries[i].blob);
+
+            ssize_t len = segment_write_record(segment_fd, pos, &record, text_fd, entries[i].offset,
+                                               record.body_len);
+            if (len < 0) {
+                log_message(LOG_ERROR, 0, "Error writing segment: %s", strerror(errno));
+                status = -1;
+                break;
+            }
+            pos += len;
+            last_id = record.id;
+            converted++;
+        }
+        slot += n;
+    }
+
+    // A tombstone carries over the last ID handed out if that email was deleted
+    if (status == 0 && last_id < index.header.next_id - 1 &&
+        segment_write_tombstone(segment_fd, pos, index.header.next_id - 1) < 0) {
+        log_message(LOG_ERROR, 0, "Error writing segment: %s", strerror(errno));
+        status = -1;
+    }
+    mailbox_index_close(&index);
+    close(text_fd);
+
+    if (status == 0 && (fsync(segment_fd) < 0 || rename(tmp_path, segment_path) < 0)) {
+        log_message(LOG_ERROR, 0, "Error installing segment: %s", strerror(errno));
+        status = -1;
+    }
+    close(segment_fd);
+    if (status != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    // Index the new segment the way the server will, which checks every record
+    storage_engine = STORAGE_SEGMENT;
+    if (mailbox_index_open(email, &index, INDEX_REPAIR) != 0) {
+        return -1;
+    }
+    int indexed = mailbox_index_live(&index.header);
+    mailbox_index_close(&index);
+    if (indexed != converted) {
+        log_message(LOG_ERROR, 0, "Converted %s: %d of %d emails verified", email, indexed, converted);
+        return -1;
+    }
+
+    log_message(LOG_INFO, 0, "Converted %s: %d emails", email, converted);
+    return converted;
+}
+
+void storage_check() {
+    // Text mailboxes are invisible to the segment engine until converted, and
+    // segments to the text engine. Shared bodies are only collected when
+    // every mailbox that may refer to one can be read.
+    DIR *dir = opendir(MAILBOX_DIR);
+    if (!dir) return;
+
+    int unconverted = 0;
+    int segments = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len > 4 && strcmp(ent->d_name + len - 4, ".seg") == 0) segments++;
+        if (len <= 4 || strcmp(ent->d_name + len - 4, ".txt") != 0) continue;
+
+        char segment_path[600];
+        snprintf(segment_path, sizeof(segment_path), "%s/%.*s.seg", MAILBOX_DIR, (int)(len - 4), ent->d_name);
+        if (access(segment_path, F_OK) != 0) unconverted++;
+    }
+    closedir(dir);
+
+    if (storage_engine == STORAGE_SEGMENT && unconverted > 0) {
+        log_message(LOG_WARN, 0, "%d text mailboxes have no segment; run with --convert to migrate them",
+                    unconverted);
+        blob_collect_enabled = 0;
+    }
+    if (storage_engine == STORAGE_TEXT && segments > 0) {
+        log_message(LOG_WARN, 0, "%d segment mailboxes found; shared bodies will not be collected", segments);
+        blob_collect_enabled = 0;
+    }
+}
+
+int mailbox_delete(const char *email, int id) {
+    // Returns 0 once the email is deleted, 1 if there is no such email, -1 on
+    // error. A tombstone is appended and the entry leaves the index; the
+    // email's bytes stay in the mailbox until it is compacted.
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    mailbox_write_lock(lock);
+
+    MailboxIndex index;
+    IndexEntry entry;
+    int status = mailbox_index_open(email, &index, INDEX_REPAIR);
+    if (status == 0) {
+        status = mailbox_index_find(&index, id, &entry);
+        if (status != 0) mailbox_index_close(&index);
+    }
+    if (status != 0) {
+        pthread_rwlock_unlock(lock);
+        return status;
+    }
+
+    char mailbox_path[512];
+    mailbox_path_for(email, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+    int mailbox_fd = open(mailbox_path, O_WRONLY);
+    if (mailbox_fd < 0) {
+        log_message(LOG_ERROR, 0, "Error opening mailbox: %s", strerror(errno));
+        mailbox_index_close(&index);
+        pthread_rwlock_unlock(lock);
+        return -1;
+    }
+
+    // The tombstone is written first, so an index rebuilt from the mailbox
+    // leaves the email out even if the index update below never happens
+    off_t base = index.header.mailbox_size;
+    ssize_t len = mailbox_write_tombstone(mailbox_fd, base, id);
+    if (len < 0 || (durable_mode && fdatasync(mailbox_fd) < 0)) {
+        log_message(LOG_ERROR, 0, "Error writing tombstone: %s", strerror(errno));
+        if (ftruncate(mailbox_fd, base) < 0) {
+            log_message(LOG_ERROR, 0, "Error truncating mailbox: %s", strerror(errno));
+        }
+        status = -1;
+    } else if (mailbox_index_tombstone(&index, id, len, base + len) != 0) {
+        log_message(LOG_ERROR, 0, "Error updating mailbox index: %s", strerror(errno));
+        status = -1;
+    } else {
+        repl_log_push(repl_change_new(REPL_DELETE, email, "", NULL, -1, 0), id);
+    }
+    close(mailbox_fd);
+
+    // Listings and the body are dropped even on failure: the tombstone may
+    // already be in the mailbox
+    cache_invalidate(email, id);
+    cache_invalidate(email, 0);
+
+    int due = status == 0 && compact_due(&index.header);
+    mailbox_index_close(&index);
+    pthread_rwlock_unlock(lock);
+
+    if (status == 0) atomic_fetch_add(&emails_deleted, 1);
+    if (due) compact_request(email);
+    return status;
+}
+
+ssize_t mailbox_write_tombstone(int mailbox_fd, off_t base, int id) {
+    // Appends the marker deleting email id and returns its length, or -1
+    if (storage_engine == STORAGE_SEGMENT) {
+        return segment_write_tombstone(mailbox_fd, base, id);
+    }
+
+    char marker[64];
+    int len = snprintf(marker, sizeof(marker), "\n--- Deleted Email ID: %d ---\n", id);
+    return pwrite(mailbox_fd, marker, len, base) == len ? len : -1;
+}
+
+int compact_due(const IndexHeader *header) {
+    // Whether deleted emails make up enough of the mailbox to rewrite it
+    return compact_threshold > 0 && header->dead_bytes > 0 &&
+           header->dead_bytes * 100 >= header->mailbox_size * compact_threshold;
+}
+
+void compact_start() {
+    pthread_mutex_init(&compact_queue.lock, NULL);
+    pthread_cond_init(&compact_queue.ready, NULL);
+
+    pthread_t thread_id;
+    if (thread_create(&thread_id, THREAD_STACK_SIZE, compact_thread, NULL) != 0) {
+        log_message(LOG_ERROR, 0, "Error creating compaction thread: %s", strerror(errno));
+        exit(1);
+    }
+    pthread_detach(thread_id);
+}
+
+void compact_request(const char *email) {
+    // Queues the mailbox for compaction unless it is already waiting. A full
+    // queue drops the request; the next deletion asks again.
+    pthread_mutex_lock(&compact_queue.lock);
+    int queued = 0;
+    for (int i = 0; i < compact_queue.count; i++) {
+        int slot = (compact_queue.head + i) % COMPACT_QUEUE_SIZE;
+        if (strcmp(compact_queue.emails[slot], email) == 0) queued = 1;
+    }
+    if (!queued && compact_queue.count < COMPACT_QUEUE_SIZE) {
+        int slot = (compact_queue.head + compact_queue.count) % COMPACT_QUEUE_SIZE;
+        snprintf(compact_queue.emails[slot], sizeof(compact_queue.emails[slot]), "%s", email);
+        compact_queue.count++;
+        pthread_cond_signal(&compact_queue.ready);
+    }
+    pthread_mutex_unlock(&compact_queue.lock);
+}
+
+void *compact_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        char email[256];
+        pthread_mutex_lock(&compact_queue.lock);
+        while (compact_queue.count == 0) {
+            pthread_cond_wait(&compact_queue.ready, &compact_queue.lock);
+        }
+        memcpy(email, compact_queue.emails[compact_queue.head], sizeof(email));
+        compact_queue.head = (compact_queue.head + 1) % COMPACT_QUEUE_SIZE;
+        compact_queue.count--;
+        pthread_mutex_unlock(&compact_queue.lock);
+
+        compact_mailbox(email);
+
+        // Shared bodies are collected once the queue drains, since that
+        // reads every mailbox index
+        pthread_mutex_lock(&compact_queue.lock);
+        int idle = compact_queue.count == 0;
+        pthread_mutex_unlock(&compact_queue.lock);
+        if (idle && atomic_exchange(&blob_collect_due, 0)) blob_collect();
+    }
+    return NULL;
+}
+
+int compact_mailbox(const char *email) {
+    // Rewrites the mailbox without its deleted emails. The copy is made from
+    // a snapshot without holding the lock; only the emails appended meanwhile
+    // are copied under the write lock, just before the new files replace the
+    // old. Returns 1 if compacted, 0 if skipped (it is retried on the next
+    // deletion), or -1 on error.
+    char mailbox_path[512];
+    char index_path[512];
+    char new_mailbox[600];
+    char new_index[600];
+    mailbox_path_for(email, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+    mailbox_path_for(email, storage_engine == STORAGE_SEGMENT ? ".seg.idx" : ".idx", index_path,
+                     sizeof(index_path));
+    snprintf(new_mailbox, sizeof(new_mailbox), "%s.compact", mailbox_path);
+    snprintf(new_index, sizeof(new_index), "%s.compact", index_path);
+
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    MailboxIndex old;
+    int status = mailbox_index_open_shared(email, &old, lock);
+    int mailbox_fd = status == 0 ? open(mailbox_path, O_RDONLY) : -1;
+    pthread_rwlock_unlock(lock);
+    if (status != 0) return status > 0 ? 0 : -1;
+
+    IndexHeader snapshot = old.header;
+    if (mailbox_fd < 0 || !compact_due(&snapshot)) {
+        if (mailbox_fd < 0) log_message(LOG_ERROR, 0, "Error opening mailbox: %s", strerror(errno));
+        if (mailbox_fd >= 0) close(mailbox_fd);
+        mailbox_index_close(&old);
+        return mailbox_fd < 0 ? -1 : 0;
+    }
+
+    struct stat st;
+    MailboxIndex fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    snprintf(fresh.path, sizeof(fresh.path), "%s", new_index);
+    int new_fd = open(new_mailbox, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    fresh.fd = open(new_index, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    status = new_fd < 0 || fresh.fd < 0 || fstat(new_fd, &st) < 0 ? -1 : 0;
+    fresh.header.magic = INDEX_MAGIC;
+    fresh.header.version = INDEX_VERSION;
+    fresh.header.mailbox_inode = status == 0 ? st.st_ino : 0;
+    fresh.header.next_id = 1;
+
+    // Copy the records of the emails in the snapshot
+    Compaction c;
+    memset(&c, 0, sizeof(c));
+    c.old = &old;
+    c.fresh = &fresh;
+    c.mailbox_fd = mailbox_fd;
+    c.new_fd = new_fd;
+    if (status == 0) status = compact_next(&c, 0);
+    if (status == 0) status = compact_scan(&c, snapshot.mailbox_size);
+    if (status == 0 && c.slot != snapshot.count) {
+        log_message(LOG_WARN, 0, "Not compacting %s: %d indexed emails missing from the mailbox",
+                    email, snapshot.count - c.slot);
+        status = -1;
+    }
+
+    // If the last ID handed out was deleted, its tombstone keeps it from
+    // being handed out again by an index rebuilt from the new file
+    uint64_t dead_bytes = 0;
+    if (status == 0 && fresh.header.next_id < snapshot.next_id) {
+        ssize_t len = mailbox_write_tombstone(new_fd, c.pos, snapshot.next_id - 1);
+        if (len < 0) status = -1;
+        c.pos += len;
+        dead_bytes += len;
+    }
+    if (status == 0 && fdatasync(new_fd) < 0) status = -1;
+
+    int installed = 0;
+    uint64_t old_size = 0;
+    if (status == 0) {
+        mailbox_write_lock(lock);
+        MailboxIndex current;
+        int open_status = mailbox_index_open(email, &current, INDEX_REPAIR);
+        if (open_status != 0) {
+            status = open_status > 0 ? 0 : -1;
+        } else {
+            // Emails appended since the snapshot all have higher IDs; an
+            // email deleted since then means starting over
+            int appended = mailbox_index_seek(&current, snapshot.next_id);
+            if (current.header.mailbox_inode != snapshot.mailbox_inode || appended != snapshot.count ||
+                current.header.deleted != snapshot.deleted) {
+                status = appended < 0 ? -1 : 0;
+                log_message(LOG_DEBUG, 0, "Compaction of %s deferred: the mailbox changed", email);
+            } else {
+                uint64_t tail = current.header.mailbox_size - snapshot.mailbox_size;
+                uint64_t new_size = c.pos + tail;
+                if (copy_range(mailbox_fd, snapshot.mailbox_size, new_fd, c.pos, tail) < 0) {
+                    status = -1;
+                }
+
+                IndexEntry entries[LIST_BATCH];
+                for (int slot = appended; status == 0 && slot < current.header.count;) {
+                    int n = mailbox_index_read(&current, slot, entries, LIST_BATCH);
+                    if (n <= 0) {
+                        status = -1;
+                        break;
+                    }
+                    for (int i = 0; i < n && status == 0; i++) {
+                        if (!entries[i].blob[0]) entries[i].offset += c.pos - snapshot.mailbox_size;
+                        if (mailbox_index_append(&fresh, &entries[i], new_size) != 0) status = -1;
+                    }
+                    slot += n;
+                }
+
+                fresh.header.mailbox_size = new_size;
+                fresh.header.next_id = current.header.next_id;
+                fresh.header.dead_bytes = dead_bytes + current.header.dead_bytes - snapshot.dead_bytes;
+                if (status == 0 &&
+                    (pwrite(fresh.fd, &fresh.header, sizeof(IndexHeader), 0) != sizeof(IndexHeader) ||
+                     fdatasync(new_fd) < 0)) {
+                    status = -1;
+                }
+
+                // The mailbox goes first: until the index follows, its inode
+                // no longer matches and it would be rebuilt
+                if (status == 0 && (rename(new_mailbox, mailbox_path) < 0 || rename(new_index, index_path) < 0)) {
+                    log_message(LOG_ERROR, 0, "Error installing compacted mailbox: %s", strerror(errno));
+                    status = -1;
+                }
+                if (status == 0) {
+                    installed = 1;
+                    old_size = current.header.mailbox_size;
+                    c.pos = new_size;
+                    cache_invalidate(email, 0);
+
+                    // The search index still holds the deleted emails' postings
+                    char search_path[512];
+                    mailbox_path_for(email, storage_engine == STORAGE_SEGMENT ? ".seg.sidx" : ".sidx", search_path,
+                                     sizeof(search_path));
+                    unlink(search_path);
+                }
+            }
+            mailbox_index_close(&current);
+        }
+        pthread_rwlock_unlock(lock);
+    }
+
+    if (status < 0) {
+        log_message(LOG_ERROR, 0, "Compacting %s failed: %s", email, strerror(errno));
+    }
+    if (!installed) {
+        unlink(new_mailbox);
+        unlink(new_index);
+    }
+    if (new_fd >= 0) close(new_fd);
+    mailbox_index_close(&fresh);
+    mailbox_index_close(&old);
+    close(mailbox_fd);
+    if (!installed) return status;
+
+    atomic_fetch_add(&compactions, 1);
+    atomic_fetch_add(&compacted_bytes, old_size - c.pos);
+    if (c.dropped_blobs > 0) atomic_store(&blob_collect_due, 1);
+    log_message(LOG_INFO, 0, "Compacted %s: %lu to %lu bytes, %d emails", email,
+                (unsigned long)old_size, (unsigned long)c.pos, fresh.header.count);
+    return 1;
+}
+
+int compact_scan(Compaction *c, uint64_t end) {
+    // Walks the records of the old mailbox in [0, end), handing each email's
+    // record to compact_record(); tombstones and damaged bytes are left behind
+    if (storage_engine == STORAGE_SEGMENT) {
+        uint64_t pos = 0;
+        while (pos < end) {
+            SegmentRecord record;
+            ssize_t len = segment_read_record(c->mailbox_fd, pos, end, &record);
+            if (len < 0) {
+                pos = segment_resync(c->mailbox_fd, pos + 1, end);
+                continue;
+            }
+            if (record.size > 0 && compact_record(c, record.id, pos, len) != 0) return -1;
+            pos += len;
+        }
+        return 0;
+    }
+
+    int dup_fd = dup(c->mailbox_fd);
+    FILE *mailbox = dup_fd >= 0 ? fdopen(dup_fd, "r") : NULL;
+    if (!mailbox) {
+        if (dup_fd >= 0) close(dup_fd);
+        return -1;
+    }
+
+    // A record runs from the newline before its start marker to the end of
+    // its end marker line
+    char line[BUFFER_SIZE];
+    uint64_t pos = 0;
+    uint64_t start = 0;
+    int at_line_start = 1;
+    int in_email = 0;
+    int id = 0;
+    int status = 0;
+    while (pos < end && fgets(line, sizeof(line), mailbox)) {
+        size_t len = strlen(line);
+        int line_start = at_line_start;
+        at_line_start = (len > 0 && line[len - 1] == '\n');
+
+        if (line_start && strncmp(line, "--- Email ID:", 13) == 0 &&
+            sscanf(line, "--- Email ID: %d ---", &id) == 1) {
+            start = pos > 0 ? pos - 1 : 0;
+            in_email = 1;
+        } else if (in_email && line_start && strncmp(line, "--- End Email ID:", 17) == 0) {
+            in_email = 0;
+            if (compact_record(c, id, start, pos + len - start) != 0) {
+                status = -1;
+                break;
+            }
+        }
+        pos += len;
+    }
+    fclose(mailbox);
+    return status;
+}
+
+int compact_record(Compaction *c, int id, uint64_t start, uint64_t len) {
+    // Copies the record at [start, start + len) to the new mailbox if its
+    // email is still indexed. Records come in ID order, as the index does,
+    // so each is matched against the next unmatched slot.
+    if (c->slot == c->old->header.count || c->entry.id > id) return 0;
+    if (c->entry.id < id) return -1;
+
+    IndexEntry entry = c->entry;
+    if (!entry.blob[0]) entry.offset = entry.offset - start + c->pos;
+    if (copy_range(c->mailbox_fd, start, c->new_fd, c->pos, len) < 0 ||
+        mailbox_index_append(c->fresh, &entry, c->pos + len) != 0) {
+        return -1;
+    }
+    c->pos += len;
+    return compact_next(c, c->slot + 1);
+}
+
+int compact_next(Compaction *c, int slot) {
+    // Moves on to the first slot from slot on whose email was not deleted,
+    // or to the end of the snapshot
+    int count = c->old->header.count;
+    for (c->slot = slot; c->slot < count; c->slot++) {
+        if (mailbox_index_read(c->old, c->slot, &c->entry, 1) != 1) return -1;
+        if (!mailbox_index_hidden(&c->entry, c->old->header.deleted)) break;
+        if (c->entry.blob[0]) c->dropped_blobs++;
+    }
+    return 0;
+}
+
+int blob_collect() {
+    // Removes the shared bodies no live email refers to. The directory is
+    // read while no shared delivery is under way, so each body listed has
+    // all the references it will get. Returns how many went, or -1.
+    if (!blob_collect_enabled) return 0;
+
+    pthread_rwlock_wrlock(&blob_lock);
+    DIR *dir = opendir(BLOB_DIR);
+    char (*blobs)[48] = NULL;
+    int count = 0;
+    int capacity = 0;
+    int status = dir ? 0 : -1;
+    struct dirent *ent;
+    while (status == 0 && (ent = readdir(dir)) != NULL) {
+        if (strlen(ent->d_name) >= 48 || !blob_name_valid(ent->d_name)) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char (*grown)[48] = realloc(blobs, capacity * sizeof(*blobs));
+            if (!grown) {
+                status = -1;
+                break;
+            }
+            blobs = grown;
+        }
+        memcpy(blobs[count++], ent->d_name, strlen(ent->d_name) + 1);
+    }
+    if (dir) closedir(dir);
+    pthread_rwlock_unlock(&blob_lock);
+
+    // Emails still indexed keep their bodies; deleted ones are only hidden
+    BlobSet live;
+    memset(&live, 0, sizeof(live));
+    char (*names)[256] = NULL;
+    int mailboxes = status == 0 && count > 0 ? mailbox_names(&names) : 0;
+    if (mailboxes < 0) status = -1;
+    for (int m = 0; m < mailboxes && status == 0; m++) {
+        MailboxIndex index;
+        pthread_rwlock_t *lock = mailbox_lock_for(names[m]);
+        int open_status = mailbox_index_open_shared(names[m], &index, lock);
+        if (open_status != 0) {
+            pthread_rwlock_unlock(lock);
+            if (open_status < 0) status = -1;
+            continue;
+        }
+        for (int slot = 0; status == 0 && slot < index.header.count;) {
+            IndexEntry entries[LIST_BATCH];
+            int n = mailbox_index_read(&index, slot, entries, LIST_BATCH);
+            if (n <= 0) {
+                status = -1;
+                break;
+            }
+            for (int i = 0; i < n && status == 0; i++) {
+                if (!entries[i].blob[0] || mailbox_index_hidden(&entries[i], index.header.deleted)) continue;
+                if (blob_set_add(&live, entries[i].blob) < 0) status = -1;
+            }
+            slot += n;
+        }
+        mailbox_index_close(&index);
+        pthread_rwlock_unlock(lock);
+    }
+    free(names);
+
+    // New references only go to bodies created after the listing, so a body
+    // unreferenced now stays that way
+    int removed = 0;
+    for (int i = 0; i < count && status == 0; i++) {
+        int added = blob_set_add(&live, blobs[i]);
+        if (added < 0) status = -1;
+        if (added <= 0) continue;
+
+        char path[512];
+        blob_path_for(blobs[i], path, sizeof(path));
+        if (unlink(path) == 0) removed++;
+    }
+    free(blobs);
+    free(live.hashes);
+
+    if (status != 0) {
+        log_message(LOG_ERROR, 0, "Collecting shared bodies failed: %s", strerror(errno));
+        return -1;
+    }
+    atomic_fetch_add(&blobs_collected, removed);
+    if (removed > 0) log_message(LOG_INFO, 0, "Removed %d unreferenced shared bodies", removed);
+    return removed;
+}
+
+char *email_read_body(int fd, const IndexEntry *entry) {
+    // Returns the email's length bytes, decompressed if need be, in a buffer
+    // the caller frees, or NULL on error
+    char *body = malloc(entry->length ? entry->length : 1);
+    if (!body) return NULL;
+
+    if (entry->codec == CODEC_NONE) {
+        if (pread_all(fd, body, entry->length, entry->offset) != (ssize_t)entry->length) {
+            log_message(LOG_ERROR, 0, "Error reading mailbox: %s", strerror(errno));
+            free(body);
+            return NULL;
+        }
+        return body;
+    }
+
+    char *packed = malloc(entry->stored_length);
+    ssize_t n = -1;
+    if (packed && pread_all(fd, packed, entry->stored_length, entry->offset) == (ssize_t)entry->stored_length) {
+        n = lz_decompress((unsigned char *)packed, entry->stored_length, (unsigned char *)body, entry->length);
+    }
+    free(packed);
+    if (n != (ssize_t)entry->length) {
+        log_message(LOG_ERROR, 0, "Cannot decompress email %d", entry->id);
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+ssize_t email_read_head(int fd, const IndexEntry *entry, char *head, size_t size) {
+    // Reads up to size bytes from the start of the email, for its headers
+    size_t want = entry->stored_length < size ? entry->stored_length : size;
+    if (entry->codec == CODEC_NONE) {
+        return pread_all(fd, head, want, entry->offset);
+    }
+
+    // Headers are mostly literals, so size packed bytes give nearly size plain ones
+    char packed[1024];
+    if (want > sizeof(packed)) want = sizeof(packed);
+    ssize_t n = pread_all(fd, packed, want, entry->offset);
+    if (n <= 0) return n;
+    return lz_decompress((unsigned char *)packed, n, (unsigned char *)head, size);
+}
+
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap) {
+    // Greedy LZ77 with a single-probe hash of the next four bytes. Each
+    // sequence is a token (literal count << 4 | match length - 4), the
+    // literals and a two-byte little-endian match offset; counts of 15 or
+    // more continue in extra bytes. The last sequence has literals only.
+    // Returns the packed size, or 0 if it would not fit in cap.
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t out = 0;
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    // The last match ends at least five bytes from the end, as in LZ4
+    while (len >= 13 && pos + 12 < len) {
+        uint32_t seq;
+        memcpy(&seq, src + pos, sizeof(seq));
+        uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+
+        uint32_t prior = 0;
+        if (candidate != 0) memcpy(&prior, src + candidate - 1, sizeof(prior));
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET || prior != seq) {
+            pos++;
+            continue;
+        }
+
+        candidate--;
+        size_t match_len = LZ_MIN_MATCH;
+        while (pos + match_len < len - 5 && src[candidate + match_len] == src[pos + match_len]) {
+            match_len++;
+        }
+
+        if (lz_emit(dst, cap, &out, src + anchor, pos - anchor, pos - candidate, match_len) != 0) {
+            return 0;
+        }
+        pos += match_len;
+        anchor = pos;
+    }
+
+    if (lz_emit(dst, cap, &out, src + anchor, len - anchor, 0, 0) != 0) {
+        return 0;
+    }
+    return out;
+}
+
+int lz_emit(unsigned char *dst, size_t cap, size_t *out, const unsigned char *literals,
+            size_t literal_len, size_t offset, size_t match_len) {
+    // Appends one sequence; a zero offset ends the block with literals only
+    size_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    size_t need = 1 + literal_len + literal_len / 255 + 1 + (match_len ? 2 + extra / 255 + 1 : 0);
+    if (*out + need > cap) return -1;
+
+    unsigned char *p = dst + *out;
+    *p++ = (literal_len < 15 ? literal_len : 15) << 4 | (extra < 15 ? extra : 15);
+    if (literal_len >= 15) {
+        size_t n = literal_len - 15;
+        for (; n >= 255; n -= 255) *p++ = 255;
+        *p++ = n;
+    }
+    memcpy(p, literals, literal_len);
+    p += literal_len;
+
+    if (match_len) {
+        *p++ = offset & 0xff;
+        *p++ = offset >> 8;
+        if (extra >= 15) {
+            size_t n = extra - 15;
+            for (; n >= 255; n -= 255) *p++ = 255;
+            *p++ = n;
+        }
+    }
+    *out = p - dst;
+    return 0;
+}
+
+ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap) {
+    // Returns the bytes produced, stopping early when src or dst runs out,
+    // or -1 if src refers back past the start of the output
+    size_t in = 0;
+    size_t out = 0;
+    while (in < len && out < cap) {
+        unsigned token = src[in++];
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            unsigned char b;
+            do {
+                if (in >= len) return out;
+                b = src[in++];
+                literal_len += b;
+            } while (b == 255);
+        }
+        size_t n = literal_len;
+        if (n > len - in) n = len - in;
+        if (n > cap - out) n = cap - out;
+        memcpy(dst + out, src + in, n);
+        in += n;
+        out += n;
+        if (n < literal_len || in + 2 > len) break;
+
+        size_t offset = src[in] | src[in + 1] << 8;
+        in += 2;
+        if (offset == 0 || offset > out) return -1;
+
+        size_t match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            unsigned char b;
+            do {
+                if (in >= len) return out;
+                b = src[in++];
+                match_len += b;
+            } while (b == 255);
+        }
+        if (match_len > cap - out) match_len = cap - out;
+
+        // Overlapping copies repeat the most recent bytes, so go byte by byte
+        const unsigned char *from = dst + out - offset;
+        if (offset >= match_len) {
+            memcpy(dst + out, from, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; i++) dst[out + i] = from[i];
+        }
+        out += match_len;
+    }
+    return out;
+}
+
+void crc32c_init() {
+    // Table for the reflected Castagnoli polynomial
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    // Continues a CRC-32C over more data; start with 0
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+int crc32c_file(int fd, off_t offset, size_t len, uint32_t *crc) {
+    // Continues *crc over len bytes of fd at offset
+    char buffer[BUFFER_SIZE];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+        ssize_t n = pread_all(fd, buffer, chunk, offset);
+        if (n <= 0) return -1;
+        *crc = crc32c(*crc, buffer, n);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int blob_create(int spool_fd, size_t content_len, char *name, size_t size) {
+    // Stores the spooled email once as BLOB_DIR/<name>, with the same trailing
+    // newline an inline email has before its end marker
+    char path[512];
+    int blob_fd = -1;
+    while (blob_fd < 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(name, size, "%lx%08lx%x", (unsigned long)now.tv_sec, (unsigned long)now.tv_nsec,
+                 atomic_fetch_add(&blob_counter, 1));
+        blob_path_for(name, path, sizeof(path));
+
+        blob_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (blob_fd < 0 && errno != EEXIST) {
+            log_message(LOG_ERROR, 0, "Error creating blob: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    if (copy_spool(spool_fd, blob_fd, 0, content_len) < 0 ||
+        pwrite(blob_fd, "\n", 1, content_len) != 1) {
+        log_message(LOG_ERROR, 0, "Error writing blob: %s", strerror(errno));
+        close(blob_fd);
+        unlink(path);
+        return -1;
+    }
+
+    close(blob_fd);
+    return 0;
+}
+
+int blob_restore(const char *name, int spool_fd, size_t content_len) {
+    // Writes the spooled email as BLOB_DIR/<name> unless a complete copy is
+    // already there. Returns 0 or -1.
+    char path[512];
+    struct stat st;
+    blob_path_for(name, path, sizeof(path));
+    if (stat(path, &st) == 0 && (uint64_t)st.st_size == content_len + 1) return 0;
+
+    int blob_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (blob_fd < 0 || copy_spool(spool_fd, blob_fd, 0, content_len) < 0 ||
+        pwrite(blob_fd, "\n", 1, content_len) != 1) {
+        log_message(LOG_ERROR, 0, "Error restoring blob: %s", strerror(errno));
+        if (blob_fd >= 0) close(blob_fd);
+        return -1;
+    }
+    close(blob_fd);
+    return 0;
+}
+
+int blob_name_valid(const char *name) {
+    // Names are hex digits, so one from elsewhere cannot point outside BLOB_DIR
+    if (!name[0]) return 0;
+    for (const char *p = name; *p; p++) {
+        if (!isxdigit((unsigned char)*p)) return 0;
+    }
+    return 1;
+}
+
+void blob_read_headers(IndexEntry *entry) {
+    // Fills in the sender and date from the start of a shared body
+    char path[512];
+    char blob_head[1024];
+    blob_path_for(entry->blob, path, sizeof(path));
+    int blob_fd = open(path, O_RDONLY);
+    if (blob_fd >= 0) {
+        ssize_t n = pread_all(blob_fd, blob_head, sizeof(blob_head), 0);
+        if (n > 0) parse_email_headers(blob_head, n, entry);
+        close(blob_fd);
+    }
+}
+
+void blob_path_for(const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", BLOB_DIR, name);
+}
+
+int copy_spool(int spool_fd, int dest_fd, off_t dest_offset, size_t len) {
+    return copy_range(spool_fd, 0, dest_fd, dest_offset, len);
+}
+
+int copy_range(int src_fd, off_t src_offset, int dest_fd, off_t dest_offset, size_t len) {
+    // Let the kernel move the bytes when it can, otherwise copy through a buffer
+    loff_t in_off = src_offset;
+    loff_t out_off = dest_offset;
+    while (len > 0) {
+        ssize_t n = copy_file_range(src_fd, &in_off, dest_fd, &out_off, len, 0);
+        if (n <= 0) break;
+        len -= n;
+    }
+
+    char buffer[BUFFER_SIZE];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+        ssize_t n = pread_all(src_fd, buffer, chunk, in_off);
+        if (n <= 0 || pwrite(dest_fd, buffer, n, out_off) != n) {
+            return -1;
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void mailbox_path_for(const char *email, const char *ext, char *path, size_t size) {
+    snprintf(path, size, "%s/%s%s", MAILBOX_DIR, email, ext);
+}
+
+const char *mailbox_ext() {
+    // The file holding a mailbox's emails under the selected storage engine
+    return storage_engine == STORAGE_SEGMENT ? ".seg" : ".txt";
+}
+
+int mailbox_index_open(const char *email, MailboxIndex *index, int flags) {
+    // Returns 0 on success, 1 if the mailbox does not exist, -1 on error, or
+    // INDEX_STALE if the index needs repair and INDEX_REPAIR was not given.
+    // Repairing requires the mailbox write lock; plain opens need the read lock.
+    char mailbox_path[512];
+    char index_path[512];
+    mailbox_path_for(email, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+    mailbox_path_for(email, storage_engine == STORAGE_SEGMENT ? ".seg.idx" : ".idx", index_path,
+                     sizeof(index_path));
+
+    int mailbox_fd = open(mailbox_path, (flags & INDEX_CREATE) ? O_RDONLY | O_CREAT : O_RDONLY, 0600);
+    if (mailbox_fd < 0) {
+        if (errno == ENOENT) return 1;
+        log_message(LOG_ERROR, 0, "Error opening mailbox: %s", strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(mailbox_fd, &st) < 0) {
+        log_message(LOG_ERROR, 0, "Error reading mailbox size: %s", strerror(errno));
+        close(mailbox_fd);
+        return -1;
+    }
+
+    snprintf(index->path, sizeof(index->path), "%s", index_path);
+    index->fd = open(index_path, O_RDWR);
+    int fresh = 0;
+    if (index->fd >= 0) {
+        ssize_t n = pread_all(index->fd, (char *)&index->header, sizeof(IndexHeader), 0);
+        if (n == sizeof(IndexHeader) &&
+            index->header.magic == INDEX_MAGIC &&
+            index->header.version == INDEX_VERSION &&
+            index->header.mailbox_inode == (uint64_t)st.st_ino &&
+            index->header.mailbox_size <= (uint64_t)st.st_size) {
+            fresh = 1;
+        } else {
+            close(index->fd);
+            index->fd = -1;
+        }
+    }
+
+    if ((!fresh || index->header.mailbox_size < (uint64_t)st.st_size) && !(flags & INDEX_REPAIR)) {
+        mailbox_index_close(index);
+        close(mailbox_fd);
+        return INDEX_STALE;
+    }
+
+    int status = 0;
+    if (!fresh) {
+        // Missing or unusable index: rebuild it from the text file
+        status = mailbox_index_rebuild(index_path, mailbox_fd, &st, index);
+        cache_invalidate(email, 0);
+    } else if (index->header.mailbox_size < (uint64_t)st.st_size) {
+        // Appended to without the index being updated: index only the new tail
+        status = mailbox_index_scan(mailbox_fd, index->header.mailbox_size, st.st_size, index);
+        cache_invalidate(email, 0);
+    }
+
+    close(mailbox_fd);
+    if (status != 0) {
+        mailbox_index_close(index);
+        return -1;
+    }
+    return 0;
+}
+
+int mailbox_index_open_shared(const char *email, MailboxIndex *index, pthread_rwlock_t *lock) {
+    // Opens the index with the mailbox lock held for reading. If the index has
+    // to be repaired first, the lock is retaken for writing and stays that way.
+    // Either way the caller releases the lock.
+    mailbox_read_lock(lock);
+    int status = mailbox_index_open(email, index, 0);
+    if (status == INDEX_STALE) {
+        pthread_rwlock_unlock(lock);
+        mailbox_write_lock(lock);
+        status = mailbox_index_open(email, index, INDEX_REPAIR);
+    }
+    return status;
+}
+
+void mailbox_index_close(MailboxIndex *index) {
+    if (index->fd >= 0) {
+        close(index->fd);
+        index->fd = -1;
+    }
+}
+
+int mailbox_index_rebuild(const char *index_path, int mailbox_fd, const struct stat *st, MailboxIndex *index) {
+    char tmp_path[600];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+
+    index->fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (index->fd < 0) {
+        log_message(LOG_ERROR, 0, "Error creating mailbox index: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(index->path, sizeof(index->path), "%s", tmp_path);
+
+    memset(&index->header, 0, sizeof(IndexHeader));
+    index->header.magic = INDEX_MAGIC;
+    index->header.version = INDEX_VERSION;
+    index->header.mailbox_inode = st->st_ino;
+    index->header.next_id = 1;
+
+    if (mailbox_index_scan(mailbox_fd, 0, st->st_size, index) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, index_path) < 0) {
+        log_message(LOG_ERROR, 0, "Error installing mailbox index: %s", strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    snprintf(index->path, sizeof(index->path), "%s", index_path);
+
+    log_message(LOG_INFO, 0, "Rebuilt index %s (%d emails)", index_path, mailbox_index_live(&index->header));
+    return 0;
+}
+
+int mailbox_index_scan(int mailbox_fd, uint64_t from, uint64_t to, MailboxIndex *index) {
+    // Parse the "--- Email ID: N ---" / "--- End Email ID: N ---" markers in
+    // [from, to) and append an entry for each complete email found; a
+    // "--- Deleted Email ID: N ---" tombstone removes email N again
+    if (storage_engine == STORAGE_SEGMENT) {
+        return segment_index_scan(mailbox_fd, from, to, index);
+    }
+
+    int dup_fd = dup(mailbox_fd);
+    FILE *mailbox = dup_fd >= 0 ? fdopen(dup_fd, "r") : NULL;
+    if (!mailbox) {
+        log_message(LOG_ERROR, 0, "Error scanning mailbox: %s", strerror(errno));
+        if (dup_fd >= 0) close(dup_fd);
+        return -1;
+    }
+    fseeko(mailbox, from, SEEK_SET);
+
+    char line[BUFFER_SIZE];
+    uint64_t pos = from;
+    int at_line_start = 1;
+    int in_email = 0;
+    IndexEntry entry;
+    int status = 0;
+
+    while (pos < to && fgets(line, sizeof(line), mailbox)) {
+        size_t len = strlen(line);
+        int line_start = at_line_start;
+        at_line_start = (len > 0 && line[len - 1] == '\n');
+
+        int id;
+        if (line_start && strncmp(line, "--- Email ID:", 13) == 0 &&
+            sscanf(line, "--- Email ID: %d ---", &id) == 1) {
+            // A start marker inside an email means the previous one was torn
+            memset(&entry, 0, sizeof(entry));
+            entry.id = id;
+            entry.offset = pos + len;
+            in_email = 1;
+        } else if (line_start && strncmp(line, "--- Deleted Email ID:", 21) == 0 &&
+                   sscanf(line, "--- Deleted Email ID: %d ---", &id) == 1) {
+            // Like a start marker, a tombstone ends any torn email before it.
+            // It counts with the newline before it.
+            in_email = 0;
+            if (mailbox_index_tombstone(index, id, len + 1, pos + len) != 0) {
+                log_message(LOG_ERROR, 0, "Error writing mailbox index: %s", strerror(errno));
+                status = -1;
+                break;
+            }
+        } else if (in_email && line_start && strncmp(line, "--- End Email ID:", 17) == 0) {
+            entry.length = pos - entry.offset;
+            in_email = 0;
+
+            // Headers (or a shared body reference) are the first lines of the email
+            char head[1024];
+            ssize_t head_len = pread_all(mailbox_fd, head,
+                                         entry.length < sizeof(head) ? entry.length : sizeof(head),
+                                         entry.offset);
+            if (head_len > 0) {
+                resolve_index_entry(head, head_len, &entry);
+            }
+            entry.stored_length = entry.length;
+
+            if (mailbox_index_append(index, &entry, pos + len) != 0) {
+                log_message(LOG_ERROR, 0, "Error writing mailbox index: %s", strerror(errno));
+                status = -1;
+                break;
+            }
+        }
+
+        pos += len;
+    }
+
+    fclose(mailbox);
+    if (status != 0) return status;
+
+    // The whole range has been consumed, including any torn trailing email
+    index->header.mailbox_size = to;
+    if (pwrite(index->fd, &index->header, sizeof(IndexHeader), 0) != sizeof(IndexHeader)) {
+        log_message(LOG_ERROR, 0, "Error writing mailbox index: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int mailbox_index_append(MailboxIndex *index, const IndexEntry *entry, uint64_t mailbox_size) {
+    off_t offset = sizeof(IndexHeader) + (off_t)index->header.count * sizeof(IndexEntry);
+    if (pwrite(index->fd, entry, sizeof(IndexEntry), offset) != sizeof(IndexEntry)) {
+        return -1;
+    }
+
+    index->header.count++;
+    if (entry->id >= index->header.next_id) {
+        index->header.next_id = entry->id + 1;
+    }
+    index->header.mailbox_size = mailbox_size;
+
+    // The header is written last so a crash leaves at most an unused entry
+    if (pwrite(index->fd, &index->header, sizeof(IndexHeader), 0) != sizeof(IndexHeader)) {
+        return -1;
+    }
+    return 0;
+}
+
+int mailbox_index_read(MailboxIndex *index, int first, IndexEntry *entries, int max) {
+    // Reads up to max consecutive entries starting at slot first
+    if (first >= index->header.count) return 0;
+    if (max > index->header.count - first) max = index->header.count - first;
+
+    off_t offset = sizeof(IndexHeader) + (off_t)first * sizeof(IndexEntry);
+    ssize_t n = pread_all(index->fd, (char *)entries, max * sizeof(IndexEntry), offset);
+    if (n < 0) {
+        log_message(LOG_ERROR, 0, "Error reading mailbox index: %s", strerror(errno));
+        return -1;
+    }
+    return n / sizeof(IndexEntry);
+}
+
+int mailbox_index_tombstone(MailboxIndex *index, int id, uint64_t tombstone_len, uint64_t mailbox_size) {
+    // Records the tombstone of email id, which ends the mailbox at
+    // mailbox_size: its entry is marked deleted where it stands and its bytes
+    // count as dead until compaction drops both. The ID is never handed out
+    // again.
+    if (id >= index->header.next_id) {
+        index->header.next_id = id + 1;
+    }
+    index->header.dead_bytes += tombstone_len;
+    index->header.mailbox_size = mailbox_size;
+
+    IndexEntry entry;
+    int slot = mailbox_index_seek(index, id);
+    if (slot < 0) return -1;
+    int n = mailbox_index_read(index, slot, &entry, 1);
+    if (n < 0) return -1;
+
+    // A mark beyond the header's count was made just before a crash kept the
+    // header from being written; otherwise a marked entry is already gone, as
+    // is the last ID of a compacted mailbox, whose tombstone is kept
+    if (n == 1 && entry.id == id && (entry.deleted == 0 || entry.deleted > index->header.deleted)) {
+        int32_t deleted = ++index->header.deleted;
+        off_t offset = sizeof(IndexHeader) + (off_t)slot * sizeof(IndexEntry) + offsetof(IndexEntry, deleted);
+        index->header.dead_bytes += mailbox_record_size(&entry);
+        if (pwrite(index->fd, &deleted, sizeof(deleted), offset) != sizeof(deleted)) {
+            return -1;
+        }
+    }
+
+    // The header goes last, so a crash before it leaves the tombstone to be
+    // found again by the next scan of the mailbox
+    if (pwrite(index->fd, &index->header, sizeof(IndexHeader), 0) != sizeof(IndexHeader)) {
+        return -1;
+    }
+    return 0;
+}
+
+int mailbox_index_live(const IndexHeader *header) {
+    // The number of emails listed: entries not marked deleted
+    return header->count - header->deleted;
+}
+
+int mailbox_index_hidden(const IndexEntry *entry, int deleted) {
+    // Whether an entry is left out by a reader that saw the header's deleted
+    // count at deleted. Marks made after that are not, so a listing begun
+    // before a deletion keeps the line count it announced.
+    return entry->deleted != 0 && entry->deleted <= deleted;
+}
+
+int mailbox_index_range(MailboxIndex *index, int *first, int *end, int skip, int max) {
+    // Narrows slots [*first, *end) to the emails a listing sends: it skips
+    // skip emails, then takes up to max (all if max < 0). Returns how many,
+    // or -1 on error. Without deleted entries no slot needs reading.
+    if (index->header.deleted == 0) {
+        *first = *first + skip < *end ? *first + skip : *end;
+        if (max >= 0 && max < *end - *first) *end = *first + max;
+        return *end - *first;
+    }
+
+    IndexEntry entries[LIST_BATCH];
+    int lines = 0;
+    int slot = *first;
+    int start = -1;
+    while (slot < *end && (max < 0 || lines < max)) {
+        int n = mailbox_index_read(index, slot, entries, LIST_BATCH);
+        if (n <= 0) return -1;
+        if (n > *end - slot) n = *end - slot;
+        for (int i = 0; i < n && (max < 0 || lines < max); i++, slot++) {
+            if (mailbox_index_hidden(&entries[i], index->header.deleted)) continue;
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            if (start < 0) start = slot;
+            lines++;
+        }
+    }
+    *first = start >= 0 ? start : slot;
+    *end = slot;
+    return lines;
+}
+
+uint64_t mailbox_record_size(const IndexEntry *entry) {
+    // Bytes the email's record takes up in its mailbox
+    if (storage_engine == STORAGE_SEGMENT) {
+        return sizeof(SegmentRecord) + (entry->blob[0] ? 0 : entry->stored_length);
+    }
+
+    // Markers and body as mailbox_write_text() lays them out; the stored
+    // length already includes the newline that starts the end marker
+    uint64_t size = snprintf(NULL, 0, "\n--- Email ID: %d ---\n", entry->id) +
+                    snprintf(NULL, 0, "\n--- End Email ID: %d ---\n", entry->id);
+    if (entry->blob[0]) {
+        return size + snprintf(NULL, 0, "Blob: %s %u", entry->blob, entry->length);
+    }
+    return size + entry->stored_length - 1;
+}
+
+int mailbox_index_find(MailboxIndex *index, int id, IndexEntry *entry) {
+    // Returns 0 if found, 1 if not, -1 on error
+    int slot = mailbox_index_seek(index, id);
+    if (slot < 0) return -1;
+    if (mailbox_index_read(index, slot, entry, 1) != 1) return slot == index->header.count ? 1 : -1;
+    return entry->id == id && !mailbox_index_hidden(entry, index->header.deleted) ? 0 : 1;
+}
+
+int mailbox_index_seek(MailboxIndex *index, int id) {
+    // Returns the first slot whose ID is at least id (count if none), or -1 on error
+    int count = index->header.count;
+
+    // IDs are normally dense from 1, so the answer is usually slot id - 1
+    // (or count, for an ID past the end) and the slot before it confirms it
+    int lo = 0;
+    int hi = count;
+    int guess = id - 1 < count ? id - 1 : count - 1;
+    if (guess < 0) guess = 0;
+    int predicted = 1;
+
+    while (lo < hi) {
+        int32_t slot_id;
+        off_t offset = sizeof(IndexHeader) + (off_t)guess * sizeof(IndexEntry);
+        if (pread_all(index->fd, (char *)&slot_id, sizeof(slot_id), offset) != sizeof(slot_id)) {
+            log_message(LOG_ERROR, 0, "Error reading mailbox index: %s", strerror(errno));
+            return -1;
+        }
+
+        if (slot_id < id) {
+            lo = guess + 1;
+        } else {
+            hi = guess;
+        }
+        guess = predicted ? (slot_id < id ? lo : hi - 1) : lo + (hi - lo) / 2;
+        predicted = 0;
+    }
+    return lo;
+}
+
+void parse_email_headers(const char *content, size_t len, IndexEntry *entry) {
+    // Pick the sender and date out of the leading "From:" and "Date:" lines
+    const char *p = content;
+    const char *end = content + len;
+    int lines = 0;
+
+    while (p < end && lines < 2) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t line_len = eol ? (size_t)(eol - p) : (size_t)(end - p);
+        char line[512];
+        if (line_len >= sizeof(line)) line_len = sizeof(line) - 1;
+        memcpy(line, p, line_len);
+        line[line_len] = '\0';
+
+        if (strncmp(line, "From:", 5) == 0) {
+            sscanf(line, "From: %255s", entry->sender);
+        } else if (strncmp(line, "Date:", 5) == 0) {
+            sscanf(line, "Date: %63[^\r\n]", entry->date);
+        }
+
+        if (!eol) break;
+        p = eol + 1;
+        lines++;
+    }
+}
+
+void resolve_index_entry(const char *head, size_t len, IndexEntry *entry) {
+    // Inline emails start with their headers; shared ones with a reference
+    // line "Blob: <name> <length>" pointing at the body file
+    if (len > 6 && strncmp(head, "Blob: ", 6) == 0) {
+        char line[128];
+        size_t line_len = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+        memcpy(line, head, line_len);
+        line[line_len] = '\0';
+
+        unsigned long blob_len;
+        if (sscanf(line, "Blob: %47s %lu", entry->blob, &blob_len) == 2) {
+            entry->offset = 0;
+            entry->length = blob_len;
+            blob_read_headers(entry);
+            return;
+        }
+        entry->blob[0] = '\0';
+    }
+
+    parse_email_headers(head, len, entry);
+}
+
+char *get_current_date() {
+    static char date_str[64];
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    
+    strftime(date_str, sizeof(date_str), "%d-%m-%Y", t);
+    return date_str;
+}
+
+int search_index_open(const char *email, MailboxIndex *mailbox, SearchIndex *search, int flags) {
+    // Opens the search index of a mailbox whose index is open. Returns 0 on
+    // success, -1 on error, or INDEX_STALE if the search index is missing or
+    // behind and INDEX_REPAIR was not given. Repairing needs the write lock.
+    char path[512];
+    mailbox_path_for(email, storage_engine == STORAGE_SEGMENT ? ".seg.sidx" : ".sidx", path, sizeof(path));
+    search->fd = open(path, (flags & INDEX_REPAIR) ? O_RDWR | O_CREAT : O_RDWR, 0600);
+    if (search->fd < 0) {
+        if (errno == ENOENT) return INDEX_STALE;
+        log_message(LOG_ERROR, 0, "Error opening search index: %s", strerror(errno));
+        return -1;
+    }
+
+    // An index ahead of the mailbox belongs to an earlier mailbox of that
+    // name; one whose mailbox outgrew its chain heads fourfold is rebuilt
+    int emails = mailbox_index_live(&mailbox->header);
+    ssize_t n = pread_all(search->fd, (char *)&search->header, sizeof(SearchHeader), 0);
+    int valid = n == sizeof(SearchHeader) &&
+                search_header_valid(&search->header) &&
+                search->header.next_id <= mailbox->header.next_id &&
+                search->header.buckets * 4 >= search_buckets_for(emails);
+    if (valid && search->header.next_id == mailbox->header.next_id) return 0;
+
+    if (!(flags & INDEX_REPAIR)) {
+        close(search->fd);
+        search->fd = -1;
+        return INDEX_STALE;
+    }
+    if ((!valid && search_index_reset(search, emails) != 0) ||
+        search_index_catch_up(email, mailbox, search) != 0) {
+        log_message(LOG_ERROR, 0, "Error updating search index: %s", strerror(errno));
+        close(search->fd);
+        search->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int search_index_reset(SearchIndex *search, int emails) {
+    // Empties the index: a header and zeroed chain heads for a mailbox of
+    // that many emails
+    memset(&search->header, 0, sizeof(SearchHeader));
+    search->header.magic = SEARCH_MAGIC;
+    search->header.version = SEARCH_VERSION;
+    search->header.next_id = 1;
+    search->header.buckets = search_buckets_for(emails);
+    search->header.size = sizeof(SearchHeader) + search->header.buckets * sizeof(uint64_t);
+    if (ftruncate(search->fd, 0) < 0 || ftruncate(search->fd, search->header.size) < 0 ||
+        pwrite(search->fd, &search->header, sizeof(SearchHeader), 0) != sizeof(SearchHeader)) {
+        return -1;
+    }
+    return 0;
+}
+
+int search_buckets_for(int emails) {
+    // The chain heads for a mailbox: a power of two near its email count
+    int buckets = SEARCH_MIN_BUCKETS;
+    while (buckets < emails && buckets < SEARCH_MAX_BUCKETS) buckets *= 2;
+    return buckets;
+}
+
+int search_header_valid(const SearchHeader *header) {
+    // Whether the header is of this version, with a chain head count
+    // search_buckets_for() could have given
+    int buckets = header->buckets;
+    return header->magic == SEARCH_MAGIC && header->version == SEARCH_VERSION &&
+           buckets >= SEARCH_MIN_BUCKETS && buckets <= SEARCH_MAX_BUCKETS && (buckets & (buckets - 1)) == 0;
+}
+
+int search_index_catch_up(const char *email, MailboxIndex *mailbox, SearchIndex *search) {
+    // Indexes the emails the search index does not cover yet, as when it is
+    // first built or a delivery found it behind
+    char mailbox_path[512];
+    mailbox_path_for(email, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+    int mailbox_fd = open(mailbox_path, O_RDONLY);
+    int slot = mailbox_index_seek(mailbox, search->header.next_id);
+    if (mailbox_fd < 0 || slot < 0) {
+        if (mailbox_fd >= 0) close(mailbox_fd);
+        return -1;
+    }
+
+    IndexEntry entries[LIST_BATCH];
+    int indexed = 0;
+    int status = 0;
+    while (status == 0 && slot < mailbox->header.count) {
+        int n = mailbox_index_read(mailbox, slot, entries, LIST_BATCH);
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+        for (int i = 0; i < n && status == 0; i++) {
+            if (mailbox_index_hidden(&entries[i], mailbox->header.deleted)) continue;
+            int fd = mailbox_fd;
+            if (entries[i].blob[0]) {
+                char path[512];
+                blob_path_for(entries[i].blob, path, sizeof(path));
+                fd = open(path, O_RDONLY);
+            }
+            char *body = fd >= 0 ? email_read_body(fd, &entries[i]) : NULL;
+            if (fd >= 0 && fd != mailbox_fd) close(fd);
+            if (!body) {
+                status = -1;
+                break;
+            }
+            size_t len = entries[i].length < SEARCH_MAX_BYTES ? entries[i].length : SEARCH_MAX_BYTES;
+            status = search_index_add(search, entries[i].id, entries[i].sender, body, len);
+            free(body);
+            indexed++;
+        }
+        slot += n;
+    }
+    close(mailbox_fd);
+    if (status != 0) return -1;
+
+    // Deleted emails leave gaps in the IDs; the index now covers them too
+    search->header.next_id = mailbox->header.next_id;
+    if (pwrite(search->fd, &search->header, sizeof(SearchHeader), 0) != sizeof(SearchHeader)) {
+        return -1;
+    }
+    if (indexed > 0) {
+        log_message(LOG_INFO, 0, "Indexed %d emails of %s for search", indexed, email);
+    }
+    return 0;
+}
+
+void search_index_append(const char *email, const IndexEntry *entry, int spool_fd, size_t content_len) {
+    // Indexes an email just appended to the mailbox; the caller holds the
+    // write lock. An index that has fallen behind, or was never built for an
+    // existing mailbox, is left for the next SEARCH to catch up.
+    char path[512];
+    mailbox_path_for(email, storage_engine == STORAGE_SEGMENT ? ".seg.sidx" : ".sidx", path, sizeof(path));
+    SearchIndex search;
+    search.fd = open(path, entry->id == 1 ? O_RDWR | O_CREAT : O_RDWR, 0600);
+    if (search.fd < 0) return;
+
+    ssize_t n = pread_all(search.fd, (char *)&search.header, sizeof(SearchHeader), 0);
+    int current = n == sizeof(SearchHeader) &&
+                  search_header_valid(&search.header) &&
+                  search.header.next_id == entry->id;
+    if (!current && entry->id == 1) {
+        current = search_index_reset(&search, 1) == 0;
+    }
+
+    size_t len = content_len < SEARCH_MAX_BYTES ? content_len : SEARCH_MAX_BYTES;
+    char *text = current ? malloc(len ? len : 1) : NULL;
+    if (text && pread_all(spool_fd, text, len, 0) == (ssize_t)len &&
+        search_index_add(&search, entry->id, entry->sender, text, len) != 0) {
+        log_message(LOG_ERROR, 0, "Error updating search index: %s", strerror(errno));
+    }
+    free(text);
+    close(search.fd);
+}
+
+int search_index_add(SearchIndex *search, int id, const char *sender, const char *text, size_t len) {
+    // Appends a posting for each distinct term of the email, then the chain
+    // heads, then the header: a crash in between leaves postings no chain
+    // reaches, or an email indexed twice, never a chain into nothing
+    size_t sender_len = strlen(sender);
+    size_t max = (len + sender_len) / 2 + 2; // Terms are one or more characters apart
+    uint64_t *terms = malloc(max * sizeof(uint64_t));
+    size_t heads_len = search->header.buckets * sizeof(uint64_t);
+    uint64_t *heads = malloc(heads_len);
+    SearchPosting *postings = malloc(max * sizeof(SearchPosting));
+    int status = -1;
+    if (!terms || !heads || !postings) goto done;
+
+    // Sender words are found plain and as "from:" terms
+    size_t count = search_terms(sender, sender_len, "from:", terms, 0, max);
+    count = search_terms(text, len, NULL, terms, count, max);
+    qsort(terms, count, sizeof(uint64_t), compare_terms);
+
+    off_t heads_offset = sizeof(SearchHeader);
+    if (pread_all(search->fd, (char *)heads, heads_len, heads_offset) != (ssize_t)heads_len) {
+        goto done;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && terms[i] == terms[i - 1]) continue;
+        uint32_t bucket = search_bucket(search, terms[i]);
+        memset(&postings[n], 0, sizeof(SearchPosting));
+        postings[n].term = terms[i];
+        postings[n].id = id;
+        postings[n].prev = heads[bucket];
+        heads[bucket] = search->header.size + n * sizeof(SearchPosting);
+        n++;
+    }
+
+    SearchHeader header = search->header;
+    header.size += n * sizeof(SearchPosting);
+    if (id >= header.next_id) header.next_id = id + 1;
+    if (pwrite(search->fd, postings, n * sizeof(SearchPosting), search->header.size) ==
+            (ssize_t)(n * sizeof(SearchPosting)) &&
+        pwrite(search->fd, heads, heads_len, heads_offset) == (ssize_t)heads_len &&
+        pwrite(search->fd, &header, sizeof(SearchHeader), 0) == sizeof(SearchHeader)) {
+        search->header = header;
+        status = 0;
+    }
+
+done:
+    free(terms);
+    free(heads);
+    free(postings);
+    return status;
+}
+
+uint32_t search_bucket(SearchIndex *search, uint64_t term) {
+    return (term ^ (term >> 32)) & (search->header.buckets - 1);
+}
+
+int search_lookup(SearchIndex *search, const uint64_t *terms, int count, int **ids) {
+    // Finds the emails holding every term. Returns how many, with their IDs
+    // in descending order in *ids for the caller to free, or -1 on error.
+    int *result = NULL;
+    int n = 0;
+    for (int t = 0; t < count; t++) {
+        int *found = NULL;
+        int m = search_chain(search, terms[t], &found);
+        if (m < 0) {
+            free(result);
+            return -1;
+        }
+        if (t == 0) {
+            result = found;
+            n = m;
+        } else {
+            // Both lists are in descending order
+            int kept = 0;
+            for (int i = 0, j = 0; i < n && j < m;) {
+                if (result[i] == found[j]) {
+                    result[kept++] = result[i];
+                    i++;
+                    j++;
+                } else if (result[i] > found[j]) {
+                    i++;
+                } else {
+                    j++;
+                }
+            }
+            n = kept;
+            free(found);
+        }
+        if (n == 0) break;
+    }
+    *ids = result;
+    return n;
+}
+
+int search_chain(SearchIndex *search, uint64_t term, int **ids) {
+    // Walks the term's bucket. Returns the number of distinct IDs with the
+    // term, stored newest first in *ids for the caller to free, or -1.
+    uint32_t bucket = search_bucket(search, term);
+    uint64_t offset;
+    if (pread_all(search->fd, (char *)&offset, sizeof(offset),
+                  sizeof(SearchHeader) + bucket * sizeof(uint64_t)) != sizeof(offset)) {
+        return -1;
+    }
+
+    int *found = NULL;
+    int n = 0;
+    int capacity = 0;
+    while (offset != 0) {
+        // Chains only lead back towards the start of the file
+        SearchPosting posting;
+        if (offset >= search->header.size ||
+            pread_all(search->fd, (char *)&posting, sizeof(posting), offset) != sizeof(posting) ||
+            posting.prev >= offset) {
+            free(found);
+            return -1;
+        }
+        if (posting.term == term && (n == 0 || found[n - 1] != posting.id)) {
+            if (n == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                int *grown = realloc(found, capacity * sizeof(int));
+                if (!grown) {
+                    free(found);
+                    return -1;
+                }
+                found = grown;
+            }
+            found[n++] = posting.id;
+        }
+        offset = posting.prev;
+    }
+    *ids = found;
+    return n;
+}
+
+size_t search_terms(const char *text, size_t len, const char *prefix, uint64_t *terms, size_t count,
+                    size_t max) {
+    // Adds the hash of each word of text (a run of letters and digits, in any
+    // case) to terms[count..max) and returns the new count
+    size_t i = 0;
+    while (i < len && count < max) {
+        while (i < len && !isalnum((unsigned char)text[i])) i++;
+        size_t start = i;
+        while (i < len && isalnum((unsigned char)text[i])) i++;
+        if (i > start && i - start <= SEARCH_MAX_TERM) {
+            terms[count++] = search_hash(prefix, text + start, i - start);
+        }
+    }
+    return count;
+}
+
+int search_query_terms(const char *query, uint64_t *terms, size_t max) {
+    // Splits a SEARCH query into terms; "from:<words>" selects sender terms.
+    // Returns -1 if a word is longer than the index keeps.
+    for (const char *p = query; *p;) {
+        while (*p && !isalnum((unsigned char)*p)) p++;
+        size_t len = 0;
+        while (isalnum((unsigned char)p[len])) len++;
+        if (len > SEARCH_MAX_TERM) return -1;
+        p += len;
+    }
+
+    size_t count = 0;
+    while (*query && count < max) {
+        while (*query == ' ' || *query == '\t') query++;
+        size_t len = strcspn(query, " \t");
+        if (len > 5 && strncasecmp(query, "from:", 5) == 0) {
+            count = search_terms(query + 5, len - 5, "from:", terms, count, max);
+        } else {
+            count = search_terms(query, len, NULL, terms, count, max);
+        }
+        query += len;
+    }
+    return count;
+}
+
+uint64_t search_hash(const char *prefix, const char *word, size_t len) {
+    // 64-bit FNV-1a of the prefix and the lower-cased word
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = prefix ? prefix : ""; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)word[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int compare_terms(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void repl_start() {
+    // Each standby is caught up and streamed to by its own thread, so mail
+    // is never held back for a slow or missing standby
+    for (int i = 0; i < replica_count; i++) {
+        pthread_t thread_id;
+        if (thread_create(&thread_id, THREAD_STACK_SIZE, replica_thread, &replicas[i]) != 0) {
+            log_message(LOG_ERROR, 0, "Error creating replication thread: %s", strerror(errno));
+            exit(1);
+        }
+        pthread_detach(thread_id);
+    }
+
+    if (standby_socket >= 0) {
+        pthread_t thread_id;
+        if (thread_create(&thread_id, THREAD_STACK_SIZE, standby_thread, NULL) != 0) {
+            log_message(LOG_ERROR, 0, "Error creating standby thread: %s", strerror(errno));
+            exit(1);
+        }
+        pthread_detach(thread_id);
+    }
+}
+
+ReplChange *repl_change_new(int type, const char *email, const char *sender, const char *blob,
+                            int spool_fd, size_t len) {
+    // Makes a change for the standbys: a stored email (REPL_APPEND, with len
+    // bytes of body from the spool, or none for a shared body) or a deletion.
+    // Returns NULL if there are no standbys or on error.
+    if (replica_count == 0) return NULL;
+
+    ReplChange *change = malloc(sizeof(ReplChange) + len);
+    if (!change) {
+        log_message(LOG_ERROR, 0, "Error allocating replication change: %s", strerror(errno));
+        return NULL;
+    }
+    memset(&change->header, 0, sizeof(ReplHeader));
+    change->header.magic = REPL_MAGIC;
+    change->header.type = type;
+    change->header.length = len;
+    snprintf(change->header.email, sizeof(change->header.email), "%s", email);
+    snprintf(change->header.sender, sizeof(change->header.sender), "%s", sender);
+    snprintf(change->header.blob, sizeof(change->header.blob), "%s", blob ? blob : "");
+    if (len > 0 && pread_all(spool_fd, change->body, len, 0) != (ssize_t)len) {
+        log_message(LOG_ERROR, 0, "Error reading spool for replication: %s", strerror(errno));
+        free(change);
+        return NULL;
+    }
+    return change;
+}
+
+void repl_log_push(ReplChange *change, int id) {
+    // Queues a change for email id; the caller holds the mailbox write lock,
+    // so each mailbox's changes are queued in order. When the log is full the
+    // oldest changes are dropped, and a standby still needing them is caught
+    // up from the mailboxes instead.
+    if (!change) return;
+    change->header.id = id;
+    clock_gettime(CLOCK_MONOTONIC, &change->committed);
+
+    size_t size = sizeof(ReplChange) + change->header.length;
+    pthread_mutex_lock(&repl_log.lock);
+    while (repl_log.first_seq < repl_log.next_seq &&
+           (repl_log.next_seq - repl_log.first_seq >= REPL_LOG_SLOTS ||
+            repl_log.bytes + size > repl_buffer_size)) {
+        ReplChange *oldest = repl_log.changes[repl_log.first_seq % REPL_LOG_SLOTS];
+        repl_log.bytes -= sizeof(ReplChange) + oldest->header.length;
+        free(oldest);
+        repl_log.first_seq++;
+    }
+    change->header.seq = repl_log.next_seq++;
+    repl_log.changes[change->header.seq % REPL_LOG_SLOTS] = change;
+    repl_log.bytes += size;
+    pthread_cond_broadcast(&repl_log.ready);
+    pthread_mutex_unlock(&repl_log.lock);
+}
+
+int repl_send(int fd, int type, uint64_t seq, const char *email, const char *sender, const char *blob,
+              int id, const void *data, size_t len) {
+    ReplHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = REPL_MAGIC;
+    header.type = type;
+    header.seq = seq;
+    header.id = id;
+    header.length = len;
+    snprintf(header.email, sizeof(header.email), "%s", email);
+    snprintf(header.sender, sizeof(header.sender), "%s", sender);
+    snprintf(header.blob, sizeof(header.blob), "%s", blob);
+    if (write_all(fd, (const char *)&header, sizeof(header)) < 0 ||
+        (len > 0 && write_all(fd, data, len) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+size_t repl_format(char *text, size_t size) {
+    // The replication lines of the metrics report. A standby's lag is the
+    // number of changes it has not acknowledged and the age of the oldest.
+    size_t len = 0;
+    if (standby_socket >= 0 && size > 0) {
+        len += snprintf(text, size,
+                        "standby_changes_applied: %lu\r\n"
+                        "standby_last_change: %llu\r\n",
+                        atomic_load(&standby_applied),
+                        (unsigned long long)atomic_load(&standby_last_seq));
+    }
+    if (replica_count == 0 || len >= size) return len < size ? len : size - 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&repl_log.lock);
+    uint64_t last = repl_log.next_seq - 1;
+    len += snprintf(text + len, size - len,
+                    "replication_log_changes: %llu\r\n"
+                    "replication_log_bytes: %zu\r\n",
+                    (unsigned long long)(repl_log.next_seq - repl_log.first_seq), repl_log.bytes);
+    for (int i = 0; i < replica_count && len < size; i++) {
+        Replica *replica = &replicas[i];
+        uint64_t acked = atomic_load(&replica->acked_seq);
+        if (acked > last) acked = last;
+
+        // Changes dropped from the log have no time; the oldest kept stands in
+        uint64_t lag_ms = 0;
+        uint64_t oldest = acked + 1 > repl_log.first_seq ? acked + 1 : repl_log.first_seq;
+        if (acked < last && oldest < repl_log.next_seq) {
+            const struct timespec *committed = &repl_log.changes[oldest % REPL_LOG_SLOTS]->committed;
+            lag_ms = (now.tv_sec - committed->tv_sec) * 1000 + (now.tv_nsec - committed->tv_nsec) / 1000000;
+        }
+        len += snprintf(text + len, size - len,
+                        "replica_%d: standby=%s:%d state=%s lag_changes=%llu lag_ms=%llu "
+                        "sent=%llu acked=%llu resyncs=%lu\r\n",
+                        i, replica->host, replica->port, replica_state_names[atomic_load(&replica->state)],
+                        (unsigned long long)(last - acked), (unsigned long long)lag_ms,
+                        (unsigned long long)atomic_load(&replica->sent_seq),
+                        (unsigned long long)atomic_load(&replica->acked_seq),
+                        atomic_load(&replica->resyncs));
+    }
+    pthread_mutex_unlock(&repl_log.lock);
+    return len < size ? len : size - 1;
+}
+
+void *replica_thread(void *arg) {
+    // Keeps one standby connected, reconnecting whenever the session ends
+    Replica *replica = arg;
+    while (1) {
+        int fd = replica_connect(replica);
+        if (fd >= 0) {
+            log_message(LOG_INFO, 0, "Connected to standby %s:%d", replica->host, replica->port);
+            replica_session(replica, fd);
+            close(fd);
+            atomic_store(&replica->state, REPLICA_CONNECTING);
+            log_message(LOG_WARN, 0, "Lost standby %s:%d", replica->host, replica->port);
+        }
+        sleep(REPL_RETRY_SECONDS);
+    }
+    return NULL;
+}
+
+int replica_connect(Replica *replica) {
+    // Returns a socket connected to the standby, or -1
+    char port[16];
+    snprintf(port, sizeof(port), "%d", replica->port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addrs;
+    if (getaddrinfo(replica->host, port, &hints, &addrs) != 0) {
+        log_message(LOG_DEBUG, 0, "Cannot resolve standby %s", replica->host);
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *addr = addrs; addr && fd < 0; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) return -1;
+
+    // Batches are written whole, so there is nothing for Nagle to coalesce;
+    // a standby that stops reading is dropped rather than waited on forever
+    int one = 1;
+    struct timeval timeout = {REPL_SEND_TIMEOUT, 0};
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+int replica_session(Replica *replica, int fd) {
+    // Catches the standby up from the mailboxes, then streams the log to it
+    // until either side fails. Returns -1 when the session ends.
+    if (repl_send(fd, REPL_HELLO, 0, "", "", "", REPL_VERSION, repl_secret, strlen(repl_secret)) < 0) return -1;
+
+    // The standby answers with the next ID of each of its mailboxes
+    ReplState *states = NULL;
+    int count = 0;
+    int capacity = 0;
+    ReplHeader header;
+    while (1) {
+        if (read_all(fd, (char *)&header, sizeof(header)) != sizeof(header) ||
+            header.magic != REPL_MAGIC || header.type != REPL_STATE) {
+            free(states);
+            return -1;
+        }
+        if (header.email[0] == '\0') break;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ReplState *grown = realloc(states, capacity * sizeof(ReplState));
+            if (!grown) {
+                free(states);
+                return -1;
+            }
+            states = grown;
+        }
+        snprintf(states[count].email, sizeof(states[count].email), "%.*s",
+                 (int)sizeof(header.email) - 1, header.email);
+        states[count].next_id = header.id;
+        count++;
+    }
+    if (count > 0) qsort(states, count, sizeof(ReplState), compare_repl_states);
+
+    // Changes from here on are streamed; the mailboxes hold all earlier ones
+    pthread_mutex_lock(&repl_log.lock);
+    uint64_t seq = repl_log.next_seq;
+    pthread_mutex_unlock(&repl_log.lock);
+
+    replica->fd = fd;
+    atomic_store(&replica->acked_seq, 0);
+    atomic_store(&replica->connected, 1);
+    pthread_t ack_thread;
+    if (thread_create(&ack_thread, THREAD_STACK_SIZE, replica_ack_thread, replica) != 0) {
+        log_message(LOG_ERROR, 0, "Error creating replication thread: %s", strerror(errno));
+        free(states);
+        return -1;
+    }
+
+    // Corked, the many small catch-up records leave in full packets. The
+    // standby is streaming once it acknowledges the end of the catch-up.
+    // Each shared body goes over once per session, however many emails use it.
+    int one = 1;
+    int zero = 0;
+    BlobSet sent = { NULL, 0, 0 };
+    atomic_store(&replica->state, REPLICA_CATCHING_UP);
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+    int status = replica_catch_up(fd, seq - 1, states, count, &sent);
+    if (status == 0) status = repl_send(fd, REPL_CAUGHT_UP, seq - 1, "", "", "", 0, NULL, 0);
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+    atomic_store(&replica->sent_seq, seq - 1);
+    free(states);
+
+    if (status == 0) {
+        status = replica_stream(replica, fd, seq, &sent);
+    }
+    free(sent.hashes);
+
+    shutdown(fd, SHUT_RDWR);
+    pthread_join(ack_thread, NULL);
+    return -1;
+}
+
+void *replica_ack_thread(void *arg) {
+    // Reads the standby's acknowledgements until the connection fails
+    Replica *replica = arg;
+    ReplHeader header;
+    while (read_all(replica->fd, (char *)&header, sizeof(header)) == sizeof(header) &&
+           header.magic == REPL_MAGIC && header.type == REPL_ACK) {
+        atomic_store(&replica->acked_seq, header.seq);
+        if (header.id == 1) {
+            log_message(LOG_INFO, 0, "Standby %s:%d caught up to change %llu",
+                        replica->host, replica->port, (unsigned long long)header.seq);
+            atomic_store(&replica->state, REPLICA_STREAMING);
+        }
+    }
+
+    // Wakes the sender, whether it is waiting for changes or blocked writing
+    atomic_store(&replica->connected, 0);
+    shutdown(replica->fd, SHUT_RDWR);
+    pthread_mutex_lock(&repl_log.lock);
+    pthread_cond_broadcast(&repl_log.ready);
+    pthread_mutex_unlock(&repl_log.lock);
+    return NULL;
+}
+
+int replica_catch_up(int fd, uint64_t seq, ReplState *states, int state_count, BlobSet *sent) {
+    // Sends each mailbox's IDs and the emails the standby does not have yet
+    char (*names)[256] = NULL;
+    int count = mailbox_names(&names);
+    if (count < 0) return -1;
+
+    int status = 0;
+    for (int i = 0; i < count && status == 0; i++) {
+        ReplState key;
+        memcpy(key.email, names[i], sizeof(key.email));
+        ReplState *state = state_count > 0
+            ? bsearch(&key, states, state_count, sizeof(ReplState), compare_repl_states)
+            : NULL;
+        status = replica_send_mailbox(fd, names[i], seq, state ? state->next_id : 1, sent);
+    }
+    free(names);
+    return status;
+}
+
+int replica_send_mailbox(int fd, const char *email, uint64_t seq, int standby_next_id, BlobSet *sent) {
+    // The IDs and the entries to send are taken under the read lock; the
+    // bodies are read after it is released, from the mailbox file opened
+    // under it, which compaction replaces rather than rewrites
+    MailboxIndex index;
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    int status = mailbox_index_open_shared(email, &index, lock);
+    if (status != 0) {
+        pthread_rwlock_unlock(lock);
+        return status > 0 ? 0 : -1;
+    }
+
+    char mailbox_path[512];
+    mailbox_path_for(email, mailbox_ext(), mailbox_path, sizeof(mailbox_path));
+    int mailbox_fd = open(mailbox_path, O_RDONLY);
+    int next_id = index.header.next_id;
+    int count = index.header.count;
+    int32_t *ids = malloc((count ? count : 1) * sizeof(int32_t));
+    int live = 0;
+    IndexEntry *missing = NULL;
+    int missing_count = 0;
+    status = ids && mailbox_fd >= 0 ? 0 : -1;
+    for (int slot = 0; status == 0 && slot < count;) {
+        IndexEntry entries[LIST_BATCH];
+        int n = mailbox_index_read(&index, slot, entries, LIST_BATCH);
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+        for (int i = 0; i < n && status == 0; i++) {
+            if (mailbox_index_hidden(&entries[i], index.header.deleted)) continue;
+            ids[live++] = entries[i].id;
+            if (entries[i].id < standby_next_id) continue;
+            if (!missing) missing = malloc((count - slot - i) * sizeof(IndexEntry));
+            if (!missing) status = -1;
+            else missing[missing_count++] = entries[i];
+        }
+        slot += n;
+    }
+    mailbox_index_close(&index);
+    pthread_rwlock_unlock(lock);
+
+    if (status == 0) {
+        status = repl_send(fd, REPL_SYNC, seq, email, "", "", next_id, ids, live * sizeof(int32_t));
+    }
+    for (int i = 0; i < missing_count && status == 0; i++) {
+        IndexEntry *entry = &missing[i];
+        if (entry->blob[0]) {
+            // The standby stores the shared body once and refers to it
+            int gone = replica_send_blob(fd, seq, entry->blob, sent);
+            if (gone > 0) {
+                log_message(LOG_ERROR, 0, "Cannot read email %d of %s for standby", entry->id, email);
+            } else if (gone == 0) {
+                status = repl_send(fd, REPL_APPEND, seq, email, entry->sender, entry->blob, entry->id, NULL, 0);
+            } else {
+                status = -1;
+            }
+            continue;
+        }
+
+        char *body = email_read_body(mailbox_fd, entry);
+        if (!body) {
+            log_message(LOG_ERROR, 0, "Cannot read email %d of %s for standby", entry->id, email);
+            continue;
+        }
+
+        // Storing adds the final newline again
+        status = repl_send(fd, REPL_APPEND, seq, email, entry->sender, "", entry->id, body, entry->length - 1);
+        free(body);
+    }
+
+    if (mailbox_fd >= 0) close(mailbox_fd);
+    free(ids);
+    free(missing);
+    return status;
+}
+
+int replica_stream(Replica *replica, int fd, uint64_t seq, BlobSet *sent) {
+    // Sends the log from change seq on in batches, without waiting for
+    // acknowledgements. Returns -1 when the connection fails or the standby
+    // falls so far behind that the changes it needs are gone.
+    size_t capacity = REPL_BATCH_BYTES;
+    char *batch = malloc(capacity);
+    if (!batch) return -1;
+
+    int status = 0;
+    while (status == 0 && atomic_load(&replica->connected)) {
+        pthread_mutex_lock(&repl_log.lock);
+        while (seq == repl_log.next_seq && atomic_load(&replica->connected)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&repl_log.ready, &repl_log.lock, &deadline);
+        }
+        if (seq < repl_log.first_seq) {
+            pthread_mutex_unlock(&repl_log.lock);
+            log_message(LOG_WARN, 0, "Standby %s:%d fell behind the replication log",
+                        replica->host, replica->port);
+            atomic_fetch_add(&replica->resyncs, 1);
+            status = -1;
+            break;
+        }
+
+        // Copy a batch out so the standby is written to without the lock
+        size_t used = 0;
+        while (seq < repl_log.next_seq) {
+            ReplChange *change = repl_log.changes[seq % REPL_LOG_SLOTS];
+            size_t size = sizeof(ReplHeader) + change->header.length;
+            if (used + size > capacity) {
+                if (used > 0) break;
+                char *grown = realloc(batch, size);
+                if (!grown) {
+                    status = -1;
+                    break;
+                }
+                batch = grown;
+                capacity = size;
+            }
+            memcpy(batch + used, &change->header, sizeof(ReplHeader));
+            memcpy(batch + used + sizeof(ReplHeader), change->body, change->header.length);
+            used += size;
+            seq++;
+        }
+        pthread_mutex_unlock(&repl_log.lock);
+
+        // A shared body the standby has not been sent yet is read from its
+        // file and goes just ahead of the first email naming it. An email
+        // whose body is already gone was deleted, and its deletion follows.
+        size_t start = 0;
+        for (size_t pos = 0; status == 0 && pos < used;) {
+            ReplHeader header;
+            memcpy(&header, batch + pos, sizeof(header));
+            size_t size = sizeof(ReplHeader) + header.length;
+            if (header.type == REPL_APPEND && header.blob[0]) {
+                int gone = write_all(fd, batch + start, pos - start) < 0
+                    ? -1 : replica_send_blob(fd, header.seq - 1, header.blob, sent);
+                if (gone < 0) status = -1;
+                start = gone > 0 ? pos + size : pos;
+            }
+            pos += size;
+        }
+        if (status == 0 && write_all(fd, batch + start, used - start) < 0) {
+            status = -1;
+        }
+        if (status == 0) {
+            atomic_store(&replica->sent_seq, seq - 1);
+        }
+    }
+    free(batch);
+    return -1;
+}
+
+int replica_send_blob(int fd, uint64_t seq, const char *blob, BlobSet *sent) {
+    // Sends a shared body unless it already went this session. Returns 0,
+    // 1 if its file is gone, or -1 on error.
+    int added = blob_set_add(sent, blob);
+    if (added <= 0) return added;
+
+    char path[512];
+    blob_path_for(blob, path, sizeof(path));
+    int blob_fd = open(path, O_RDONLY);
+    if (blob_fd < 0) {
+        if (errno == ENOENT) return 1;
+        log_message(LOG_ERROR, 0, "Error opening blob for standby: %s", strerror(errno));
+        return -1;
+    }
+
+    // The stored trailing newline is added back by the standby
+    struct stat st;
+    char *body = NULL;
+    int status = -1;
+    if (fstat(blob_fd, &st) == 0 && st.st_size > 0 && (body = malloc(st.st_size)) != NULL &&
+        pread_all(blob_fd, body, st.st_size, 0) == st.st_size) {
+        status = repl_send(fd, REPL_BLOB, seq, "", "", blob, 0, body, st.st_size - 1);
+    } else {
+        log_message(LOG_ERROR, 0, "Error reading blob for standby: %s", strerror(errno));
+    }
+    free(body);
+    close(blob_fd);
+    return status;
+}
+
+int blob_set_add(BlobSet *set, const char *name) {
+    // Returns 1 if name was added, 0 if it was already there, -1 on error
+    if (set->count * 2 >= set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+        uint64_t *hashes = calloc(capacity, sizeof(uint64_t));
+        if (!hashes) return -1;
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->hashes[i] == 0) continue;
+            size_t slot = set->hashes[i] & (capacity - 1);
+            while (hashes[slot]) slot = (slot + 1) & (capacity - 1);
+            hashes[slot] = set->hashes[i];
+        }
+        free(set->hashes);
+        set->hashes = hashes;
+        set->capacity = capacity;
+    }
+
+    uint64_t hash = search_hash(NULL, name, strlen(name)) | 1;
+    size_t slot = hash & (set->capacity - 1);
+    while (set->hashes[slot]) {
+        if (set->hashes[slot] == hash) return 0;
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    set->hashes[slot] = hash;
+    set->count++;
+    return 1;
+}
+
+int compare_repl_states(const void *a, const void *b) {
+    return strcmp(((const ReplState *)a)->email, ((const ReplState *)b)->email);
+}
+
+void *standby_thread(void *arg) {
+    // Takes the stream of one primary at a time
+    (void)arg;
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(standby_socket, (struct sockaddr *)&addr, &addr_len);
+        if (fd < 0) {
+            if (errno != EINTR) log_message(LOG_ERROR, 0, "Error accepting primary: %s", strerror(errno));
+            continue;
+        }
+
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+        log_message(LOG_INFO, 0, "Primary connected: %s", host);
+        standby_session(fd);
+        close(fd);
+        log_message(LOG_WARN, 0, "Primary disconnected: %s", host);
+    }
+    return NULL;
+}
+
+int standby_session(int fd) {
+    // Reports this standby's mailboxes, then applies changes as they arrive.
+    // Acknowledgements go out whenever no more changes are waiting, so a
+    // burst costs one.
+    ReplHeader header;
+    char secret[REPL_MAX_SECRET];
+    if (read_all(fd, (char *)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != REPL_MAGIC || header.type != REPL_HELLO || header.id != REPL_VERSION ||
+        header.length > REPL_MAX_SECRET || read_all(fd, secret, header.length) != (ssize_t)header.length) {
+        log_message(LOG_ERROR, 0, "Unsupported replication stream");
+        return -1;
+    }
+    if (!standby_secret_matches(secret, header.length)) {
+        log_message(LOG_ERROR, 0, "Primary refused: replication secret does not match");
+        return -1;
+    }
+    if (standby_send_state(fd) != 0) return -1;
+
+    // Bodies are staged in a spool file so the normal append path stores them
+    char spool_path[] = SPOOL_DIR "/replXXXXXX";
+    int spool_fd = mkstemp(spool_path);
+    if (spool_fd < 0) {
+        log_message(LOG_ERROR, 0, "Error creating spool file: %s", strerror(errno));
+        return -1;
+    }
+    unlink(spool_path);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint64_t acked = 0;
+    int status = 0;
+    while (status == 0 && read_all(fd, (char *)&header, sizeof(header)) == sizeof(header)) {
+        if (header.magic != REPL_MAGIC) {
+            status = -1;
+            break;
+        }
+        header.email[sizeof(header.email) - 1] = '\0';
+        header.sender[sizeof(header.sender) - 1] = '\0';
+        header.blob[sizeof(header.blob) - 1] = '\0';
+        status = standby_apply(fd, &header, spool_fd);
+        if (status != 0) break;
+
+        if (header.seq > atomic_load(&standby_last_seq)) {
+            atomic_store(&standby_last_seq, header.seq);
+        }
+        char byte;
+        if (header.type == REPL_CAUGHT_UP) {
+            acked = header.seq;
+            status = repl_send(fd, REPL_ACK, acked, "", "", "", 1, NULL, 0);
+        } else if (header.seq > acked && recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            acked = header.seq;
+            status = repl_send(fd, REPL_ACK, acked, "", "", "", 0, NULL, 0);
+        }
+    }
+    close(spool_fd);
+    return status;
+}
+
+int standby_secret_matches(const char *secret, size_t len) {
+    // Compares every byte, so the time taken does not show how much matched
+    size_t expected = strlen(repl_secret);
+    unsigned char diff = len != expected;
+    for (size_t i = 0; i < len && i < expected; i++) {
+        diff |= secret[i] ^ repl_secret[i];
+    }
+    return diff == 0;
+}
+
+int standby_send_state(int fd) {
+    // Tells the primary the next ID of every mailbox here, so it only sends
+    // the emails this standby lacks
+    char (*names)[256] = NULL;
+    int count = mailbox_names(&names);
+    if (count < 0) return -1;
+
+    int status = 0;
+    for (int i = 0; i < count && status == 0; i++) {
+        MailboxIndex index;
+        pthread_rwlock_t *lock = mailbox_lock_for(names[i]);
+        int next_id = 1;
+        if (mailbox_index_open_shared(names[i], &index, lock) == 0) {
+            next_id = index.header.next_id;
+            mailbox_index_close(&index);
+        }
+        pthread_rwlock_unlock(lock);
+        status = repl_send(fd, REPL_STATE, 0, names[i], "", "", next_id, NULL, 0);
+    }
+    free(names);
+    if (status != 0) return -1;
+    return repl_send(fd, REPL_STATE, 0, "", "", "", 0, NULL, 0);
+}
+
+int standby_apply(int fd, const ReplHeader *header, int spool_fd) {
+    // Applies one change whose length bytes are still to be read from fd.
+    // Returns 0, or -1 to end the session.
+    if (header->type == REPL_APPEND || header->type == REPL_BLOB) {
+        char *body = malloc(header->length ? header->length : 1);
+        if (!body || read_all(fd, body, header->length) != header->length ||
+            ftruncate(spool_fd, 0) < 0 ||
+            pwrite(spool_fd, body, header->length, 0) != (ssize_t)header->length) {
+            free(body);
+            return -1;
+        }
+        free(body);
+    }
+
+    if (header->type == REPL_BLOB) {
+        // Kept under the primary's name, which the emails sharing it refer to
+        if (!blob_name_valid(header->blob)) {
+            log_message(LOG_ERROR, 0, "Invalid shared body name from primary");
+            return -1;
+        }
+        return blob_restore(header->blob, spool_fd, header->length);
+    }
+
+    if (header->type == REPL_APPEND) {
+        // A shared body is appended from its file, as the primary did
+        const char *blob = header->blob[0] ? header->blob : NULL;
+        int body_fd = spool_fd;
+        size_t content_len = header->length;
+        if (blob) {
+            char path[512];
+            struct stat st;
+            if (!blob_name_valid(blob)) {
+                log_message(LOG_ERROR, 0, "Invalid shared body name from primary");
+                return -1;
+            }
+            blob_path_for(blob, path, sizeof(path));
+            body_fd = open(path, O_RDONLY);
+            if (body_fd < 0 || fstat(body_fd, &st) < 0 || st.st_size < 1) {
+                log_message(LOG_ERROR, 0, "Shared body %s missing for email %d of %s",
+                            blob, header->id, header->email);
+                if (body_fd >= 0) close(body_fd);
+                return -1;
+            }
+            content_len = st.st_size - 1;
+        }
+
+        // Emails this standby already has are skipped
+        pthread_rwlock_t *lock = mailbox_lock_for(header->email);
+        mailbox_write_lock(lock);
+        int id = mailbox_append_locked(header->email, header->sender, body_fd, content_len, blob,
+                                       header->id, NULL);
+        pthread_rwlock_unlock(lock);
+        if (body_fd != spool_fd) close(body_fd);
+        if (id < 0) return -1;
+        if (id > 0) atomic_fetch_add(&standby_applied, 1);
+        return 0;
+    }
+
+    if (header->type == REPL_DELETE) {
+        int status = mailbox_delete(header->email, header->id);
+        if (status == 0) atomic_fetch_add(&standby_applied, 1);
+        return status < 0 ? -1 : 0;
+    }
+
+    if (header->type == REPL_SYNC) {
+        int32_t *ids = malloc(header->length ? header->length : 1);
+        if (!ids || read_all(fd, (char *)ids, header->length) != header->length) {
+            free(ids);
+            return -1;
+        }
+        int status = standby_sync(header->email, header->id, ids, header->length / sizeof(int32_t));
+        free(ids);
+        return status;
+    }
+
+    if (header->type == REPL_CAUGHT_UP) return 0;
+
+    log_message(LOG_ERROR, 0, "Unknown replication record %u", header->type);
+    return -1;
+}
+
+int standby_sync(const char *email, int next_id, const int32_t *ids, int count) {
+    // Deletes the emails below next_id the primary no longer has, which were
+    // deleted there while this standby was away. Both lists are in index
+    // order, which is ascending.
+    MailboxIndex index;
+    pthread_rwlock_t *lock = mailbox_lock_for(email);
+    int status = mailbox_index_open_shared(email, &index, lock);
+    if (status != 0) {
+        pthread_rwlock_unlock(lock);
+        return status > 0 ? 0 : -1;
+    }
+
+    int *stale = NULL;
+    int stale_count = 0;
+    int capacity = 0;
+    int j = 0;
+    for (int slot = 0; status == 0 && slot < index.header.count;) {
+        IndexEntry entries[LIST_BATCH];
+        int n = mailbox_index_read(&index, slot, entries, LIST_BATCH);
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+        for (int i = 0; i < n && entries[i].id < next_id; i++) {
+            if (mailbox_index_hidden(&entries[i], index.header.deleted)) continue;
+            while (j < count && ids[j] < entries[i].id) j++;
+            if (j < count && ids[j] == entries[i].id) continue;
+            if (stale_count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                int *grown = realloc(stale, capacity * sizeof(int));
+                if (!grown) {
+                    status = -1;
+                    break;
+                }
+                stale = grown;
+            }
+            stale[stale_count++] = entries[i].id;
+        }
+        slot += n;
+    }
+    mailbox_index_close(&index);
+    pthread_rwlock_unlock(lock);
+
+    for (int i = 0; i < stale_count && status == 0; i++) {
+        if (mailbox_delete(email, stale[i]) < 0) status = -1;
+    }
+    if (stale_count > 0) {
+        log_message(LOG_INFO, 0, "Deleted %d emails of %s removed on the primary", stale_count, email);
+    }
+    free(stale);
+    return status;
+}
+
+int mailbox_names(char (**names)[256]) {
+    // Lists the mailboxes of the current storage engine. Returns how many,
+    // with the names in *names for the caller to free, or -1.
+    DIR *dir = opendir(MAILBOX_DIR);
+    if (!dir) {
+        log_message(LOG_ERROR, 0, "Error opening mailbox directory: %s", strerror(errno));
+        return -1;
+    }
+
+    const char *ext = mailbox_ext();
+    size_t ext_len = strlen(ext);
+    char (*list)[256] = NULL;
+    int count = 0;
+    int capacity = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len <= ext_len || len - ext_len >= 256 || strcmp(ent->d_name + len - ext_len, ext) != 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char (*grown)[256] = realloc(list, capacity * sizeof(*list));
+            if (!grown) {
+                free(list);
+                closedir(dir);
+                return -1;
+            }
+            list = grown;
+        }
+        snprintf(list[count++], 256, "%.*s", (int)(len - ext_len), ent->d_name);
+    }
+    closedir(dir);
+    *names = list;
+    return count;
+}
+
+int journal_open() {
+    journal.fd = open(JOURNAL_PATH, O_RDWR | O_CREAT, 0600);
+    if (journal.fd < 0) {
+        log_message(LOG_ERROR, 0, "Error opening journal: %s", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&journal.lock, NULL);
+    pthread_cond_init(&journal.appended, NULL);
+    pthread_cond_init(&journal.durable, NULL);
+
+    // Make sure the journal itself survives a crash before relying on it
+    int dir_fd = open(MAILBOX_DIR, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    if (journal_recover() != 0) {
+        return -1;
+    }
+
+    pthread_t thread_id;
+    if (thread_create(&thread_id, THREAD_STACK_SIZE, journal_commit_thread, NULL) != 0) {
+        log_message(LOG_ERROR, 0, "Error creating journal thread: %s", strerror(errno));
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
+
+int journal_recover() {
+    // Re-applies every complete record whose email is missing from its
+    // mailbox (lost with the page cache), then starts a fresh journal
+    struct stat st;
+    if (fstat(journal.fd, &st) < 0) {
+        log_message(LOG_ERROR, 0, "Error reading journal size: %s", strerror(errno));
+        return -1;
+    }
+
+    off_t offset = 0;
+    int replayed = 0;
+    while ((uint64_t)offset + sizeof(JournalRecord) <= (uint64_t)st.st_size) {
+        JournalRecord record;
+        if (pread_all(journal.fd, (char *)&record, sizeof(record), offset) != sizeof(record) ||
+            record.magic != JOURNAL_MAGIC || record.target_count == 0 ||
+            record.target_count > MAX_RECIPIENTS) {
+            break;
+        }
+
+        size_t targets_len = record.target_count * sizeof(JournalTarget);
+        off_t content_offset = offset + sizeof(record) + targets_len;
+        off_t end = content_offset + record.content_len + sizeof(JournalTrailer);
+        if (end > st.st_size) break;
+
+        JournalTarget *targets = malloc(targets_len);
+        if (!targets || pread_all(journal.fd, (char *)targets, targets_len,
+                                  offset + sizeof(record)) != (ssize_t)targets_len) {
+            free(targets);
+            break;
+        }
+
+        // A record torn by the crash was never acknowledged, so it ends the replay
+        uint32_t checksum = fnv1a(2166136261u, &record, sizeof(record));
+        checksum = fnv1a(checksum, targets, targets_len);
+        char buffer[BUFFER_SIZE];
+        uint64_t done = 0;
+        while (done < record.content_len) {
+            size_t chunk = record.content_len - done < sizeof(buffer) ? record.content_len - done : sizeof(buffer);
+            ssize_t n = pread_all(journal.fd, buffer, chunk, content_offset + done);
+            if (n != (ssize_t)chunk) break;
+            checksum = fnv1a(checksum, buffer, n);
+            done += n;
+        }
+
+        JournalTrailer trailer;
+        if (done != record.content_len ||
+            pread_all(journal.fd, (char *)&trailer, sizeof(trailer), end - sizeof(trailer)) != sizeof(trailer) ||
+            trailer.magic != JOURNAL_MAGIC || trailer.checksum != checksum) {
+            free(targets);
+            break;
+        }
+
+        int status = journal_replay_record(content_offset, &record, targets);
+        free(targets);
+        if (status < 0) return -1;
+        replayed += status;
+        offset = end;
+    }
+
+    if (offset < st.st_size) {
+        log_message(LOG_WARN, 0, "Discarded %ld bytes of incomplete journal", (long)(st.st_size - offset));
+    }
+    if (replayed > 0) {
+        log_message(LOG_INFO, 0, "Recovered %d emails from the journal", replayed);
+    }
+
+    // Everything the journal described is now in the mailboxes; make that
+    // durable before forgetting the journal
+    if (syncfs(journal.fd) < 0 || ftruncate(journal.fd, 0) < 0 || fsync(journal.fd) < 0) {
+        log_message(LOG_ERROR, 0, "Error resetting journal: %s", strerror(errno));
+        return -1;
+    }
+    journal.size = 0;
+    return 0;
+}
+
+int journal_replay_record(off_t offset, const JournalRecord *record, const JournalTarget *targets) {
+    // Returns the number of emails re-appended, or -1 on error. The body is
+    // staged in a spool file so the normal delivery path can be reused.
+    char spool_path[] = SPOOL_DIR "/replayXXXXXX";
+    int spool_fd = mkstemp(spool_path);
+    if (spool_fd < 0) {
+        log_message(LOG_ERROR, 0, "Error creating spool file: %s", strerror(errno));
+        return -1;
+    }
+    unlink(spool_path);
+
+    if (copy_range(journal.fd, offset, spool_fd, 0, record->content_len) < 0) {
+        log_message(LOG_ERROR, 0, "Error reading journal: %s", strerror(errno));
+        close(spool_fd);
+        return -1;
+    }
+
+    // A shared body whose file did not survive is rewritten under the same name
+    const char *blob = record->blob[0] ? record->blob : NULL;
+    if (blob && blob_restore(blob, spool_fd, record->content_len) != 0) {
+        close(spool_fd);
+        return -1;
+    }
+
+    int replayed = 0;
+    for (uint32_t i = 0; i < record->target_count; i++) {
+        if (targets[i].id <= 0) continue;
+
+        MailboxIndex index;
+        if (mailbox_index_open(targets[i].recipient, &index, INDEX_CREATE | INDEX_REPAIR) != 0) {
+            close(spool_fd);
+            return -1;
+        }
+        int present = index.header.next_id > targets[i].id;
+        mailbox_index_close(&index);
+        if (present) continue;
+
+        int id = mailbox_append_locked(targets[i].recipient, record->sender, spool_fd,
+                                       record->content_len, blob, 0, NULL);
+        if (id < 0) {
+            close(spool_fd);
+            return -1;
+        }
+        log_message(LOG_INFO, 0, "Recovered email %d for %s as ID %d", targets[i].id, targets[i].recipient, id);
+        replayed++;
+    }
+
+    close(spool_fd);
+    return replayed;
+}
+
+uint64_t journal_append(ClientState *state, const int *ids, const char *blob,
+                        int spool_fd, size_t content_len) {
+    // Writes the journal record for a stored message and returns its sequence
+    // number, or 0 if it could not be written
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = JOURNAL_MAGIC;
+    record.target_count = state->recipient_count;
+    record.content_len = content_len;
+    snprintf(record.sender, sizeof(record.sender), "%s", state->sender);
+    snprintf(record.blob, sizeof(record.blob), "%s", blob);
+
+    size_t targets_len = state->recipient_count * sizeof(JournalTarget);
+    JournalTarget *targets = calloc(state->recipient_count, sizeof(JournalTarget));
+    if (!targets) {
+        log_message(LOG_ERROR, 0, "Error allocating journal record: %s", strerror(errno));
+        return 0;
+    }
+    for (int i = 0; i < state->recipient_count; i++) {
+        snprintf(targets[i].recipient, sizeof(targets[i].recipient), "%s", state->recipients[i]);
+        targets[i].id = ids[i] > 0 ? ids[i] : 0;
+    }
+
+    JournalTrailer trailer;
+    trailer.magic = JOURNAL_MAGIC;
+    trailer.checksum = fnv1a(2166136261u, &record, sizeof(record));
+    trailer.checksum = fnv1a(trailer.checksum, targets, targets_len);
+
+    pthread_mutex_lock(&journal.lock);
+    off_t offset = journal.size;
+    int ok = pwrite(journal.fd, &record, sizeof(record), offset) == sizeof(record) &&
+             pwrite(journal.fd, targets, targets_len, offset + sizeof(record)) == (ssize_t)targets_len;
+    offset += sizeof(record) + targets_len;
+
+    // The body is copied through a buffer so the checksum can cover it
+    char buffer[BUFFER_SIZE];
+    size_t done = 0;
+    while (ok && done < content_len) {
+        size_t chunk = content_len - done < sizeof(buffer) ? content_len - done : sizeof(buffer);
+        ssize_t n = pread_all(spool_fd, buffer, chunk, done);
+        if (n <= 0 || pwrite(journal.fd, buffer, n, offset + done) != n) {
+            ok = 0;
+            break;
+        }
+        trailer.checksum = fnv1a(trailer.checksum, buffer, n);
+        done += n;
+    }
+    offset += content_len;
+    ok = ok && pwrite(journal.fd, &trailer, sizeof(trailer), offset) == sizeof(trailer);
+
+    uint64_t seq = 0;
+    if (!ok) {
+        log_message(LOG_ERROR, 0, "Error writing journal: %s", strerror(errno));
+        if (ftruncate(journal.fd, journal.size) < 0) {
+            log_message(LOG_ERROR, 0, "Error truncating journal: %s", strerror(errno));
+        }
+    } else {
+        journal.size = offset + sizeof(trailer);
+        seq = ++journal.appended_seq;
+        atomic_fetch_add(&journal_records, 1);
+        pthread_cond_signal(&journal.appended);
+    }
+    pthread_mutex_unlock(&journal.lock);
+
+    free(targets);
+    return seq;
+}
+
+void journal_wait(uint64_t seq) {
+    pthread_mutex_lock(&journal.lock);
+    while (journal.durable_seq < seq) {
+        pthread_cond_wait(&journal.durable, &journal.lock);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+void *journal_commit_thread(void *arg) {
+    // Group commit: one fdatasync() makes every record appended so far durable
+    (void)arg;
+    pthread_mutex_lock(&journal.lock);
+    while (1) {
+        while (journal.durable_seq == journal.appended_seq) {
+            pthread_cond_wait(&journal.appended, &journal.lock);
+        }
+
+        // Give concurrent sessions a moment to join the batch
+        if (commit_delay_us > 0) {
+            pthread_mutex_unlock(&journal.lock);
+            usleep(commit_delay_us);
+            pthread_mutex_lock(&journal.lock);
+        }
+
+        // Records appended while syncing are left for the next batch
+        uint64_t batch = journal.appended_seq;
+        pthread_mutex_unlock(&journal.lock);
+        int status = fdatasync(journal.fd);
+        pthread_mutex_lock(&journal.lock);
+
+        // After a failed sync the state of the file is unknown, so nothing
+        // more may be acknowledged
+        if (status < 0) {
+            log_message(LOG_ERROR, 0, "Error syncing journal: %s", strerror(errno));
+            exit(1);
+        }
+
+        journal.durable_seq = batch;
+        atomic_fetch_add(&journal_syncs, 1);
+        pthread_cond_broadcast(&journal.durable);
+        for (int i = 0; i < journal.event_fd_count; i++) {
+            uint64_t one = 1;
+            if (write(journal.event_fds[i], &one, sizeof(one)) < 0) {
+                log_message(LOG_ERROR, 0, "Error signalling event loop: %s", strerror(errno));
+            }
+        }
+
+        // Checkpoint: once the mailboxes themselves are synced, the records
+        // describing them are no longer needed. Holding the lock keeps new
+        // records out, and every record was written after its mailbox append.
+        if (journal.size >= JOURNAL_CHECKPOINT_SIZE && journal.durable_seq == journal.appended_seq) {
+            if (syncfs(journal.fd) < 0 || ftruncate(journal.fd, 0) < 0 || fdatasync(journal.fd) < 0) {
+                log_message(LOG_ERROR, 0, "Error checkpointing journal: %s", strerror(errno));
+                exit(1);
+            }
+            journal.size = 0;
+        }
+    }
+    return NULL;
+}
+
+void log_init() {
+    // Rings of exited threads are handed back to the drainer
+    pthread_key_create(&log_ring_key, log_release_ring);
+
+    // Whatever is still buffered goes out on exit (a shutdown calls exit())
+    atexit(log_drain);
+
+    // SIGUSR1 toggles verbose per-command logging at runtime
+    signal(SIGUSR1, log_toggle_verbose);
+
+    pthread_t thread_id;
+    if (thread_create(&thread_id, THREAD_STACK_SIZE, log_thread, NULL) != 0) {
+        perror("Error creating log thread");
+        exit(1);
+    }
+    pthread_detach(thread_id);
+}
+
+void log_toggle_verbose(int sig) {
+    (void)sig;
+    log_level = log_level == LOG_DEBUG ? LOG_INFO : LOG_DEBUG;
+}
+
+int log_enabled(int level) {
+    return level <= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+void log_message(int level, uint64_t conn_id, const char *fmt, ...) {
+    if (!log_enabled(level)) return;
+
+    va_list args;
+    va_start(args, fmt);
+    log_push(level, conn_id, NULL, 0, fmt, args);
+    va_end(args);
+}
+
+void log_command(uint64_t conn_id, const char *command, uint32_t latency_us, const char *args) {
+    log_push_args(LOG_DEBUG, conn_id, command, latency_us, "%s", args);
+}
+
+void log_push_args(int level, uint64_t conn_id, const char *command, uint32_t latency_us,
+                   const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log_push(level, conn_id, command, latency_us, fmt, args);
+    va_end(args);
+}
+
+void log_push(int level, uint64_t conn_id, const char *command, uint32_t latency_us,
+              const char *fmt, va_list args) {
+    LogRing *ring = log_thread_ring();
+    if (!ring) return;
+
+    // Only this thread advances head, so a relaxed read of it is enough
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SIZE) {
+        // Never block the request path on a slow log destination
+        atomic_fetch_add(&log_dropped, 1);
+        return;
+    }
+
+    LogRecord *record = &ring->records[head % LOG_RING_SIZE];
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->conn_id = conn_id;
+    record->latency_us = latency_us;
+    record->level = level;
+    snprintf(record->command, sizeof(record->command), "%s", command ? command : "");
+    vsnprintf(record->message, sizeof(record->message), fmt, args);
+
+    // Publish the record to the drainer
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+LogRing *log_thread_ring() {
+    // Rings are created on a thread's first log record
+    if (thread_log_ring) return thread_log_ring;
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) return NULL;
+
+    pthread_mutex_lock(&log_rings_lock);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_rings_lock);
+
+    pthread_setspecific(log_ring_key, ring);
+    thread_log_ring = ring;
+    return ring;
+}
+
+void log_release_ring(void *ring) {
+    atomic_store_explicit(&((LogRing *)ring)->orphaned, 1, memory_order_release);
+}
+
+void log_drain() {
+    // Formats every published record and writes them with as few calls as
+    // possible. The rings lock also makes this the only consumer.
+    static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+    char out[64 * 1024];
+    size_t out_len = 0;
+
+    pthread_mutex_lock(&log_rings_lock);
+    LogRing **link = &log_rings;
+    while (*link) {
+        LogRing *ring = *link;
+        int orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            LogRecord *record = &ring->records[tail % LOG_RING_SIZE];
+            if (out_len + LOG_MESSAGE_SIZE + 128 > sizeof(out)) {
+                write_all(STDOUT_FILENO, out, out_len);
+                out_len = 0;
+            }
+
+            struct tm tm;
+            gmtime_r(&record->time.tv_sec, &tm);
+            out_len += strftime(out + out_len, sizeof(out) - out_len, "%Y-%m-%dT%H:%M:%S", &tm);
+            out_len += snprintf(out + out_len, sizeof(out) - out_len, ".%06ldZ %s conn=%lu",
+                                record->time.tv_nsec / 1000, level_names[record->level],
+                                (unsigned long)record->conn_id);
+            if (record->command[0]) {
+                out_len += snprintf(out + out_len, sizeof(out) - out_len, " cmd=%s latency_us=%u",
+                                    record->command, record->latency_us);
+            }
+            out_len += snprintf(out + out_len, sizeof(out) - out_len, " msg=\"%s\"\n", record->message);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        // The owner has exited and everything it logged has been written
+        if (orphaned) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    unsigned long dropped = atomic_load(&log_dropped);
+    if (dropped != log_dropped_reported) {
+        out_len += snprintf(out + out_len, sizeof(out) - out_len,
+                            "WARN conn=0 msg=\"log rings full, %lu records dropped so far\"\n", dropped);
+        log_dropped_reported = dropped;
+    }
+    pthread_mutex_unlock(&log_rings_lock);
+
+    if (out_len > 0) {
+        write_all(STDOUT_FILENO, out, out_len);
+    }
+}
+
+void *log_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(LOG_FLUSH_INTERVAL_US);
+        log_drain();
+    }
+    return NULL;
+}
+
+ThreadMetrics *metrics_thread() {
+    // Each thread registers its own metrics on first use
+    if (current_metrics) return current_metrics;
+
+    ThreadMetrics *metrics = calloc(1, sizeof(ThreadMetrics));
+    if (!metrics) return NULL;
+
+    pthread_mutex_lock(&metrics_lock);
+    metrics->next = thread_metrics_list;
+    thread_metrics_list = metrics;
+    pthread_mutex_unlock(&metrics_lock);
+
+    pthread_setspecific(metrics_key, metrics);
+    current_metrics = metrics;
+    return metrics;
+}
+
+void metrics_release(void *arg) {
+    // Folds an exiting thread's metrics into the retired totals
+    ThreadMetrics *metrics = arg;
+    pthread_mutex_lock(&metrics_lock);
+    ThreadMetrics **link = &thread_metrics_list;
+    while (*link && *link != metrics) link = &(*link)->next;
+    if (*link) *link = metrics->next;
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        retired_metrics.counters[i] += metrics->counters[i];
+    }
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            retired_metrics.histograms[m][b] += metrics->histograms[m][b];
+        }
+        if (metrics->latency_max[m] > retired_metrics.latency_max[m]) {
+            retired_metrics.latency_max[m] = metrics->latency_max[m];
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    free(metrics);
+}
+
+void metrics_count(int counter, unsigned long n) {
+    // Only the owning thread writes, so a plain load and store is enough
+    ThreadMetrics *metrics = metrics_thread();
+    if (!metrics) return;
+    atomic_ulong *value = &metrics->counters[counter];
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void metrics_record(int metric, uint32_t latency_us) {
+    ThreadMetrics *metrics = metrics_thread();
+    if (!metrics) return;
+    atomic_ulong *bucket = &metrics->histograms[metric][histogram_bucket(latency_us)];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    if (latency_us > atomic_load_explicit(&metrics->latency_max[metric], memory_order_relaxed)) {
+        atomic_store_explicit(&metrics->latency_max[metric], latency_us, memory_order_relaxed);
+    }
+}
+
+int metric_for_command(const char *command) {
+    for (int i = 0; i < METRIC_OTHER; i++) {
+        if (strcmp(command, metric_names[i]) == 0) return i;
+    }
+    return METRIC_OTHER;
+}
+
+int histogram_bucket(uint32_t value) {
+    // Values below HISTOGRAM_SUB_BUCKETS get exact buckets; above that each
+    // power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+    int exponent = 31 - __builtin_clz(value);
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    int sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+unsigned long histogram_bucket_value(int bucket) {
+    // Highest value that falls into the bucket
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    unsigned long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+unsigned long histogram_percentile(const unsigned long *buckets, unsigned long count, double percentile,
+                                   unsigned long max) {
+    // A bucket is reported by its upper bound, which may lie above the
+    // largest value actually recorded
+    unsigned long rank = (unsigned long)(count * percentile / 100.0);
+    if (rank >= count) rank = count - 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            unsigned long value = histogram_bucket_value(b);
+            return value < max ? value : max;
+        }
+    }
+    return 0;
+}
+
+size_t metrics_format(char *text, size_t size) {
+    // Sums the per-thread metrics into one plain-text report ("name: value"
+    // lines), used by STATS and the metrics port
+    unsigned long counters[COUNTER_COUNT] = {0};
+    unsigned long (*histograms)[HISTOGRAM_BUCKETS] = calloc(METRIC_COUNT, sizeof(*histograms));
+    unsigned long latency_max[METRIC_COUNT] = {0};
+    if (!histograms) return 0;
+
+    pthread_mutex_lock(&metrics_lock);
+    for (ThreadMetrics *metrics = &retired_metrics; metrics;
+         metrics = metrics == &retired_metrics ? thread_metrics_list : metrics->next) {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            counters[i] += atomic_load_explicit(&metrics->counters[i], memory_order_relaxed);
+        }
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                histograms[m][b] += atomic_load_explicit(&metrics->histograms[m][b], memory_order_relaxed);
+            }
+            unsigned long max = atomic_load_explicit(&metrics->latency_max[m], memory_order_relaxed);
+            if (max > latency_max[m]) latency_max[m] = max;
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    double uptime = elapsed_seconds(&server_started);
+    if (uptime <= 0) uptime = 1e-6;
+
+    size_t len = snprintf(text, size,
+                          "uptime_seconds: %.0f\r\n"
+                          "connections_active: %ld\r\n"
+                          "connections_total: %lu\r\n"
+                          "messages_stored: %lu\r\n"
+                          "messages_per_second: %.1f\r\n"
+                          "deliveries: %lu\r\n"
+                          "bytes_received: %lu\r\n"
+                          "bytes_sent: %lu\r\n"
+                          "connections_rejected: %lu\r\n"
+                          "connections_timed_out: %lu\r\n"
+                          "mailbox_lock_stripes: %d\r\n"
+                          "mailbox_lock_acquired: %lu\r\n"
+                          "mailbox_lock_contended: %lu\r\n"
+                          "journal_records: %lu\r\n"
+                          "journal_syncs: %lu\r\n"
+                          "compressed_bytes_in: %lu\r\n"
+                          "compressed_bytes_out: %lu\r\n"
+                          "emails_deleted: %lu\r\n"
+                          "compactions: %lu\r\n"
+                          "compacted_bytes: %lu\r\n"
+                          "blobs_collected: %lu\r\n"
+                          "log_dropped: %lu\r\n",
+                          uptime,
+                          atomic_load(&active_connections),
+                          counters[COUNTER_CONNECTIONS],
+                          counters[COUNTER_MESSAGES],
+                          counters[COUNTER_MESSAGES] / uptime,
+                          counters[COUNTER_DELIVERIES],
+                          counters[COUNTER_BYTES_RECEIVED],
+                          counters[COUNTER_BYTES_SENT],
+                          counters[COUNTER_REJECTED],
+                          counters[COUNTER_TIMEOUTS],
+                          MAILBOX_LOCK_STRIPES,
+                          atomic_load(&mailbox_lock_acquired),
+                          atomic_load(&mailbox_lock_contended),
+                          atomic_load(&journal_records),
+                          atomic_load(&journal_syncs),
+                          atomic_load(&compress_bytes_in),
+                          atomic_load(&compress_bytes_out),
+                          atomic_load(&emails_deleted),
+                          atomic_load(&compactions),
+                          atomic_load(&compacted_bytes),
+                          atomic_load(&blobs_collected),
+                          atomic_load(&log_dropped));
+
+    for (int m = 0; m < METRIC_COUNT && len < size; m++) {
+        unsigned long count = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) count += histograms[m][b];
+        if (count == 0) continue;
+
+        len += snprintf(text + len, size - len,
+                        "latency_us_%s: count=%lu p50=%lu p99=%lu p999=%lu max=%lu\r\n",
+                        metric_names[m], count,
+                        histogram_percentile(histograms[m], count, 50.0, latency_max[m]),
+                        histogram_percentile(histograms[m], count, 99.0, latency_max[m]),
+                        histogram_percentile(histograms[m], count, 99.9, latency_max[m]),
+                        latency_max[m]);
+    }
+
+    len += session_format(text + len, size - len);
+    len += cache_format(text + len, size - len);
+    len += repl_format(text + len, size - len);
+
+    // Per-shard view; each shard's counters are its own thread's metrics
+    for (int i = 0; shards && i < shard_count && len < size; i++) {
+        ThreadMetrics *metrics = shards[i].metrics;
+        if (!metrics) continue;
+        len += snprintf(text + len, size - len,
+                        "shard_%d: cpu=%d active=%ld connections=%lu messages=%lu "
+                        "bytes_received=%lu bytes_sent=%lu\r\n",
+                        i, shards[i].cpu, atomic_load(&shards[i].active),
+                        atomic_load_explicit(&metrics->counters[COUNTER_CONNECTIONS], memory_order_relaxed),
+                        atomic_load_explicit(&metrics->counters[COUNTER_MESSAGES], memory_order_relaxed),
+                        atomic_load_explicit(&metrics->counters[COUNTER_BYTES_RECEIVED], memory_order_relaxed),
+                        atomic_load_explicit(&metrics->counters[COUNTER_BYTES_SENT], memory_order_relaxed));
+    }
+
+    free(histograms);
+    return len < size ? len : size - 1;
+}
+
+void *metrics_server(void *arg) {
+    // Answers every connection on 127.0.0.1:<metrics_port> with the metrics
+    // report and closes it
+    (void)arg;
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket < 0) {
+        log_message(LOG_ERROR, 0, "Error creating metrics socket: %s", strerror(errno));
+        return NULL;
+    }
+
+    int opt = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(metrics_port);
+    if (bind(server_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server_socket, MAX_CLIENTS) < 0) {
+        log_message(LOG_ERROR, 0, "Error opening metrics port: %s", strerror(errno));
+        close(server_socket);
+        return NULL;
+    }
+
+    log_message(LOG_INFO, 0, "Metrics on 127.0.0.1:%d", metrics_port);
+
+    char text[METRICS_TEXT_SIZE];
+    while (1) {
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket < 0) {
+            if (errno != EINTR) log_message(LOG_ERROR, 0, "Error accepting metrics connection: %s", strerror(errno));
+            continue;
+        }
+        size_t len = metrics_format(text, sizeof(text));
+        write_all(client_socket, text, len);
+        close(client_socket);
+    }
+    return NULL;
+}
+
+uint32_t elapsed_us(const struct timespec *started) {
+    // Wraps after 71 minutes; for latencies, not for uptime
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started->tv_sec) * 1000000 + (now.tv_nsec - started->tv_nsec) / 1000;
+}
+
+double elapsed_seconds(const struct timespec *started) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+}
+
+void init_mailbox_locks() {
+    // Prefer writers so a stream of LIST/GET_MAIL cannot starve deliveries
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < MAILBOX_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&mailbox_locks[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+pthread_rwlock_t *mailbox_lock_for(const char *email) {
+    // FNV-1a hash of the mailbox name picks the stripe
+    uint32_t hash = fnv1a(2166136261u, email, strlen(email));
+    return &mailbox_locks[hash % MAILBOX_LOCK_STRIPES];
+}
+
+uint32_t fnv1a(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void mailbox_read_lock(pthread_rwlock_t *lock) {
+    // Try first so waits can be counted
+    if (pthread_rwlock_tryrdlock(lock) != 0) {
+        atomic_fetch_add(&mailbox_lock_contended, 1);
+        pthread_rwlock_rdlock(lock);
+    }
+    atomic_fetch_add(&mailbox_lock_acquired, 1);
+}
+
+void mailbox_write_lock(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(lock) != 0) {
+        atomic_fetch_add(&mailbox_lock_contended, 1);
+        pthread_rwlock_wrlock(lock);
+    }
+    atomic_fetch_add(&mailbox_lock_acquired, 1);
+}
+
+void cache_init() {
+    // The shard locks also count the references of uncached items, such as
+    // SEARCH results, so they exist even with the cache off
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+    }
+
+    cache_enabled = cache_size > 0;
+    if (!cache_enabled) return;
+
+    // A single item may take up to half of a shard's share
+    cache_item_limit = cache_size / CACHE_SHARDS / 2;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache_shards[i];
+        shard->table = calloc(CACHE_BUCKETS, sizeof(CacheItem *));
+        shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+        if (!shard->table) {
+            log_message(LOG_ERROR, 0, "Error allocating message cache: %s", strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+uint32_t cache_hash(const char *email, int id) {
+    uint32_t hash = fnv1a(2166136261u, email, strlen(email));
+    return fnv1a(hash, &id, sizeof(id));
+}
+
+CacheItem *cache_new(const char *email, int id) {
+    // The caller holds the only reference until it inserts and releases the item
+    CacheItem *item = calloc(1, sizeof(CacheItem));
+    if (!item) return NULL;
+    snprintf(item->email, sizeof(item->email), "%s", email);
+    item->id = id;
+    item->hash = cache_hash(item->email, id);
+    item->refs = 1;
+    item->charge = sizeof(CacheItem);
+    return item;
+}
+
+CacheItem *cache_lookup(const char *email, int id) {
+    // Returns the item with a reference for the caller to cache_release(), or NULL
+    if (!cache_enabled) return NULL;
+
+    uint32_t hash = cache_hash(email, id);
+    CacheShard *shard = &cache_shards[hash % CACHE_SHARDS];
+    int kind = id ? CACHE_BODY : CACHE_LISTING;
+
+    pthread_mutex_lock(&shard->lock);
+    CacheItem *item = cache_find_locked(shard, email, id, hash);
+    if (item) {
+        // Move to the front of the LRU list
+        item->lru_prev->lru_next = item->lru_next;
+        item->lru_next->lru_prev = item->lru_prev;
+        item->lru_next = shard->lru.lru_next;
+        item->lru_prev = &shard->lru;
+        shard->lru.lru_next->lru_prev = item;
+        shard->lru.lru_next = item;
+
+        item->refs++;
+        shard->hits[kind]++;
+    } else {
+        shard->misses[kind]++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return item;
+}
+
+void cache_release(CacheItem *item) {
+    CacheShard *shard = &cache_shards[item->hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    int last = --item->refs == 0;
+    pthread_mutex_unlock(&shard->lock);
+    if (last) cache_free(item);
+}
+
+void cache_insert(CacheItem *item) {
+    // Adds the item in place of any with the same key. The cache takes its own
+    // reference; the caller still releases the one from cache_new().
+    CacheShard *shard = &cache_shards[item->hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    CacheItem *old = cache_find_locked(shard, item->email, item->id, item->hash);
+    if (old) cache_unlink_locked(shard, old);
+
+    CacheItem **bucket = &shard->table[(item->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    item->hash_next = *bucket;
+    *bucket = item;
+    item->lru_next = shard->lru.lru_next;
+    item->lru_prev = &shard->lru;
+    shard->lru.lru_next->lru_prev = item;
+    shard->lru.lru_next = item;
+    item->refs++;
+    shard->used += item->charge;
+
+    cache_evict_locked(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+CacheItem *cache_find_locked(CacheShard *shard, const char *email, int id, uint32_t hash) {
+    CacheItem *item = shard->table[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (item && (item->hash != hash || item->id != id || strcmp(item->email, email) != 0)) {
+        item = item->hash_next;
+    }
+    return item;
+}
+
+void cache_unlink_locked(CacheShard *shard, CacheItem *item) {
+    // Takes the item out of the cache; users still holding it keep it alive
+    CacheItem **link = &shard->table[(item->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (*link != item) link = &(*link)->hash_next;
+    *link = item->hash_next;
+    item->lru_prev->lru_next = item->lru_next;
+    item->lru_next->lru_prev = item->lru_prev;
+    shard->used -= item->charge;
+    if (--item->refs == 0) cache_free(item);
+}
+
+void cache_evict_locked(CacheShard *shard) {
+    // Drops least recently used items until the shard is within its share
+    while (shard->used > cache_size / CACHE_SHARDS && shard->lru.lru_prev != &shard->lru) {
+        cache_unlink_locked(shard, shard->lru.lru_prev);
+        shard->evictions++;
+    }
+}
+
+void cache_free(CacheItem *item) {
+    free(item->body);
+    free(item->entries);
+    free(item);
+}
+
+void cache_put_body(const char *email, const IndexEntry *entry, char *body) {
+    // Caches an email's decompressed body, taking ownership of the buffer
+    CacheItem *item = NULL;
+    if (cache_enabled && entry->length <= cache_item_limit) {
+        item = cache_new(email, entry->id);
+    }
+    if (!item) {
+        free(body);
+        return;
+    }
+
+    item->entry = *entry;
+    item->body = body;
+    item->charge += entry->length;
+    cache_insert(item);
+    cache_release(item);
+}
+
+void cache_store_spool(const char *email, const IndexEntry *entry, int spool_fd, size_t content_len) {
+    // Caches a newly stored email from its spool file, which the page cache
+    // still holds; the stored copy ends with one more newline
+    if (!cache_enabled || entry->length > cache_item_limit) return;
+
+    char *body = malloc(entry->length);
+    if (!body) return;
+    if (pread_all(spool_fd, body, content_len, 0) != (ssize_t)content_len) {
+        free(body);
+        return;
+    }
+    body[content_len] = '\n';
+    cache_put_body(email, entry, body);
+}
+
+CacheItem *cache_load_listing(const char *email, MailboxIndex *index) {
+    // Reads the whole index into a new cached listing and returns it with a
+    // reference, or NULL. The caller holds the mailbox lock, so no append
+    // can slip in between reading the index and caching it. Deleted entries
+    // are left out.
+    int count = index->header.count;
+    if (!cache_enabled || mailbox_index_live(&index->header) == 0 ||
+        (size_t)count * sizeof(IndexEntry) > cache_item_limit) {
+        return NULL;
+    }
 
-    // Create server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Error creating socket");
-        return 1;
+    CacheItem *item = cache_new(email, 0);
+    if (!item) return NULL;
+    item->entries = malloc(count * sizeof(IndexEntry));
+    if (!item->entries || mailbox_index_read(index, 0, item->entries, count) != count) {
+        cache_free(item);
+        return NULL;
+    }
+    if (index->header.deleted > 0) {
+        int live = 0;
+        for (int i = 0; i < count; i++) {
+            if (!mailbox_index_hidden(&item->entries[i], index->header.deleted)) {
+                item->entries[live++] = item->entries[i];
+            }
+        }
+        count = live;
     }
+    item->count = item->capacity = count;
+    item->charge += count * sizeof(IndexEntry);
+    cache_insert(item);
+    return item;
+}
 
-    // Set socket options to reuse address
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("Error setting socket options");
-        close(server_socket);
-        return 1;
+void cache_append_entry(const char *email, const IndexEntry *entry, int count) {
+    // Adds the entry for a new email to the mailbox's cached listing, if any;
+    // count is the number of live entries in the index including the new one
+    if (!cache_enabled) return;
+
+    uint32_t hash = cache_hash(email, 0);
+    CacheShard *shard = &cache_shards[hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    CacheItem *item = cache_find_locked(shard, email, 0, hash);
+    if (item && (item->count != count - 1 || (size_t)count * sizeof(IndexEntry) > cache_item_limit)) {
+        // Out of step with the index, or grown too large to keep
+        cache_unlink_locked(shard, item);
+    } else if (item) {
+        if (item->count == item->capacity) {
+            int capacity = item->capacity * 2;
+            IndexEntry *entries = realloc(item->entries, capacity * sizeof(IndexEntry));
+            if (!entries) {
+                cache_unlink_locked(shard, item);
+                pthread_mutex_unlock(&shard->lock);
+                return;
+            }
+            size_t added = (capacity - item->capacity) * sizeof(IndexEntry);
+            item->entries = entries;
+            item->capacity = capacity;
+            item->charge += added;
+            shard->used += added;
+        }
+        item->entries[item->count++] = *entry;
+        cache_evict_locked(shard);
     }
+    pthread_mutex_unlock(&shard->lock);
+}
 
-    // Initialize server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+void cache_invalidate(const char *email, int id) {
+    if (!cache_enabled) return;
 
-    // Bind socket to the specified port
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Error binding socket");
-        close(server_socket);
-        return 1;
+    uint32_t hash = cache_hash(email, id);
+    CacheShard *shard = &cache_shards[hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    CacheItem *item = cache_find_locked(shard, email, id, hash);
+    if (item) cache_unlink_locked(shard, item);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_listing_snapshot(CacheItem *item, int since_id, int *first, int *total) {
+    // Gives the current number of entries and, for since_id >= 0, the first
+    // slot with a greater ID. Appends only ever add slots after these.
+    CacheShard *shard = &cache_shards[item->hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    *total = item->count;
+    if (since_id >= 0) {
+        *first = cache_listing_seek_locked(item, since_id + 1);
     }
+    pthread_mutex_unlock(&shard->lock);
+}
 
-    // Listen for incoming connections
-    if (listen(server_socket, MAX_CLIENTS) < 0) {
-        perror("Error listening");
-        close(server_socket);
-        return 1;
+int cache_listing_seek_locked(CacheItem *item, int id) {
+    // The first slot whose ID is at least id, or the count if none
+    int lo = 0;
+    int hi = item->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (item->entries[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    return lo;
+}
 
-    printf("Listening on port %d...\n", port);
+void cache_listing_read(CacheItem *item, int first, IndexEntry *entries, int n) {
+    // Copied under the lock because an append may move the array
+    CacheShard *shard = &cache_shards[item->hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    memcpy(entries, item->entries + first, n * sizeof(IndexEntry));
+    pthread_mutex_unlock(&shard->lock);
+}
 
-    // Create mailbox directory if it doesn't exist
-    create_mailbox_if_not_exists();
+size_t cache_format(char *text, size_t size) {
+    // The cache's lines of the metrics report
+    if (!cache_enabled || size == 0) return 0;
 
-    // Handle SIGINT to gracefully shut down the server
-    signal(SIGINT, (void (*)(int))exit);
+    size_t used = 0;
+    unsigned long hits[2] = {0};
+    unsigned long misses[2] = {0};
+    unsigned long evictions = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        used += shard->used;
+        for (int kind = 0; kind < 2; kind++) {
+            hits[kind] += shard->hits[kind];
+            misses[kind] += shard->misses[kind];
+        }
+        evictions += shard->evictions;
+        pthread_mutex_unlock(&shard->lock);
+    }
 
-    // Accept and handle client connections
-    while (1) {
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            perror("Error accepting connection");
-            continue;
+    size_t len = snprintf(text, size,
+                          "cache_bytes: %zu\r\n"
+                          "cache_size: %zu\r\n"
+                          "cache_body_hits: %lu\r\n"
+                          "cache_body_misses: %lu\r\n"
+                          "cache_listing_hits: %lu\r\n"
+                          "cache_listing_misses: %lu\r\n"
+                          "cache_evictions: %lu\r\n",
+                          used, cache_size, hits[CACHE_BODY], misses[CACHE_BODY],
+                          hits[CACHE_LISTING], misses[CACHE_LISTING], evictions);
+    return len < size ? len : size - 1;
+}
+
+int snapshot_save() {
+    // Writes the cached listings to SNAPSHOT_PATH for the next start, least
+    // recently used first so that loading them keeps their order. Each is
+    // written under its mailbox lock with the index header it matches.
+    if (!cache_enabled) return 0;
+
+    // Every listing is referenced while it is written, so eviction cannot free it
+    int count = 0;
+    int capacity = 64;
+    CacheItem **items = malloc(capacity * sizeof(CacheItem *));
+    if (!items) {
+        log_message(LOG_ERROR, 0, "Error saving snapshot: %s", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (CacheItem *item = shard->lru.lru_prev; item != &shard->lru; item = item->lru_prev) {
+            if (item->id != 0) continue;
+            if (count == capacity) {
+                CacheItem **grown = realloc(items, capacity * 2 * sizeof(CacheItem *));
+                if (!grown) break;
+                items = grown;
+                capacity *= 2;
+            }
+            item->refs++;
+            items[count++] = item;
         }
+        pthread_mutex_unlock(&shard->lock);
+    }
 
-        printf("Client connected: %s\n", inet_ntoa(client_addr.sin_addr));
+    char tmp_path[64];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", SNAPSHOT_PATH);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) log_message(LOG_ERROR, 0, "Error creating snapshot: %s", strerror(errno));
 
-        // Create a new thread to handle the client
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = client_socket;
-        
-        if (pthread_create(&thread_id, NULL, handle_client, (void *)client_sock) != 0) {
-            perror("Error creating thread");
-            free(client_sock);
-            close(client_socket);
-        } else {
-            pthread_detach(thread_id);
+    SnapshotHeader header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, 0 };
+    int status = fd >= 0 && write_all(fd, (char *)&header, sizeof(header)) == sizeof(header) ? 0 : -1;
+    for (int i = 0; i < count; i++) {
+        CacheItem *item = items[i];
+        pthread_rwlock_t *lock = mailbox_lock_for(item->email);
+        mailbox_read_lock(lock);
+
+        // A listing dropped from the cache may no longer match the index
+        CacheShard *shard = &cache_shards[item->hash % CACHE_SHARDS];
+        pthread_mutex_lock(&shard->lock);
+        int cached = cache_find_locked(shard, item->email, 0, item->hash) == item;
+        pthread_mutex_unlock(&shard->lock);
+
+        MailboxIndex index;
+        if (status == 0 && cached && mailbox_index_open(item->email, &index, 0) == 0) {
+            if (mailbox_index_live(&index.header) == item->count) {
+                SnapshotListing listing;
+                memset(&listing, 0, sizeof(listing));
+                snprintf(listing.email, sizeof(listing.email), "%s", item->email);
+                listing.header = index.header;
+                size_t len = item->count * sizeof(IndexEntry);
+                if (write_all(fd, (char *)&listing, sizeof(listing)) != sizeof(listing) ||
+                    write_all(fd, (char *)item->entries, len) != (ssize_t)len) {
+                    status = -1;
+                }
+                header.count++;
+            }
+            mailbox_index_close(&index);
         }
+        pthread_rwlock_unlock(lock);
+        cache_release(item);
+    }
+    free(items);
+
+    if (status == 0 && pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        status = -1;
+    }
+    if (fd >= 0) close(fd);
+    if (status != 0 || rename(tmp_path, SNAPSHOT_PATH) < 0) {
+        if (fd >= 0) log_message(LOG_ERROR, 0, "Error saving snapshot: %s", strerror(errno));
+        unlink(tmp_path);
+        return -1;
     }
 
-    // Close server socket
-    close(server_socket);
+    log_message(LOG_INFO, 0, "Saved %d cached listings to %s", header.count, SNAPSHOT_PATH);
     return 0;
 }
 
-void *handle_client(void *arg) {
-    int client_socket = *((int *)arg);
-    free(arg);
-    
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    ClientState state = {0};
+void snapshot_load() {
+    // Seeds the cache with the listings the last clean shutdown saved. The
+    // file is mapped rather than read, and each listing costs one index
+    // header read to validate, so this takes time in proportion to the cache
+    // rather than the mail stored. A snapshot is only ever loaded once.
+    int fd = open(SNAPSHOT_PATH, O_RDONLY);
+    if (fd < 0) return;
 
-    // Send welcome message
-    send_response(client_socket, OK);
-
-    while ((bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_read] = '\0';
-        
-        // Remove trailing newline
-        char *newline = strchr(buffer, '\n');
-        if (newline) *newline = '\0';
-        
-        // Remove carriage return if present
-        newline = strchr(buffer, '\r');
-        if (newline) *newline = '\0';
-
-        printf("Received: %s\n", buffer);
-
-        // Parse command
-        char command[16] = {0};
-        char argument[BUFFER_SIZE] = {0};
-        
-        if (sscanf(buffer, "%15s %[^\n]", command, argument) < 1) {
-            send_response(client_socket, ERR_SYNTAX);
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (cache_enabled && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapshotHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    unlink(SNAPSHOT_PATH);
+    if (map == MAP_FAILED) return;
+
+    size_t size = st.st_size;
+    const char *base = map;
+    const SnapshotHeader *header = map;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    int loaded = 0;
+    int stale = 0;
+    size_t offset = sizeof(SnapshotHeader);
+    for (int i = 0; header->magic == SNAPSHOT_MAGIC && header->version == SNAPSHOT_VERSION &&
+                    i < header->count && offset + sizeof(SnapshotListing) <= size; i++) {
+        const SnapshotListing *listing = (const SnapshotListing *)(base + offset);
+        offset += sizeof(SnapshotListing);
+        int live = mailbox_index_live(&listing->header);
+        size_t len = (size_t)live * sizeof(IndexEntry);
+        if (live <= 0 || len > size - offset) break;
+        const IndexEntry *entries = (const IndexEntry *)(base + offset);
+        offset += len;
+
+        // Only a mailbox untouched since the snapshot still has the same header
+        char email[256];
+        snprintf(email, sizeof(email), "%.*s", (int)sizeof(listing->email) - 1, listing->email);
+        MailboxIndex index;
+        int current = 0;
+        if (mailbox_index_open(email, &index, 0) == 0) {
+            current = memcmp(&index.header, &listing->header, sizeof(IndexHeader)) == 0;
+            mailbox_index_close(&index);
+        }
+        if (!current || len > cache_item_limit) {
+            stale++;
             continue;
         }
 
-        // Handle commands
-        if (strcmp(command, "HELO") == 0) {
-            handle_helo(client_socket, argument, &state);
-        } else if (strcmp(command, "MAIL") == 0) {
-            // Extract email from "MAIL FROM: <email>"
-            char email[256] = {0};
-            if (sscanf(argument, "FROM: %255s", email) == 1) {
-                handle_mail_from(client_socket, email, &state);
-            } else {
-                send_response(client_socket, ERR_SYNTAX);
-            }
-        } else if (strcmp(command, "RCPT") == 0) {
-            // Extract email from "RCPT TO: <email>"
-            char email[256] = {0};
-            if (sscanf(argument, "TO: %255s", email) == 1) {
-                handle_rcpt_to(client_socket, email, &state);
-            } else {
-                send_response(client_socket, ERR_SYNTAX);
-            }
-        } else if (strcmp(command, "DATA") == 0) {
-            handle_data(client_socket, &state);
-        } else if (strcmp(command, "LIST") == 0) {
-            handle_list(client_socket, argument);
-        } else if (strcmp(command, "GET_MAIL") == 0) {
-            char email[256] = {0};
-            int id;
-            if (sscanf(argument, "%255s %d", email, &id) == 2) {
-                handle_get_mail(client_socket, email, id);
-            } else {
-                send_response(client_socket, ERR_SYNTAX);
-            }
-        } else if (strcmp(command, "QUIT") == 0) {
-            handle_quit(client_socket);
+        CacheItem *item = cache_new(email, 0);
+        if (!item) break;
+        item->entries = malloc(len);
+        if (!item->entries) {
+            cache_free(item);
             break;
-        } else {
-            send_response(client_socket, ERR_SYNTAX);
         }
+        memcpy(item->entries, entries, len);
+        item->count = item->capacity = live;
+        item->charge += len;
+        cache_insert(item);
+        cache_release(item);
+        loaded++;
     }
+    munmap(map, size);
 
-    if (bytes_read <= 0) {
-        if (bytes_read < 0) {
-            perror("Error reading from socket");
-        }
-        printf("Client disconnected\n");
+    log_message(LOG_INFO, 0, "Loaded %d cached listings from %s (%d out of date)", loaded, SNAPSHOT_PATH, stale);
+}
+
+Connection *connection_create(int fd) {
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (!conn) return NULL;
+    session_memory(sizeof(Connection));
+
+    conn->id = atomic_fetch_add(&next_connection_id, 1) + 1;
+    atomic_fetch_add(&active_connections, 1);
+    conn->shard = current_shard;
+    if (conn->shard) atomic_fetch_add(&conn->shard->active, 1);
+    metrics_count(COUNTER_CONNECTIONS, 1);
+    conn->fd = fd;
+    conn->phase = PHASE_COMMAND;
+    conn->spool_fd = -1;
+    conn->file_fd = -1;
+    conn->list_fd = -1;
+    conn->batch_fd = -1;
+    connection_timer_start(conn);
+    session_list_add(conn);
+    return conn;
+}
+
+void connection_destroy(Connection *conn) {
+    // A session that goes away while its reply is held back leaves the wait list
+    commit_waiters_remove(conn);
+    connection_timer_stop(conn);
+    session_list_remove(conn);
+
+    // Closing the descriptor also drops it from any epoll set
+    close(conn->fd);
+    atomic_fetch_sub(&active_connections, 1);
+    if (conn->shard) atomic_fetch_sub(&conn->shard->active, 1);
+    if (conn->spool_fd >= 0) close(conn->spool_fd);
+    if (conn->file_fd >= 0) close(conn->file_fd);
+    list_close(conn);
+
+    // Whatever is still buffered is dropped with the session
+    conn->file_fd = -1;
+    conn->rlen = conn->wlen = 0;
+    connection_trim(conn);
+    client_state_reset(&conn->state);
+    session_memory(-(long)sizeof(Connection));
+    free(conn);
+}
+
+int connection_read_buffer(Connection *conn) {
+    // Gives the session a read buffer before a recv(); -1 if none is left
+    if (conn->rbuf) return 0;
+    conn->rbuf = buffer_get();
+    if (!conn->rbuf) {
+        log_message(LOG_ERROR, conn->id, "Error allocating read buffer: %s", strerror(errno));
+        return -1;
     }
+    session_memory(BUFFER_SIZE);
+    return 0;
+}
 
-    close(client_socket);
-    return NULL;
+void connection_trim(Connection *conn) {
+    // Gives back the buffers the session holds nothing in; called where it
+    // waits for input, so an idle session costs only its Connection
+    if (conn->rbuf && conn->rlen == 0) {
+        buffer_put(conn->rbuf, BUFFER_SIZE);
+        session_memory(-BUFFER_SIZE);
+        conn->rbuf = NULL;
+    }
+    if (conn->wbuf && conn->wlen == 0) {
+        buffer_put(conn->wbuf, conn->wcap);
+        session_memory(-(long)conn->wcap);
+        conn->wbuf = NULL;
+        conn->wcap = 0;
+    }
+    if (conn->fbuf && conn->file_fd < 0) {
+        free(conn->fbuf);
+        session_memory(-FILE_CHUNK);
+        conn->fbuf = NULL;
+        conn->flen = conn->fsent = 0;
+    }
 }
 
-void handle_helo(int client_socket, char *client_id, ClientState *state) {
-    printf("HELO received from %s\n", client_id);
-    state->is_authenticated = 1;
-    send_response(client_socket, OK);
+char *buffer_get() {
+    // A BUFFER_SIZE buffer from this thread's pool, or a new one
+    BufferPool *pool = &buffer_pool;
+    if (!pool->head) return malloc(BUFFER_SIZE);
+
+    char *buf = pool->head;
+    memcpy(&pool->head, buf, sizeof(char *));
+    pool->count--;
+    atomic_fetch_sub(&pooled_bytes, BUFFER_SIZE);
+    return buf;
 }
 
-void handle_mail_from(int client_socket, char *sender, ClientState *state) {
-    if (!state->is_authenticated) {
-        send_response(client_socket, ERR_FORBIDDEN);
+void buffer_put(char *buf, size_t size) {
+    // Keeps a BUFFER_SIZE buffer for reuse while the pool has room; replies
+    // that outgrew one go back to malloc
+    BufferPool *pool = &buffer_pool;
+    if (size != BUFFER_SIZE || pool->count >= pool->keep) {
+        free(buf);
         return;
     }
 
-    printf("MAIL FROM: %s\n", sender);
-    strcpy(state->sender, sender);
-    state->has_sender = 1;
-    send_response(client_socket, OK);
+    memcpy(buf, &pool->head, sizeof(char *));
+    pool->head = buf;
+    pool->count++;
+    atomic_fetch_add(&pooled_bytes, BUFFER_SIZE);
 }
 
-void handle_rcpt_to(int client_socket, char *recipient, ClientState *state) {
-    if (!state->is_authenticated || !state->has_sender) {
-        send_response(client_socket, ERR_FORBIDDEN);
+void session_memory(long delta) {
+    atomic_fetch_add_explicit(&session_bytes, delta, memory_order_relaxed);
+}
+
+size_t session_format(char *text, size_t size) {
+    // The session memory lines of the metrics report. An idle session on an
+    // event loop holds just its Connection; in thread mode it also keeps a
+    // worker, with its stack and the read buffer its recv() waits on.
+    if (size == 0) return 0;
+    long idle = sizeof(Connection);
+    if (server_mode == MODE_THREADS) idle += BUFFER_SIZE + SESSION_STACK_SIZE;
+
+    size_t len = snprintf(text, size,
+                          "session_bytes: %ld\r\n"
+                          "bytes_per_idle_session: %ld\r\n"
+                          "buffer_pool_bytes: %ld\r\n",
+                          atomic_load(&session_bytes), idle, atomic_load(&pooled_bytes));
+    return len < size ? len : size - 1;
+}
+
+int thread_create(pthread_t *thread, size_t stack_size, void *(*start)(void *), void *arg) {
+    // pthread_create() with an explicit stack size instead of the default
+    // reservation (8MB with most limits); returns its error number
+    pthread_attr_t attr;
+    int status = pthread_attr_init(&attr);
+    if (status != 0) return status;
+    status = pthread_attr_setstacksize(&attr, stack_size);
+    if (status == 0) status = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    return status;
+}
+
+void send_response(Connection *conn, const char *response) {
+    send_bytes(conn, response, strlen(response));
+}
+
+void send_bytes(Connection *conn, const char *data, size_t len) {
+    if (conn->wlen + len > conn->wcap) {
+        size_t new_cap = conn->wcap ? conn->wcap : BUFFER_SIZE;
+        while (new_cap < conn->wlen + len) new_cap *= 2;
+
+        // Replies that fit one buffer take it from the pool
+        char *new_buf = new_cap == BUFFER_SIZE ? buffer_get() : realloc(conn->wbuf, new_cap);
+        if (!new_buf) {
+            log_message(LOG_ERROR, conn->id, "Error queueing response: %s", strerror(errno));
+            return;
+        }
+        session_memory(new_cap - conn->wcap);
+        conn->wbuf = new_buf;
+        conn->wcap = new_cap;
+    }
+
+    memcpy(conn->wbuf + conn->wlen, data, len);
+    conn->wlen += len;
+}
+
+void send_file_region(Connection *conn, int fd, off_t offset, size_t len) {
+    // Takes ownership of fd; the region is sent once wbuf has drained
+    if (len == 0) {
+        close(fd);
         return;
     }
+    conn->file_fd = fd;
+    conn->file_offset = offset;
+    conn->file_remaining = len;
+}
 
-    printf("RCPT TO: %s\n", recipient);
-    strcpy(state->recipient, recipient);
-    state->has_recipient = 1;
-    send_response(client_socket, OK);
+int connection_waiting(Connection *conn) {
+    // A reply that must go out before any later command is processed
+    return conn->file_fd >= 0 || connection_listing(conn) || conn->commit_seq != 0;
 }
 
-void handle_data(int client_socket, ClientState *state) {
-    if (!state->is_authenticated || !state->has_sender || !state->has_recipient) {
-        send_response(client_socket, ERR_FORBIDDEN);
+int connection_listing(Connection *conn) {
+    // A LIST reply is still being generated
+    return conn->list_fd >= 0 || conn->list_item != NULL;
+}
+
+void connection_defer_reply(Connection *conn, uint64_t seq, const char *reply) {
+    if (server_mode == MODE_THREADS) {
+        // A session thread can simply block until its batch is synced
+        journal_wait(seq);
+        send_response(conn, reply);
         return;
     }
 
-    printf("DATA received...\n");
-    
-    // Tell client to start sending data
-    send_response(client_socket, "354 Start mail input; end with a single dot '.'\r\n");
-    
-    char email_content[MAX_EMAIL_SIZE] = {0};
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    int content_length = 0;
-    
-    // Add metadata to email
-    char date[64];
-    strcpy(date, get_current_date());
-    content_length += snprintf(email_content + content_length, 
-                              MAX_EMAIL_SIZE - content_length,
-                              "From: %s\nDate: %s\n", 
-                              state->sender, date);
-    
-    // Read email content until single dot
-    while ((bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_read] = '\0';
-        
-        // Check for single dot
-        if (strcmp(buffer, ".\r\n") == 0 || strcmp(buffer, ".\n") == 0) {
-            break;
-        }
-        
-        // Append to email content
-        if (content_length + bytes_read < MAX_EMAIL_SIZE) {
-            strcat(email_content, buffer);
-            content_length += bytes_read;
-        } else {
-            // Email too large
-            send_response(client_socket, ERR_SERVER);
-            return;
+    // The event loop must not block: park the reply until the commit thread
+    // reports the batch durable
+    conn->commit_seq = seq;
+    snprintf(conn->commit_reply, sizeof(conn->commit_reply), "%s", reply);
+    conn->commit_next = commit_waiters;
+    commit_waiters = conn;
+}
+
+void commit_waiters_remove(Connection *conn) {
+    if (!conn->commit_seq) return;
+    Connection **link = &commit_waiters;
+    while (*link && *link != conn) link = &(*link)->commit_next;
+    if (*link) *link = conn->commit_next;
+    conn->commit_seq = 0;
+}
+
+void timer_wheel_init(TimerWheel *wheel, int shared, void (*expire)(TimerWheel *, Timer *)) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = timer_now();
+    wheel->shared = shared;
+    wheel->expire = expire;
+    pthread_mutex_init(&wheel->lock, NULL);
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            Timer *head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
         }
     }
-    
-    // Save the email
-    save_email(state->recipient, state->sender, email_content);
-    
-    printf("Message stored.\n");
-    send_response(client_socket, "200 Message stored successfully\r\n");
-    
-    // Reset state for next email
-    state->has_sender = 0;
-    state->has_recipient = 0;
-    memset(state->sender, 0, sizeof(state->sender));
-    memset(state->recipient, 0, sizeof(state->recipient));
 }
 
-void handle_list(int client_socket, char *email) {
-    printf("LIST %s\n", email);
-    
-    // Construct the path to the mailbox file
-    char mailbox_path[512];
-    snprintf(mailbox_path, sizeof(mailbox_path), "%s/%s.txt", MAILBOX_DIR, email);
-    
-    // Open the mailbox file
-    FILE *mailbox = fopen(mailbox_path, "r");
-    if (!mailbox) {
-        if (errno == ENOENT) {
-            // Mailbox doesn't exist
-            send_response(client_socket, "200 OK\r\nNo emails found.\r\n");
-        } else {
-            perror("Error opening mailbox");
-            send_response(client_socket, ERR_SERVER);
-        }
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires) {
+    // (Re)arms the timer to fire at the first tick processed at or after expires
+    if (timer->next) timer_cancel(wheel, timer);
+    if (expires <= wheel->now) expires = wheel->now + 1;
+    if (expires - wheel->now > TIMER_MAX_TICKS) expires = wheel->now + TIMER_MAX_TICKS;
+    timer->expires = expires;
+    timer_place(wheel, timer);
+    wheel->count++;
+}
+
+void timer_place(TimerWheel *wheel, Timer *timer) {
+    // Files the timer in the lowest level whose tick bits above it agree with now
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 &&
+           (timer->expires ^ wheel->now) >> (TIMER_LEVEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    Timer *head = &wheel->slots[level][(timer->expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (!timer->next) return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    wheel->count--;
+}
+
+void timer_advance(TimerWheel *wheel, uint64_t target) {
+    // Processes every tick up to target, firing the timers due
+    if (wheel->count == 0 && target > wheel->now) {
+        wheel->now = target;
         return;
     }
-    
-    char response[BUFFER_SIZE] = "200 OK\r\n";
-    char line[BUFFER_SIZE];
-    int email_id = 0;
-    char sender[256];
-    char date[64];
-    int found = 0;
-    
-    while (fgets(line, sizeof(line), mailbox)) {
-        if (strncmp(line, "--- Email ID:", 13) == 0) {
-            sscanf(line, "--- Email ID: %d ---", &email_id);
-            found = 1;
-        } else if (strncmp(line, "From:", 5) == 0 && found) {
-            sscanf(line, "From: %s", sender);
-            found = 2;
-        } else if (strncmp(line, "Date:", 5) == 0 && found == 2) {
-            sscanf(line, "Date: %[^\n]", date);
-            
-            char email_info[512];
-            snprintf(email_info, sizeof(email_info), "%d: Email from %s (%s)\r\n", 
-                    email_id, sender, date);
-            strcat(response, email_info);
-            
-            found = 0;
+
+    while (wheel->now < target) {
+        wheel->now++;
+
+        // Refile the upper level slots that the new tick starts
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if (wheel->now & ((1ULL << (TIMER_LEVEL_BITS * level)) - 1)) break;
+            Timer *head = &wheel->slots[level][(wheel->now >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+            Timer *timer = head->next;
+            head->next = head->prev = head;
+            while (timer != head) {
+                Timer *next = timer->next;
+                timer_place(wheel, timer);
+                timer = next;
+            }
+        }
+
+        Timer *head = &wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            timer_cancel(wheel, timer);
+            wheel->expire(wheel, timer);
         }
     }
-    
-    fclose(mailbox);
-    
-    if (strlen(response) <= 10) { // Just "200 OK\r\n"
-        strcat(response, "No emails found.\r\n");
+}
+
+uint64_t timer_now() {
+    // Ticks since the server started; the coarse clock is a plain memory read
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    int64_t ms = (now.tv_sec - server_started.tv_sec) * 1000 +
+                 (now.tv_nsec - server_started.tv_nsec) / 1000000;
+    return ms > 0 ? ms / TIMER_TICK_MS : 0;
+}
+
+void *timer_main(void *arg) {
+    // Thread mode: drives the shared wheel
+    (void)arg;
+    while (1) {
+        usleep(TIMER_TICK_MS * 1000);
+        pthread_mutex_lock(&session_wheel.lock);
+        timer_advance(&session_wheel, timer_now());
+        pthread_mutex_unlock(&session_wheel.lock);
     }
-    
-    printf("Emails retrieved; list sent.\n");
-    send_response(client_socket, response);
+    return NULL;
 }
 
-void handle_get_mail(int client_socket, char *email, int id) {
-    printf("GET_MAIL %s %d\n", email, id);
-    
-    // Construct the path to the mailbox file
-    char mailbox_path[512];
-    snprintf(mailbox_path, sizeof(mailbox_path), "%s/%s.txt", MAILBOX_DIR, email);
-    
-    // Open the mailbox file
-    FILE *mailbox = fopen(mailbox_path, "r");
-    if (!mailbox) {
-        if (errno == ENOENT) {
-            // Mailbox doesn't exist
-            send_response(client_socket, ERR_NOT_FOUND);
+void connection_touch(Connection *conn) {
+    // The session made progress: push its deadline out. The timer itself is
+    // only moved when it fires early, so this costs no wheel operation.
+    if (!conn->wheel) return;
+    int seconds = conn->phase == PHASE_DATA ? data_timeout : idle_timeout;
+    uint64_t deadline = seconds ? timer_now() + (uint64_t)seconds * 1000 / TIMER_TICK_MS : UINT64_MAX;
+    atomic_store_explicit(&conn->deadline, deadline, memory_order_relaxed);
+}
+
+void connection_timer_start(Connection *conn) {
+    conn->wheel = current_wheel ? current_wheel : (idle_timeout || data_timeout) ? &session_wheel : NULL;
+    if (!conn->wheel) return;
+    connection_touch(conn);
+
+    if (conn->wheel->shared) pthread_mutex_lock(&conn->wheel->lock);
+    timer_arm(conn->wheel, &conn->timer, atomic_load_explicit(&conn->deadline, memory_order_relaxed));
+    if (conn->wheel->shared) pthread_mutex_unlock(&conn->wheel->lock);
+}
+
+void connection_timer_stop(Connection *conn) {
+    // Once this returns the timer thread no longer refers to the session
+    if (!conn->wheel) return;
+    if (conn->wheel->shared) pthread_mutex_lock(&conn->wheel->lock);
+    timer_cancel(conn->wheel, &conn->timer);
+    if (conn->wheel->shared) pthread_mutex_unlock(&conn->wheel->lock);
+}
+
+void connection_timer_expired(TimerWheel *wheel, Timer *timer) {
+    // Runs on the thread driving the wheel (under its lock if shared)
+    Connection *conn = (Connection *)((char *)timer - offsetof(Connection, timer));
+    struct linger reset = { 1, 0 };  // Close with a reset, discarding unsent output
+
+    // A session waiting on the journal is held up by the server, not the client
+    if (conn->commit_seq) connection_touch(conn);
+
+    uint64_t deadline = atomic_load_explicit(&conn->deadline, memory_order_relaxed);
+    if (deadline > wheel->now) {
+        timer_arm(wheel, timer, deadline);
+        return;
+    }
+
+    if (wheel->shared) {
+        // The session thread is blocked in recv() or send(): end the read so
+        // it can send the timeout reply, and if it is stuck sending, cut the
+        // connection on the next expiry
+        int again = atomic_exchange(&conn->timed_out, 1);
+        if (again) {
+            setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
         } else {
-            perror("Error opening mailbox");
-            send_response(client_socket, ERR_SERVER);
+            metrics_count(COUNTER_TIMEOUTS, 1);
         }
+        shutdown(conn->fd, again ? SHUT_RDWR : SHUT_RD);
+        timer_arm(wheel, timer, wheel->now + (uint64_t)(idle_timeout ? idle_timeout : data_timeout) * 1000 / TIMER_TICK_MS);
         return;
     }
-    
-    char line[BUFFER_SIZE];
-    char email_content[MAX_EMAIL_SIZE] = "200 OK\r\n";
-    int current_id = 0;
-    int found = 0;
-    int in_email = 0;
-    
-    while (fgets(line, sizeof(line), mailbox)) {
-        if (strncmp(line, "--- Email ID:", 13) == 0) {
-            sscanf(line, "--- Email ID: %d ---", &current_id);
-            if (current_id == id) {
-                found = 1;
-                in_email = 1;
-            } else if (in_email) {
-                break; // We've moved past the requested email
-            }
-        } else if (found && in_email) {
-            if (strncmp(line, "--- End Email", 13) == 0) {
-                in_email = 0;
-            } else {
-                strcat(email_content, line);
-            }
-        }
+
+    // Say why, unless a reply is stuck behind a client that is not reading,
+    // then drop the session like a dead peer
+    log_message(LOG_INFO, conn->id, "Session timed out");
+    metrics_count(COUNTER_TIMEOUTS, 1);
+    if (connection_output_pending(conn)) {
+        setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    } else {
+        send(conn->fd, ERR_TIMEOUT, strlen(ERR_TIMEOUT), MSG_NOSIGNAL | MSG_DONTWAIT);
     }
-    
-    fclose(mailbox);
-    
-    if (found) {
-        printf("Email with id %d sent.\n", id);
-        send_response(client_socket, email_content);
+    conn->closing = 1;
+    if (current_ring) {
+        uring_complete(conn, URING_RECV, -ETIMEDOUT);
+        uring_pump(conn);
     } else {
-        printf("Email with id %d not found.\n", id);
-        send_response(client_socket, ERR_NOT_FOUND);
+        connection_destroy(conn);
     }
 }
 
-void handle_quit(int client_socket) {
-    printf("Client requested QUIT\n");
-    send_response(client_socket, "200 Goodbye\r\n");
+int connection_output_pending(Connection *conn) {
+    return conn->wsent < conn->wlen || conn->file_fd >= 0 || connection_listing(conn);
 }
 
-void create_mailbox_if_not_exists() {
-    struct stat st = {0};
-    if (stat(MAILBOX_DIR, &st) == -1) {
-        if (mkdir(MAILBOX_DIR, 0700) == -1) {
-            perror("Error creating mailbox directory");
-            exit(1);
-        }
-        printf("Created mailbox directory\n");
+int connection_flush(Connection *conn) {
+    // Returns 0 when everything is written or the socket is full, -1 on error
+    while (1) {
+        if (connection_flush_buffers(conn) < 0) return -1;
+        if (conn->wsent < conn->wlen || conn->file_fd >= 0 || !connection_listing(conn)) return 0;
+
+        // The socket took everything so far: generate the next part of a LIST
+        list_continue(conn);
     }
 }
 
-void save_email(const char *recipient, const char *sender, const char *content) {
-    pthread_mutex_lock(&mailbox_mutex);
-    
-    // Construct the path to the mailbox file
-    char mailbox_path[512];
-    snprintf(mailbox_path, sizeof(mailbox_path), "%s/%s.txt", MAILBOX_DIR, recipient);
-    
-    // Open the mailbox file in append mode
-    FILE *mailbox = fopen(mailbox_path, "a+");
-    if (!mailbox) {
-        perror("Error opening mailbox");
-        pthread_mutex_unlock(&mailbox_mutex);
-        return;
+int connection_flush_buffers(Connection *conn) {
+    // Writes wbuf and then the file region until done or the socket is full
+    while (conn->wsent < conn->wlen) {
+        // A reply header followed by a file region or more of a stream goes
+        // out with the bytes after it instead of as a lone small segment held
+        // back by Nagle
+        int more = conn->file_fd >= 0 || connection_listing(conn) ? MSG_MORE : 0;
+        ssize_t sent = send(conn->fd, conn->wbuf + conn->wsent,
+                            conn->wlen - conn->wsent, MSG_NOSIGNAL | more);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_message(LOG_ERROR, conn->id, "Error sending response: %s", strerror(errno));
+            return -1;
+        }
+        conn->wsent += sent;
+        connection_touch(conn);
+        metrics_count(COUNTER_BYTES_SENT, sent);
     }
-    
-    // Determine the email ID
-    int email_id = 1;
-    char line[BUFFER_SIZE];
-    
-    // Go to the beginning of the file
-    fseek(mailbox, 0, SEEK_SET);
-    
-    while (fgets(line, sizeof(line), mailbox)) {
-        if (strncmp(line, "--- Email ID:", 13) == 0) {
-            int id;
-            if (sscanf(line, "--- Email ID: %d ---", &id) == 1) {
-                if (id >= email_id) {
-                    email_id = id + 1;
-                }
-            }
+
+    conn->wlen = 0;
+    conn->wsent = 0;
+
+    // Stream the file region straight from the page cache
+    while (conn->file_fd >= 0 && conn->file_remaining > 0) {
+        ssize_t sent = sendfile(conn->fd, conn->file_fd, &conn->file_offset, conn->file_remaining);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_message(LOG_ERROR, conn->id, "Error sending email: %s", strerror(errno));
+            return -1;
+        }
+        if (sent == 0) {
+            // The file is shorter than the index claims
+            log_message(LOG_ERROR, conn->id, "Error sending email: unexpected end of mailbox");
+            return -1;
         }
+        conn->file_remaining -= sent;
+        connection_touch(conn);
+        metrics_count(COUNTER_BYTES_SENT, sent);
     }
-    
-    // Go to the end of the file
-    fseek(mailbox, 0, SEEK_END);
-    
-    // Write the email with ID and delimiter
-    fprintf(mailbox, "\n--- Email ID: %d ---\n", email_id);
-    fprintf(mailbox, "%s", content);
-    fprintf(mailbox, "\n--- End Email ID: %d ---\n", email_id);
-    
-    fclose(mailbox);
-    pthread_mutex_unlock(&mailbox_mutex);
+
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    return 0;
 }
 
-char *get_current_date() {
-    static char date_str[64];
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    
-    strftime(date_str, sizeof(date_str), "%d-%m-%Y", t);
-    return date_str;
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t write_all(int fd, const char *data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+ssize_t read_all(int fd, char *data, size_t len) {
+    // Returns len, fewer bytes if the peer closed the connection, or -1
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, data + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
 }
 
-void send_response(int client_socket, const char *response) {
-    if (send(client_socket, response, strlen(response), 0) < 0) {
-        perror("Error sending response");
+ssize_t pread_all(int fd, char *data, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, data + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
     }
-}
\ No newline at end of file
+    return done;
+}